@@ -0,0 +1,290 @@
+// Hosted build of the buddy allocator and page table walker in src/mm.h.
+//
+// Physical memory is a malloc'd arena that starts at ARENA_PHYS and hhdm is
+// set so that p2v lands inside it, exactly like the kernel's direct map.
+// Runs a randomized alloc/free workload, checks the free lists after every
+// batch, then times the allocator and the page table walker.
+//
+//     mm_test [seed] [ops] [arena MB]
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef uint16_t u16;
+typedef uint8_t u8;
+
+static void panic(const char *msg) {
+    fputs(msg, stderr);
+    abort();
+}
+
+#include "mm.h"
+
+#define ARENA_PHYS 0x100000000ULL
+#define ARENA_ALIGN ((size_t)PAGE_SIZE << MAX_ORDER)
+#define MAX_LIVE 4096
+#define CHECK_EVERY 1000
+#define MAP_PAGES 100000
+
+struct live_block {
+    u64 *addr;
+    size_t order;
+    u64 tag;
+};
+
+static char *arena;
+static size_t arena_pages;
+static u8 *page_owner;
+static struct live_block live[MAX_LIVE];
+static size_t live_count;
+
+static u64 rng_state;
+
+static u64 rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, size_t page) {
+    fprintf(stderr, "mm_test: %s at arena page %zu\n", what, page);
+    exit(1);
+}
+
+static void arena_init(size_t mb) {
+    size_t size = mb << 20;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    // Buddies are found by xor on the direct map address, so the arena
+    // needs the alignment the kernel's hhdm has
+    arena = aligned_alloc(ARENA_ALIGN, size);
+    page_owner = malloc(size / PAGE_SIZE);
+    if (!arena || !page_owner)
+        panic("mm_test: out of host memory\n");
+
+    arena_pages = size / PAGE_SIZE;
+    hhdm = (uintptr_t)arena - ARENA_PHYS;
+    memset(free_list, 0, sizeof(free_list));
+    free_range((void *)p2v(ARENA_PHYS), (void *)p2v(ARENA_PHYS + size));
+}
+
+static size_t page_index(const void *p) {
+    return (v2p((uintptr_t)p) - ARENA_PHYS) / PAGE_SIZE;
+}
+
+static void claim(const void *p, size_t order, const char *what) {
+    uintptr_t a = (uintptr_t)p;
+    if (a < (uintptr_t)arena || a + (PAGE_SIZE << order) > (uintptr_t)arena + arena_pages * PAGE_SIZE)
+        fail("block outside the arena", 0);
+    if (a % (PAGE_SIZE << order))
+        fail("misaligned block", page_index(p));
+
+    size_t first = page_index(p);
+    for (size_t i = first; i < first + ((size_t)1 << order); i++) {
+        if (page_owner[i])
+            fail(what, i);
+        page_owner[i] = 1;
+    }
+}
+
+static int is_free(const void *p, size_t order) {
+    for (struct free_list_node *n = free_list[order]; n; n = n->next) {
+        if (n == p)
+            return 1;
+    }
+    return 0;
+}
+
+// Every page is in exactly one free or live block, and no free block has
+// its buddy free at the same order
+static void check_invariants(void) {
+    memset(page_owner, 0, arena_pages);
+
+    for (size_t order = 0; order <= MAX_ORDER; order++) {
+        for (struct free_list_node *n = free_list[order]; n; n = n->next) {
+            claim(n, order, "free blocks overlap");
+            if (order < MAX_ORDER && is_free((void *)((uintptr_t)n ^ (PAGE_SIZE << order)), order))
+                fail("free buddies not coalesced", page_index(n));
+        }
+    }
+
+    for (size_t i = 0; i < live_count; i++)
+        claim(live[i].addr, live[i].order, "live block overlaps");
+
+    for (size_t i = 0; i < arena_pages; i++) {
+        if (!page_owner[i])
+            fail("page leaked", i);
+    }
+}
+
+// Also counts the free pages still in MAX_ORDER blocks, the ones any
+// allocation can be served from
+static size_t free_pages(size_t *whole) {
+    size_t pages = 0;
+    for (size_t order = 0; order <= MAX_ORDER; order++) {
+        for (struct free_list_node *n = free_list[order]; n; n = n->next)
+            pages += (size_t)1 << order;
+        if (order == MAX_ORDER - 1)
+            *whole = pages;
+    }
+    *whole = pages - *whole;
+    return pages;
+}
+
+// Small orders dominate, like page tables and kmem_cache slabs do in the
+// kernel
+static size_t random_order(void) {
+    size_t order = 0;
+    while (order < MAX_ORDER && rng() % 4 == 0)
+        order++;
+    return order;
+}
+
+static void live_alloc(void) {
+    size_t order = random_order();
+    u64 *p = try_early_kalloc(order);
+    if (!p)
+        return;
+
+    size_t words = (PAGE_SIZE << order) / sizeof(u64);
+    if (p[0] || p[words - 1])
+        fail("block not zeroed", page_index(p));
+
+    u64 tag = rng() | 1;
+    p[0] = tag;
+    p[words - 1] = tag;
+    live[live_count++] = (struct live_block){ p, order, tag };
+}
+
+static void live_free(size_t i) {
+    struct live_block b = live[i];
+    size_t words = (PAGE_SIZE << b.order) / sizeof(u64);
+    if (b.addr[0] != b.tag || b.addr[words - 1] != b.tag)
+        fail("live block was overwritten", page_index(b.addr));
+
+    early_kfree(b.addr, b.order);
+    live[i] = live[--live_count];
+}
+
+// Mixed workload that hovers around half of MAX_LIVE live blocks
+static void run_workload(size_t ops) {
+    size_t peak_free = 0, peak_whole = 0, peak_live = 0;
+
+    for (size_t op = 1; op <= ops; op++) {
+        if (live_count < MAX_LIVE && (live_count == 0 || rng() % MAX_LIVE >= live_count))
+            live_alloc();
+        else
+            live_free(rng() % live_count);
+
+        if (op % CHECK_EVERY == 0) {
+            check_invariants();
+            if (live_count >= peak_live) {
+                peak_live = live_count;
+                peak_free = free_pages(&peak_whole);
+            }
+        }
+    }
+
+    printf("workload: ops=%zu checked every %d, ok\n", ops, CHECK_EVERY);
+    printf("fragmentation: live=%zu free_pages=%zu max_order_pages=%zu index=%.3f\n",
+           peak_live, peak_free, peak_whole,
+           peak_free ? 1.0 - (double)peak_whole / peak_free : 0.0);
+
+    while (live_count)
+        live_free(live_count - 1);
+    check_invariants();
+
+    // Everything back means every block merged all the way up
+    for (size_t order = 0; order < MAX_ORDER; order++) {
+        if (free_list[order])
+            fail("not fully coalesced", page_index(free_list[order]));
+    }
+    printf("coalescing: all %zu pages back in order %d blocks, ok\n", arena_pages, MAX_ORDER);
+}
+
+static void bench_alloc(size_t ops) {
+    size_t n = 0;
+    double start = now();
+
+    for (size_t op = 0; op < ops; op++) {
+        if (live_count < MAX_LIVE && (live_count == 0 || rng() % MAX_LIVE >= live_count))
+            live_alloc();
+        else
+            live_free(rng() % live_count);
+        n++;
+    }
+    double secs = now() - start;
+
+    while (live_count)
+        live_free(live_count - 1);
+
+    printf("alloc_free: ops=%zu secs=%.3f ops/sec=%.0f\n", n, secs, n / secs);
+
+    start = now();
+    for (size_t op = 0; op < ops; op++)
+        early_kfree(early_kalloc(0), 0);
+    secs = now() - start;
+    printf("alloc_free_order0: ops=%zu secs=%.3f ops/sec=%.0f\n", ops, secs, ops / secs);
+}
+
+// Random 4K mappings inside one 1G window, so the tables stay shared,
+// then every one is walked back
+static void bench_map(void) {
+    ptl4_t *l4 = early_kalloc(0);
+    static uintptr_t va[MAP_PAGES];
+    size_t whole;
+    size_t before = free_pages(&whole);
+
+    double start = now();
+    for (size_t i = 0; i < MAP_PAGES; i++) {
+        va[i] = (rng() % (PTL2_ENTRY_COUNT * PTL1_ENTRY_COUNT)) << 12;
+        map_page_early(l4, va[i] & PAGE_ADDR_MASK, va[i], PAGE_P | PAGE_RW);
+    }
+    double secs = now() - start;
+
+    for (size_t i = 0; i < MAP_PAGES; i++) {
+        ptl3_t *l3 = walk_ptl4(l4, (va[i] >> 39) & 0x1FF, 0);
+        ptl2_t *l2 = l3 ? walk_ptl3(l3, (va[i] >> 30) & 0x1FF, 0) : 0;
+        ptl1_t *l1 = l2 ? walk_ptl2(l2, (va[i] >> 21) & 0x1FF, 0) : 0;
+        if (!l1 || l1->table[(va[i] >> 12) & 0x1FF].entry != ((va[i] & PAGE_ADDR_MASK) | PAGE_P | PAGE_RW))
+            fail("mapping lost", i);
+    }
+
+    size_t tables = before - free_pages(&whole);
+    printf("map_page_early: pages=%d secs=%.3f maps/sec=%.0f tables=%zu\n",
+           MAP_PAGES, secs, MAP_PAGES / secs, tables);
+
+    start = now();
+    map_range_early(l4, 0, 1ULL << 40, (size_t)MAP_PAGES * PAGE_SIZE, PAGE_P | PAGE_RW);
+    secs = now() - start;
+    printf("map_range_early: pages=%d secs=%.3f maps/sec=%.0f\n", MAP_PAGES, secs, MAP_PAGES / secs);
+}
+
+int main(int argc, char **argv) {
+    u64 seed = argc > 1 ? strtoull(argv[1], 0, 0) : 1;
+    size_t ops = argc > 2 ? strtoull(argv[2], 0, 0) : 1000000;
+    size_t mb = argc > 3 ? strtoull(argv[3], 0, 0) : 256;
+
+    setvbuf(stdout, 0, _IOLBF, 0);
+    rng_state = seed ? seed : 1;
+    arena_init(mb);
+    printf("arena: %zu MB at phys %#llx, seed=%llu\n", mb, ARENA_PHYS, (unsigned long long)seed);
+
+    run_workload(ops);
+    bench_alloc(ops);
+    bench_map();
+    return 0;
+}
@@ -15,6 +15,11 @@ typedef int32_t s32;
 typedef int16_t s16;
 typedef int8_t s8;
 
+void *memset(void *s, int c, size_t n);
+static void panic(const char *msg);
+
+#include "mm.h"
+
 __attribute__((used, section(".limine_requests")))
 static volatile struct limine_framebuffer_request framebuffer_request = {
     .id = LIMINE_FRAMEBUFFER_REQUEST_ID,
@@ -39,6 +44,18 @@ static volatile struct limine_rsdp_request rsdp_request = {
     .revision = 0
 };
 
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_module_request module_request = {
+    .id = LIMINE_MODULE_REQUEST_ID,
+    .revision = 0
+};
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_executable_address_request executable_address_request = {
+    .id = LIMINE_EXECUTABLE_ADDRESS_REQUEST_ID,
+    .revision = 0
+};
+
 __attribute__((used, section(".limine_requests"))) static volatile u64 limine_base_revision[] = LIMINE_BASE_REVISION(4);
 __attribute__((used, section(".limine_requests_start"))) static volatile u64 limine_requests_start_marker[] = LIMINE_REQUESTS_START_MARKER;
 __attribute__((used, section(".limine_requests_end"))) static volatile u64 limine_requests_end_marker[] = LIMINE_REQUESTS_END_MARKER;
@@ -96,21 +113,63 @@ static __attribute__((noreturn)) void hcf(void) {
 }
 
 #define MAX_MEMMAP_REGIONS 64
-
-#define MAX_ORDER 10
-
-#define PAGE_SIZE 4096
-
-#define PTL4_ENTRY_COUNT 512
-#define PTL3_ENTRY_COUNT 512
-#define PTL2_ENTRY_COUNT 512
-#define PTL1_ENTRY_COUNT 512
-
-#define PAGE_P (1ULL << 0)
-#define PAGE_RW (1ULL << 1)
-#define PAGE_PS (1ULL << 7)
-
-#define MAX_IOAPICS 4
+#define MAX_BOOT_MODULES 16
+#define BOOT_MODULE_NAME 64
+
+#define INITRD_HASH_SIZE 64
+#define TAR_BLOCK 512
+#define TAR_REGULAR '0'
+
+#define BOOT_PHASES_MAX 32
+
+// The lower half of every address space is private, the upper half is
+// the kernel's and shared
+#define USER_VA_END (1ULL << 47)
+
+// Read-only struct time_page at the top of every address space.
+// user_bench.s hardcodes it.
+#define TIME_PAGE_VA (USER_VA_END - PAGE_SIZE)
+#define HUGE_PAGE_SIZE (2ULL << 20)
+
+// Page fault error code
+#define PF_PRESENT (1 << 0)
+#define PF_WRITE (1 << 1)
+
+#define ELF_MAGIC "\177ELF"
+#define ELF_IDENT_CLASS 4
+#define ELF_IDENT_DATA 5
+#define ELF_CLASS64 2
+#define ELF_DATA_LSB 1
+#define ELF_TYPE_EXEC 2
+#define ELF_TYPE_DYN 3
+#define ELF_MACHINE_X86_64 62
+#define ELF_PT_LOAD 1
+#define ELF_PF_W 2
+#define ELF_DYN_BASE 0x400000ULL
+
+// Run at boot from the initrd, see spawn_init
+#define INIT_NAME "init"
+
+// Handles init finds in its cap table. A fresh table hands out slots in
+// order with generation 0, so grants made at boot land on fixed numbers.
+#define INIT_CAP_VM 0 // its own address space
+#define INIT_CAP_CONSOLE 1 // endpoint, see console_server
+#define INIT_CAP_KBD 2 // CAP_IRQ for the keyboard
+#define INIT_CAP_NET 3 // CAP_CHANNEL of net queue 0, only with virtio-net
+
+// Where init finds net queue 0, laid out as net_attach describes
+#define INIT_NET_VA 0x7FFF00000000ULL
+
+#define ELF_STACK_TOP 0x7FFFFF000000ULL
+#define ELF_STACK_SIZE (1ULL << 20)
+
+#define FRAME_REFS_PER_CHUNK (PAGE_SIZE / sizeof(u32))
+
+// Past this many pages a cr3 reload is cheaper than invlpg each one
+#define TLB_BATCH_PAGES 32
+#define TLB_BATCH_FRAMES 64
+
+#define MAX_IOAPICS 32
 #define MAX_LAPICS 1
 
 #define APIC_ID      (0x0020/4)   // ID
@@ -128,6 +187,7 @@ static __attribute__((noreturn)) void hcf(void) {
   #define APIC_DEASSERT   0x00000000
   #define APIC_LEVEL      0x00008000   // Level triggered
   #define APIC_BCAST      0x00080000   // Send to all APICs, including self.
+  #define APIC_SELF       0x00040000   // Send to this APIC only
   #define APIC_BUSY       0x00001000
   #define APIC_FIXED      0x00000000
 #define APIC_ICRHI   (0x0310/4)   // Interrupt Command [63:32]
@@ -184,6 +244,8 @@ static __attribute__((noreturn)) void hcf(void) {
 #define IOAPIC_REG_VERSION 0x01
 #define IOAPIC_REG_TABLE 0x10
 #define IOAPIC_INT_DISABLED 0x00010000
+#define IOAPIC_LEVEL 0x00008000
+#define IOAPIC_ACTIVELOW 0x00002000
 #define IOAPIC_IO_REG_SELECT 0
 #define IOAPIC_IO_DATA 4
 
@@ -191,50 +253,327 @@ static __attribute__((noreturn)) void hcf(void) {
 #define SEG_KDATA 2
 #define SEG_UCODE 3
 #define SEG_UDATA 4
-#define SEG_TSS 5
+#define SEG_TSS 5 // each cpu's 16 byte tss descriptor takes two entries from here
+#define GDT_ENTRIES (SEG_TSS + 2 * MAX_CPUS)
+
+#define IST_DOUBLE_FAULT 1
+#define IST_NMI 2
+#define IST_MACHINE_CHECK 3
+#define IST_COUNT 3
+#define IST_STACK_SIZE PAGE_SIZE
 
 #define INTERRUPT_COUNT 256
 
 #define COM1 0x3F8
 
-#define RFLAG_IF 0x00000200
-
-#define PROC_COUNT 8
-
-#define KSTACK_SIZE PAGE_SIZE
-#define KSTACK_ORDER 0
-
-typedef struct {
-    u64 entry;
-} ptl1e_t;
-
-typedef struct {
-    u64 entry;
-} ptl2e_t;
-
-typedef struct {
-    u64 entry;
-} ptl3e_t;
-
-typedef struct {
-    u64 entry;
-} ptl4e_t;
-
-typedef struct {
-    ptl1e_t table[PTL1_ENTRY_COUNT];
-} __attribute__((aligned(PAGE_SIZE))) ptl1_t;
+// QEMU isa-debug-exit, a write of v exits qemu with status (v << 1) | 1
+#define QEMU_EXIT_PORT 0xF4
 
-typedef struct {
-    ptl2e_t table[PTL2_ENTRY_COUNT];
-} __attribute__((aligned(PAGE_SIZE))) ptl2_t;
+#define PIT_CH2 0x42
+#define PIT_CMD 0x43
+#define PIT_GATE 0x61
+  #define PIT_GATE_CH2     0x01
+  #define PIT_GATE_SPEAKER 0x02
+  #define PIT_GATE_OUT2    0x20
+#define PIT_HZ 1193182
+#define PIT_CALIBRATE_MS 10
 
-typedef struct {
-    ptl3e_t table[PTL3_ENTRY_COUNT];
-} __attribute__((aligned(PAGE_SIZE))) ptl3_t;
+#define RFLAG_IF 0x00000200
 
-typedef struct {
-    ptl4e_t table[PTL4_ENTRY_COUNT];
-} __attribute__((aligned(PAGE_SIZE))) ptl4_t;
+#define CPUID_FEATURES 1
+  #define CPUID_ECX_MONITOR (1 << 3)
+
+#define MAX_CPUS MAX_LAPICS
+
+#define KSTACK_ORDER 1
+#define KSTACK_SIZE (PAGE_SIZE << KSTACK_ORDER)
+#define KSTACK_CANARY 0x6b737461636b2121ULL // at the lowest address of every kstack
+#define BOOT_STACK_ORDER 2 // the scheduler's once off the bootloader's
+#define KSTACK_CACHE_SIZE 64
+
+#define IDR_BITS 6
+#define IDR_SIZE (1 << IDR_BITS)
+#define IDR_MASK (IDR_SIZE - 1)
+#define IDR_LEVELS 3
+#define IDR_MAX (1 << (IDR_BITS * IDR_LEVELS))
+
+#define SLEEP_HASH_BITS 8
+#define SLEEP_HASH_SIZE (1 << SLEEP_HASH_BITS)
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_0_WEIGHT 1024
+
+#define SCHED_LATENCY_NS 6000000ULL
+#define SCHED_MIN_GRANULARITY_NS 750000ULL
+#define SCHED_WAKEUP_GRANULARITY_NS 1000000ULL
+#define SCHED_NR_LATENCY (SCHED_LATENCY_NS / SCHED_MIN_GRANULARITY_NS)
+
+#define RT_PRIO_COUNT 64
+#define RR_TIMESLICE_NS 10000000ULL
+
+// Deadline bandwidth is runtime/period in DL_BW_SHIFT fixed point
+#define DL_BW_SHIFT 20
+#define DL_BW_LIMIT ((95ULL << DL_BW_SHIFT) / 100)
+
+#define ENQUEUE_WAKEUP 0x1
+#define ENQUEUE_HEAD 0x2
+
+// Short ipc messages travel in rsi, rdx, r8 and r9 of the int 0x40 syscall,
+// with the operation in rax and the endpoint id in rdi
+#define IPC_MSG_WORDS 4
+
+#define SYS_IPC_CALL 0
+#define SYS_IPC_REPLY_WAIT 1
+#define SYS_IPC_REPLY 2
+#define SYS_RING_WAIT 3
+#define SYS_RING_NOTIFY 4
+#define SYS_CAP_COPY 5
+#define SYS_CAP_MINT 6
+#define SYS_CAP_DELETE 7
+#define SYS_CAP_REVOKE 8
+#define SYS_IRQ_WAIT 9
+#define SYS_IRQ_ACK 10
+#define SYS_FUTEX_WAIT 11
+#define SYS_FUTEX_WAKE 12
+#define SYS_FUTEX_REQUEUE 13
+#define SYS_FUTEX_WAKE_OP 14
+#define SYS_SCHED_SETSCHEDULER 15
+#define SYS_SCHED_SETDEADLINE 16
+#define SYS_SCHED_WAIT_PERIOD 17
+#define SYS_SET_NICE 18
+#define SYS_VM_ALLOC 19
+#define SYS_VM_UNMAP 20
+#define SYS_VM_GRANT 21
+#define SYS_VM_TRANSFER 22
+#define SYS_CHANNEL_CREATE 23
+#define SYS_CHANNEL_MAP 24
+#define SYS_IRQ_SET_AFFINITY 25
+
+// futex_wait results besides 0 for woken
+#define FUTEX_AGAIN -1 // value changed or bad address
+#define FUTEX_TIMEDOUT -2
+
+// wake_op encoding, as in Linux: op and cmp select the operation applied to
+// the second word and the test on its old value, each with a 12 bit arg
+#define FUTEX_OP(op, oparg, cmp, cmparg) (((op) & 0xF) << 28 | ((cmp) & 0xF) << 24 | ((oparg) & 0xFFF) << 12 | ((cmparg) & 0xFFF))
+#define FUTEX_OP_SET 0
+#define FUTEX_OP_ADD 1
+#define FUTEX_OP_OR 2
+#define FUTEX_OP_ANDN 3
+#define FUTEX_OP_XOR 4
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP_CMP_NE 1
+#define FUTEX_OP_CMP_LT 2
+#define FUTEX_OP_CMP_LE 3
+#define FUTEX_OP_CMP_GT 4
+#define FUTEX_OP_CMP_GE 5
+
+// Vectors handed out to irq objects, clear of the legacy TRAP_IRQ0 range
+// and TRAP_SYSCALL
+#define IRQ_VECTOR_BASE 80
+#define MAX_IRQS 160
+
+#define ISA_IRQS 16
+
+// MPS INTI flags of an interrupt source override
+#define MADT_POLARITY_MASK 0x3
+#define MADT_POLARITY_LOW 0x3
+#define MADT_TRIGGER_MASK 0xC
+#define MADT_TRIGGER_LEVEL 0xC
+
+#define MADT_LAPIC_ENABLED 0x1
+
+#define IRQ_BALANCE_NS 100000000ULL
+
+#define MAX_PCI_SEGMENTS 4
+#define MAX_PCI_DEVS 64
+#define PCI_DEVS_PER_BUS 32
+#define PCI_FUNCS_PER_DEV 8
+
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0A
+#define PCI_CLASS 0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_SECONDARY_BUS 0x19
+#define PCI_CAP_PTR 0x34
+
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_MASTER 0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+#define PCI_STATUS_CAP_LIST 0x0010
+#define PCI_HEADER_MULTIFUNCTION 0x80
+#define PCI_HEADER_BRIDGE 0x01
+#define PCI_BAR_IO 0x1
+#define PCI_BAR_64 0x4
+#define PCI_BAR_COUNT 6
+
+#define PCI_CAP_MSIX 0x11
+#define MSIX_CONTROL 2
+#define MSIX_TABLE 4
+#define MSIX_ENABLE 0x8000
+#define MSIX_MASK_ALL 0x4000
+#define MSIX_TABLE_SIZE_MASK 0x7FF
+#define MSIX_BIR_MASK 0x7
+#define MSIX_ENTRY_SIZE 16
+#define MSIX_ENTRY_ADDR 0
+#define MSIX_ENTRY_DATA 8
+#define MSIX_ENTRY_CONTROL 12
+#define MSIX_ENTRY_MASKED 0x1
+
+// Physical destination mode, fixed delivery, edge triggered
+#define MSI_ADDRESS_BASE 0xFEE00000
+
+#define PCI_CAP_VENDOR 0x09
+
+#define VIRTIO_VENDOR 0x1AF4
+#define VIRTIO_DEVICE_BLK 0x1042
+#define VIRTIO_DEVICE_BLK_TRANSITIONAL 0x1001
+
+// Vendor capability of a modern virtio device, locating each register block
+#define VIRTIO_CAP_TYPE 3
+#define VIRTIO_CAP_BAR 4
+#define VIRTIO_CAP_OFFSET 8
+#define VIRTIO_CAP_NOTIFY_MULT 16
+#define VIRTIO_CAP_COMMON 1
+#define VIRTIO_CAP_NOTIFY 2
+#define VIRTIO_CAP_DEVICE 4
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_FAILED 128
+
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+#define VIRTIO_BLK_F_MQ (1ULL << 12)
+#define VIRTIO_NO_VECTOR 0xFFFF
+
+#define VIRTQ_SIZE 128
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_SECTOR_SIZE 512
+#define VIRTIO_BLK_CFG_NUM_QUEUES 34
+
+// A request chains a header, up to BLK_MAX_SEGS data and a status
+// descriptor. Queue memory takes BLK_QUEUE_DMA_ORDER pages.
+#define BLK_MAX_SEGS 32
+#define BLK_QUEUE_DMA_ORDER 1
+#define BLK_POLL_MIN_NS 2000
+#define BLK_POLL_MAX_NS 50000
+#define BLK_REAP_NS 1000000ULL // polls a queue without an irq while async io is out
+
+#define VIRTIO_DEVICE_NET 0x1041
+#define VIRTIO_DEVICE_NET_TRANSITIONAL 0x1000
+#define VIRTIO_NET_F_CSUM (1ULL << 0) // device checksums what we send
+#define VIRTIO_NET_F_GUEST_CSUM (1ULL << 1) // device validates what we receive
+#define VIRTIO_NET_F_MAC (1ULL << 5)
+#define VIRTIO_NET_F_CTRL_VQ (1ULL << 17)
+#define VIRTIO_NET_F_MQ (1ULL << 22)
+#define VIRTIO_NET_CFG_MAC 0
+#define VIRTIO_NET_CFG_MAX_PAIRS 8
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+#define VIRTIO_NET_CTRL_MQ 4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK 0
+
+// Every packet is one page shared with the server, the virtio header
+// first and the frame after it
+#define NET_BUFS 256 // per queue pair
+#define NET_FRAME_OFFSET sizeof(struct virtio_net_hdr)
+#define NET_FRAME_MAX (PAGE_SIZE - NET_FRAME_OFFSET)
+#define NET_BUDGET 32 // packets per direction per poll round
+#define NET_REFILL_BATCH 16
+#define NET_TX_GRANT 64 // send buffers a server starts with
+#define NET_BUSY_POLL_NS 50000
+
+// Channel messages between a queue and its server: w[0] op, w[1] buffer
+// index, w[2] frame length, w[3] flags
+#define NET_MSG_RX 0 // cq, a frame arrived
+#define NET_MSG_TX_DONE 1 // cq, the buffer is the server's again
+#define NET_MSG_TX 2 // sq, send a frame
+#define NET_MSG_FREE 3 // sq, the rx buffer is the kernel's again
+#define NET_RX_CSUM_VALID 1
+#define NET_TX_CSUM (1ULL << 32) // low bits csum_start | csum_offset << 16
+
+// Who holds each buffer. The server may only send or free its own, so a
+// buffer is never posted twice or sent while the device fills it.
+#define NET_BUF_POOL 0 // the kernel's, not posted
+#define NET_BUF_DEVICE 1 // posted for rx or queued for tx
+#define NET_BUF_SERVER 2
+
+// The page cache radix tree covers 2^30 pages, 4 TiB of disk
+#define PCACHE_BITS 6
+#define PCACHE_SIZE (1 << PCACHE_BITS)
+#define PCACHE_MASK (PCACHE_SIZE - 1)
+#define PCACHE_LEVELS 5
+
+#define PG_UPTODATE 0x01
+#define PG_DIRTY 0x02
+#define PG_IO 0x04 // a read or write is in flight
+#define PG_REFERENCED 0x08 // second chance for the clock
+#define PG_READAHEAD 0x10 // reaching it starts the next window
+
+#define PCACHE_SECTORS_PER_PAGE (PAGE_SIZE / VIRTIO_BLK_SECTOR_SIZE)
+#define PCACHE_RA_MIN 4
+#define PCACHE_RA_MAX BLK_MAX_SEGS
+#define PCACHE_SHRINK_BATCH 32
+#define PCACHE_GANG 32
+#define PCACHE_WRITEBACK_NS 200000000ULL
+
+#define CACHE_LINE 64
+
+// A handle is the slot index in the low 32 bits and the slot's generation
+// above it. Generations are 31 bits so handles are never negative.
+#define CAP_TABLE_ORDER 2
+#define CAP_TABLE_SLOTS ((PAGE_SIZE << CAP_TABLE_ORDER) / sizeof(struct cap))
+#define CAP_GEN_MASK 0x7FFFFFFFU
+#define CAP_NO_SLOT 0xFFFFFFFFU
+
+#define CAP_RIGHT_SEND (1U << 0) // call an endpoint, notify a ring
+#define CAP_RIGHT_RECV (1U << 1) // reply_wait on an endpoint, wait on a ring
+#define CAP_RIGHT_MAP (1U << 2) // map, grant or transfer pages of a vm
+#define CAP_RIGHT_GRANT (1U << 3) // copy or mint the capability
+#define CAP_RIGHTS_ALL 0xFU
+
+// A channel has a submission and a completion ring of ipc_msg entries. The
+// entries and the page of indices are shared with both parties.
+#define RING_ORDER 1
+#define RING_ENTRIES ((PAGE_SIZE << RING_ORDER) / sizeof(struct ipc_msg))
+#define RING_MASK (RING_ENTRIES - 1)
+#define RING_SQ 0
+#define RING_CQ 1
+// A mapped channel is its ctl page then the SQ and CQ entries
+#define CHANNEL_PAGES (1 + 2 * (1 << RING_ORDER))
+
+// Record the longest irq-off and preempt-off spans and where they started.
+// Costs an rdtsc on every cli/sti pair, so only the bench turns it on by
+// default. Build with -DTRACE_LATENCY=1 to get it elsewhere.
+#ifndef TRACE_LATENCY
+#ifdef BENCH
+#define TRACE_LATENCY 1
+#else
+#define TRACE_LATENCY 0
+#endif
+#endif
+
+#define barrier() asm volatile("" : : : "memory")
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 
 enum memmap_region_type {
     MEMMAP_REGION_USABLE = 0,
@@ -254,13 +593,149 @@ struct region {
     enum memmap_region_type type;
 };
 
+// Lets ring 3 compute clock_ns without a syscall: ns = ((rdtsc - boot_tsc)
+// * tsc_ns_mult) >> 32. Readers retry while seq is odd or changed under
+// them. The layout is ABI for user code.
+struct time_page {
+    u32 seq;
+    u32 pad;
+    u64 tsc_khz;
+    u64 tsc_ns_mult;
+    u64 boot_tsc;
+    u64 ticks;
+};
+
+// Pending invalidations for one address space. Frames unmapped on the way
+// are only released once no tlb can still reach them.
+struct tlb_batch {
+    struct vm_space *vm;
+    int full_flush;
+    size_t page_count;
+    uintptr_t pages[TLB_BATCH_PAGES];
+    size_t frame_count;
+    uintptr_t frames[TLB_BATCH_FRAMES];
+};
+
 struct memmap {
     size_t region_count;
     struct region regions[MAX_MEMMAP_REGIONS];
 };
 
-struct free_list_node {
-    struct free_list_node *next;
+// A Limine module. The data stays where the bootloader put it, only the
+// name is copied out of reclaimable memory.
+struct boot_module {
+    const u8 *data;
+    size_t size;
+    char name[BOOT_MODULE_NAME]; // last path component
+};
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct list {
+    struct list *next;
+    struct list *prev;
+};
+
+struct vm_space {
+    ptl4_t *ptl4;
+    struct list areas; // struct vm_area, filled in on fault
+    u32 refs; // threads running in it and capabilities naming it
+};
+
+// Points into a module, nothing is copied
+struct initrd_file {
+    struct list node;
+    const char *name; // not terminated
+    size_t name_len;
+    const u8 *data;
+    size_t size;
+    uintptr_t *pages; // see initrd_file_page
+    size_t pages_order;
+};
+
+// A range of an address space that vm_fault fills in on first touch
+struct vm_area {
+    struct list node;
+    uintptr_t start;
+    uintptr_t end;
+    u64 flags; // PAGE_RW
+    struct initrd_file *file; // NULL for zero fill
+    u64 offset; // of start in file, page aligned
+    uintptr_t file_end; // zero fill from here on
+};
+
+struct elf64_ehdr {
+    u8 ident[16];
+    u16 type;
+    u16 machine;
+    u32 version;
+    u64 entry;
+    u64 phoff;
+    u64 shoff;
+    u32 flags;
+    u16 ehsize;
+    u16 phentsize;
+    u16 phnum;
+    u16 shentsize;
+    u16 shnum;
+    u16 shstrndx;
+};
+
+struct elf64_phdr {
+    u32 type;
+    u32 flags;
+    u64 offset;
+    u64 vaddr;
+    u64 paddr;
+    u64 filesz;
+    u64 memsz;
+    u64 align;
+};
+
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int red;
+};
+
+struct rb_tree {
+    struct rb_node *root;
+    struct rb_node *leftmost;
+};
+
+struct kmem_cache {
+    size_t size;
+    size_t active;
+    struct free_list_node *free;
+};
+
+struct idr_node {
+    u64 full; // bit i set when slot i is in use (leaf) or its subtree is full
+    void *slots[IDR_SIZE];
+};
+
+struct idr {
+    struct idr_node *root;
+    size_t count;
 };
 
 struct acpi_sdt_header {
@@ -319,6 +794,29 @@ struct madt_ioapic_entry {
     u32 gsi_base;
 } __attribute__((packed));
 
+struct acpi_mcfg_entry {
+    u64 base; // of bus 0, even when start_bus is not
+    u16 segment;
+    u8 start_bus;
+    u8 end_bus;
+    u32 reserved;
+} __attribute__((packed));
+
+struct acpi_mcfg {
+    struct acpi_sdt_header header;
+    u64 reserved;
+    struct acpi_mcfg_entry entries[];
+} __attribute__((packed));
+
+struct madt_override_entry {
+    u8 type;
+    u8 length;
+    u8 bus;
+    u8 source; // isa irq
+    u32 gsi;
+    u16 flags;
+} __attribute__((packed));
+
 struct madt_lapic_entry {
     u8 type;
     u8 length;
@@ -331,6 +829,281 @@ struct ioapic {
     u8 id;
     volatile u32 *addr;
     u32 gsi_base;
+    u32 pins;
+};
+
+// Fires from the timer interrupt once clock_ns passes expires
+struct timer {
+    u64 expires;
+    void (*fn)(struct timer *);
+    struct list node;
+    int pending;
+};
+
+// Layout of the common configuration block
+struct virtio_common_cfg {
+    u32 device_feature_select;
+    u32 device_feature;
+    u32 driver_feature_select;
+    u32 driver_feature;
+    u16 msix_config;
+    u16 num_queues;
+    u8 device_status;
+    u8 config_generation;
+    u16 queue_select;
+    u16 queue_size;
+    u16 queue_msix_vector;
+    u16 queue_enable;
+    u16 queue_notify_off;
+    u64 queue_desc;
+    u64 queue_driver;
+    u64 queue_device;
+} __attribute__((packed));
+
+struct virtq_desc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+};
+
+struct virtq_avail {
+    u16 flags;
+    u16 idx;
+    u16 ring[VIRTQ_SIZE];
+};
+
+struct virtq_used {
+    u16 flags;
+    u16 idx;
+    struct {
+        u32 id;
+        u32 len;
+    } ring[VIRTQ_SIZE];
+};
+
+struct virtio_blk_hdr {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+};
+
+// The split ring of one virtqueue, VIRTQ_SIZE entries
+struct virtq_ring {
+    struct virtq_desc desc[VIRTQ_SIZE];
+    struct virtq_avail avail;
+    struct virtq_used used __attribute__((aligned(4)));
+};
+
+// Register blocks of a modern virtio pci function
+struct virtio_pci {
+    struct pci_dev *pci;
+    volatile struct virtio_common_cfg *common;
+    uintptr_t notify_base;
+    u32 notify_mult;
+    uintptr_t device_cfg;
+};
+
+// Caller owned, alive until done is set
+struct blk_req {
+    volatile int done;
+    u8 status; // VIRTIO_BLK_S_OK on success
+    u64 submit_tsc;
+    u64 complete_tsc;
+    void (*end)(struct blk_req *); // run on completion if set, irqs off
+};
+
+// One physically contiguous piece of a request's data
+struct blk_seg {
+    void *buf;
+    u32 len;
+};
+
+// From the page allocator, so v2p works for every part the device reads
+// or writes. Headers and status bytes are indexed by head descriptor.
+struct blk_queue_dma {
+    struct virtq_ring ring;
+    struct virtio_blk_hdr hdrs[VIRTQ_SIZE];
+    u8 status[VIRTQ_SIZE];
+};
+
+// Submitted to and completed on by the cpu it belongs to
+struct blk_queue {
+    u16 index;
+    struct blk_queue_dma *dma;
+    volatile u16 *notify;
+    u16 avail_idx;
+    u16 last_used;
+    u16 unkicked; // published since the last notification
+    u16 free_head; // descriptors chained through next
+    u16 free_count;
+    struct blk_req *reqs[VIRTQ_SIZE];
+    struct irq *irq; // NULL when the queue can only be polled
+    u64 poll_ns; // how long waiters spin before sleeping
+    u16 async; // in flight with an end callback
+    u16 sleepers; // in blk_wait_until
+    struct timer reap_timer; // stands in for the irq when there is none
+};
+
+struct pcache_node {
+    u64 present; // bit i set when slots[i] is in use
+    void *slots[PCACHE_SIZE];
+};
+
+struct cached_page {
+    u64 index;
+    u32 flags;
+    u32 refs; // users plus in flight io, evictable at 0
+    void *data;
+    struct blk_queue *q; // of the io in flight
+    volatile int io_done;
+    struct list lru;
+};
+
+// A read or write of up to BLK_MAX_SEGS consecutive pages
+struct cache_io {
+    struct blk_req req;
+    struct page_cache *cache;
+    struct blk_queue *q;
+    int write;
+    size_t count;
+    struct cached_page *pages[BLK_MAX_SEGS];
+};
+
+// Caches one disk by page index. Pages sit on the clock in insertion
+// order. Readahead follows a single sequential stream.
+struct page_cache {
+    struct pcache_node *root;
+    size_t pages;
+    size_t max_pages;
+    size_t dirty;
+    size_t dirty_high; // wakes writeback early
+    struct list clock;
+    u64 ra_prev;
+    u64 ra_start;
+    u64 ra_size;
+    struct timer writeback_timer;
+    u64 hits;
+    u64 misses;
+    u64 ra_pages;
+    u64 wb_pages;
+    u64 wb_reqs;
+};
+
+struct virtio_blk {
+    int ready;
+    struct virtio_pci vp;
+    u64 capacity; // in sectors
+    size_t queue_count;
+    struct blk_queue queues[MAX_CPUS];
+    struct page_cache cache;
+};
+
+struct virtio_net_hdr {
+    u8 flags;
+    u8 gso_type;
+    u16 hdr_len;
+    u16 gso_size;
+    u16 csum_start;
+    u16 csum_offset;
+    u16 num_buffers;
+} __attribute__((packed));
+
+// One direction of a queue pair. A packet is a single descriptor so the
+// free descriptors are a plain stack.
+struct net_vq {
+    u16 index;
+    struct virtq_ring *ring;
+    volatile u16 *notify;
+    u16 avail_idx;
+    u16 last_used;
+    u16 unkicked;
+    u16 free_count;
+    u16 free[VIRTQ_SIZE];
+    u16 bufs[VIRTQ_SIZE]; // buffer index by descriptor
+};
+
+// A queue pair with its buffers and the channel to its server. Only the
+// poll thread touches it, apart from the irq handler turning interrupts
+// off again.
+struct net_queue {
+    struct net_vq rx;
+    struct net_vq tx;
+    void *bufs[NET_BUFS];
+    u16 pool[NET_BUFS]; // held by the kernel and not posted
+    size_t pool_count;
+    u8 owner[NET_BUFS]; // NET_BUF_*
+    struct channel *ch; // the server pushes to RING_SQ, we to RING_CQ
+    struct irq *irq;
+    u64 rx_packets;
+    u64 tx_packets;
+    u64 polls;
+    u64 sleeps;
+};
+
+struct virtio_net {
+    int ready;
+    struct virtio_pci vp;
+    u64 features;
+    u8 mac[6];
+    size_t queue_count;
+    struct net_queue queues[MAX_CPUS];
+    struct net_vq ctrl;
+    size_t pollers; // poll threads started, each takes the next queue
+};
+
+struct pci_segment {
+    uintptr_t base;
+    u16 segment;
+    u8 start_bus;
+    u8 end_bus;
+};
+
+struct pci_dev {
+    u16 segment;
+    u8 bus;
+    u8 dev;
+    u8 func;
+    u16 vendor;
+    u16 device;
+    u8 class;
+    u8 subclass;
+    u8 prog_if;
+    uintptr_t cfg; // 4K ecam window, mapped
+    uintptr_t bars[PCI_BAR_COUNT]; // mapped on first use
+    u8 msix_cap; // 0 without msi-x
+    u16 msix_count;
+    uintptr_t msix_table;
+};
+
+// Where an isa irq arrives. Identity, edge triggered and active high
+// unless the MADT overrides it.
+struct isa_route {
+    u32 gsi;
+    u32 redirect; // IOAPIC_LEVEL and IOAPIC_ACTIVELOW bits
+};
+
+// A device line owned by a driver thread. The kernel masks it when it
+// fires and the driver unmasks it once the device has been serviced.
+struct irq {
+    int bound;
+    int boost; // preempt normal threads to run the driver
+    struct pci_dev *msix; // entry msix_entry of its table instead of an ioapic pin
+    u32 msix_entry;
+    u32 gsi;
+    size_t ioapic;
+    u32 pin;
+    u32 vector;
+    u32 redirect; // low half of the redirection entry, unmasked
+    size_t cpu; // whose lapic receives it
+    int pinned; // affinity set explicitly, left alone by irq_balance
+    u64 count; // deliveries since the last balance
+    u64 pending; // deliveries since the driver last waited
+    u64 raised_tsc; // first undelivered interrupt
+    struct proc *waiter;
+    // In kernel drivers can handle the interrupt right away instead
+    void (*handler)(struct irq *);
+    void *data;
 };
 
 struct lapic {
@@ -348,6 +1121,16 @@ struct gdt_entry {
     u8 base_high;
 } __attribute__((packed));
 
+struct tss {
+    u32 reserved0;
+    u64 rsp[3];
+    u64 reserved1;
+    u64 ist[7];
+    u64 reserved2;
+    u16 reserved3;
+    u16 iomap_base;
+} __attribute__((packed));
+
 struct idt_gate {
     u16 off_15_0;   // low 16 bits of offset in segment
     u16 cs;         // code segment selector
@@ -412,14 +1195,162 @@ enum process_state {
     PROC_SLEEPING
 };
 
+// Classes are picked in reverse order: deadline, then fifo/rr, then normal
+enum sched_policy {
+    SCHED_NORMAL,
+    SCHED_FIFO,
+    SCHED_RR,
+    SCHED_DEADLINE
+};
+
+struct ipc_msg {
+    u64 w[IPC_MSG_WORDS];
+};
+
+enum cap_type {
+    CAP_NONE,
+    CAP_ENDPOINT,
+    CAP_CHANNEL,
+    CAP_VM,
+    CAP_IRQ
+};
+
+struct cap_table;
+
+// Derived capabilities hang off the capability they were copied or minted
+// from, possibly in another table, so revoke only walks that subtree
+struct cap {
+    u32 gen; // bumped on delete, stale handles stop matching
+    u32 type;
+    u32 rights;
+    u32 next_free;
+    u64 badge;
+    void *obj;
+    struct cap_table *table;
+    struct cap *parent;
+    struct cap *child;
+    struct cap *next;
+    struct cap *prev;
+};
+
+struct cap_table {
+    struct cap *slots; // CAP_TABLE_SLOTS
+    u32 free_head;
+    u32 count;
+    u32 refs; // threads using it
+};
+
+// Indices of one ring, each on its own cache line so the producer and the
+// consumer never write the same line
+struct ring_ctl {
+    u32 head __attribute__((aligned(CACHE_LINE))); // consumer
+    u32 tail __attribute__((aligned(CACHE_LINE))); // producer
+    u32 waiting __attribute__((aligned(CACHE_LINE))); // consumer asleep
+};
+
+struct ring {
+    struct ring_ctl *ctl;
+    struct ipc_msg *entries;
+    u32 sleepers; // in ring_wait, unlike ctl->waiting out of user reach
+};
+
+struct channel {
+    struct ring_ctl *ctl; // RING_SQ and RING_CQ indices, one page
+    struct ring rings[2];
+    u32 caps; // capabilities naming it
+};
+
+struct endpoint {
+    struct list senders; // callers waiting for a server
+    struct list receivers; // servers waiting in reply_wait
+};
+
 struct proc {
     struct context context;
     void *channel;
     enum process_state state;
     void *stack;
+    int tid;
+    int preempt_count;
+    struct list node; // sleep bucket, rt queue, dl throttled list or endpoint
+    struct rb_node rb; // fair or dl run queue
+    enum sched_policy policy;
+    int rt_priority;
+    s64 rr_remaining;
+    int nice;
+    u32 weight;
+    u64 vruntime;
+    u64 sum_exec;
+    u64 exec_start;
+    u64 slice_start; // sum_exec when last picked
+    u64 wakeup_ns;
+
+    u64 dl_runtime;
+    u64 dl_deadline;
+    u64 dl_period;
+    u64 dl_bw;
+    u64 dl_abs_deadline;
+    s64 dl_remaining;
+    u64 dl_replenish_at;
+    int dl_throttled;
+    int dl_missed; // current job already counted
+    u64 dl_jobs;
+    u64 dl_misses;
+    u64 dl_overruns;
+    u64 dl_max_lateness;
+
+    struct vm_space *vm; // NULL for threads that only touch kernel memory
+    struct cap_table *caps; // may be shared by several threads
+
+    struct ipc_msg ipc_msg; // in flight to or from this thread
+    u64 ipc_badge; // of the capability the call came through
+
+    u64 futex_key;
+    int futex_queued;
+    int futex_timed_out;
+    struct timer timer; // timeout of the current wait
+    struct proc *ipc_caller; // blocked until we reply
+    int ipc_failed; // the server exited without replying
+};
+
+struct latency_trace {
+    u64 start;
+    uintptr_t start_site;
+    u64 max;
+    uintptr_t max_site;
+    uintptr_t max_end_site;
+};
+
+struct cpu {
+    struct context scheduler_context;
+    struct proc *proc;
+    struct vm_space *vm; // loaded in cr3, NULL for kernel_ptl4
+    struct proc *dead; // exited thread to reap once we are off its stack
+    u64 cli_count;
+    int interrupts_enabled;
+    int need_resched;
+    struct rb_tree dl_tree; // by absolute deadline
+    struct list dl_throttled;
+    struct list timers; // by expiry
+    u64 dl_bw;
+    struct list rt_queue[RT_PRIO_COUNT];
+    u64 rt_bitmap;
+    struct rb_tree fair_tree; // by vruntime
+    u64 fair_load;
+    u64 min_vruntime;
+    u64 nr_running; // queued in any class, current excluded
+    struct free_list_node *stack_cache;
+    size_t stack_cache_count;
+    struct tss tss;
+    u64 start_tsc;
+    u64 idle_cycles;
+    u64 idle_count;
+    struct latency_trace irqoff;
+    struct latency_trace preemptoff;
+    int started; // running with its lapic set up, see cpu_online
 };
 
-static struct gdt_entry gdt[5];
+static struct gdt_entry gdt[GDT_ENTRIES];
 
 static struct idt_gate idt[INTERRUPT_COUNT];
 
@@ -427,14 +1358,20 @@ static volatile u32 *framebuffer;
 static int framebuffer_width;
 static int framebuffer_height;
 
-static uintptr_t hhdm;
-
 static struct memmap memmap;
-
-static struct free_list_node *free_list[MAX_ORDER + 1];
+static struct boot_module boot_modules[MAX_BOOT_MODULES];
+static size_t boot_module_count;
+static uintptr_t kernel_phys_base;
+static struct list initrd_table[INITRD_HASH_SIZE];
+static struct kmem_cache initrd_file_cache;
+static size_t initrd_file_count;
 
 static ptl4_t *kernel_ptl4;
 
+// Reference counts of usable frames, one page of counts per chunk
+static u32 **frame_refs;
+static size_t frame_ref_chunks;
+
 extern char __kernel_offset[];
 extern char __text_start[];
 extern char __text_end[];
@@ -452,22 +1389,108 @@ static volatile u32 *lapic;
 static size_t ioapic_count;
 static struct ioapic ioapics[MAX_IOAPICS];
 
+static struct isa_route isa_routes[ISA_IRQS];
+
+static size_t pci_segment_count;
+static struct pci_segment pci_segments[MAX_PCI_SEGMENTS];
+
+static size_t pci_dev_count;
+static struct pci_dev pci_devs[MAX_PCI_DEVS];
+
+static struct virtio_blk virtio_blk;
+static struct virtio_net virtio_net;
+
+static struct kmem_cache pcache_node_cache;
+static struct kmem_cache cached_page_cache;
+static struct kmem_cache cache_io_cache;
+
+static struct irq irqs[MAX_IRQS];
+
+// Spread bound irqs over the cpus by load, otherwise they all go to the
+// boot cpu
+static int irq_balancing = 1;
+static size_t irq_next_cpu;
+static struct timer irq_balance_timer;
+
 static size_t lapic_count;
 static struct lapic lapics[MAX_LAPICS];
 
 static u64 sched_ticks;
 
-static u64 cli_count;
-static struct proc *current_proc;
-static int interrupts_enabled;
-static struct context scheduler_context;
+static struct cpu cpus[MAX_CPUS];
+
+// Switch straight to the next runnable thread in sched() instead of going
+// through the scheduler context. Only cleared to benchmark the old path.
+static int sched_direct_switch = 1;
+
+// Preempt the current thread when a sleeper wakes with a much smaller
+// vruntime. Only cleared to benchmark slice-only preemption.
+static int sched_wakeup_preempt = 1;
+
+static int cpu_has_mwait;
+
+// Where kmain's time goes, see boot_mark
+struct boot_phase {
+    const char *name;
+    u64 end_tsc;
+};
+
+static struct boot_phase boot_phases[BOOT_PHASES_MAX];
+static size_t boot_phase_count;
+
+static u64 boot_tsc;
+static u64 tsc_khz;
+static u64 tsc_ns_mult; // ns = (cycles * tsc_ns_mult) >> 32
+
+static const u32 nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548, 7620, 6100, 4904, 3906,
+    /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+    /*   0 */ 1024, 820, 655, 526, 423,
+    /*   5 */ 335, 272, 215, 172, 137,
+    /*  10 */ 110, 87, 70, 56, 45,
+    /*  15 */ 36, 29, 23, 18, 15,
+};
+
+static struct kmem_cache proc_cache;
+static struct kmem_cache idr_node_cache;
+
+static struct kmem_cache endpoint_cache;
+static struct kmem_cache channel_cache;
+static struct kmem_cache vm_cache;
+static struct kmem_cache vm_area_cache;
+
+static struct time_page *time_page;
+static struct kmem_cache cap_table_cache;
+
+static struct idr tid_idr;
 
-static struct proc proc_table[PROC_COUNT];
+static struct list sleep_table[SLEEP_HASH_SIZE];
+static struct list futex_table[FUTEX_HASH_SIZE];
 
 extern void switch_proc(struct context *old, struct context *new);
+extern void kthread_entry(void);
+extern void uthread_entry(void);
 
 static void pushcli(void);
 static void popcli(void);
+static void preempt_disable(void);
+static void preempt_enable(void);
+static void cond_resched(void);
+static size_t reclaim_memory(void);
+static void cap_table_get(struct cap_table *t);
+static void cap_table_put(struct cap_table *t);
+
+static u64 rdtsc(void) {
+    u32 lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
+static void cpuid(u32 leaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
 
 static u64 readrflags(void) {
     u64 rflags;
@@ -551,8 +1574,10 @@ static void serial_puts(const char *s) {
         serial_putc(*s++);
 }
 
+// Interrupts stay on while we poll the uart, only other threads are kept
+// from interleaving with the line
 static void early_printf(const char *fmt, ...) {
-    pushcli();
+    preempt_disable();
 
     va_list args;
     va_start(args, fmt);
@@ -708,34 +1733,67 @@ static void early_printf(const char *fmt, ...) {
             }
         } else {
             serial_putc(*p);
+            if (*p == '\n' && p[1])
+                cond_resched();
         }
     }
 
     va_end(args);
 
-    popcli();
+    preempt_enable();
 }
 
 static void panic(const char *msg) {
     serial_puts(msg);
+#ifdef BENCH
+    // Fail the make bench run rather than hang it
+    outb(QEMU_EXIT_PORT, 1);
+#endif
     hcf();
 }
 
-static void pushcli(void) {
+// APs are not started yet, so the BSP is the only cpu
+static struct cpu *my_cpu(void) {
+    return &cpus[0];
+}
+
+static void trace_record(struct latency_trace *t, u64 start, uintptr_t site, uintptr_t end_site) {
+    u64 span = rdtsc() - start;
+
+    if (span > t->max) {
+        t->max = span;
+        t->max_site = site;
+        t->max_end_site = end_site;
+    }
+}
+
+// pushcli/popcli and preempt_disable/preempt_enable are kept out of line so
+// the return address names their caller
+static __attribute__((noinline)) void pushcli(void) {
     u64 rflags = readrflags();
     cli();
-    if (cli_count == 0)
-        interrupts_enabled = rflags & RFLAG_IF;
-    cli_count++;
+    struct cpu *c = my_cpu();
+    if (c->cli_count == 0) {
+        c->interrupts_enabled = rflags & RFLAG_IF;
+        if (TRACE_LATENCY && c->interrupts_enabled) {
+            c->irqoff.start = rdtsc();
+            c->irqoff.start_site = (uintptr_t)__builtin_return_address(0);
+        }
+    }
+    c->cli_count++;
 }
 
-static void popcli(void) {
+static __attribute__((noinline)) void popcli(void) {
     if (readrflags() & RFLAG_IF)
         panic("popcli - interruptable");
-    if (cli_count == 0)
+    struct cpu *c = my_cpu();
+    if (c->cli_count == 0)
         panic("popcli - cli_count =+ 0");
-    if (--cli_count == 0 && interrupts_enabled)
+    if (--c->cli_count == 0 && c->interrupts_enabled) {
+        if (TRACE_LATENCY)
+            trace_record(&c->irqoff, c->irqoff.start, c->irqoff.start_site, (uintptr_t)__builtin_return_address(0));
         sti();
+    }
 }
 
 static void validate_bootloader(void) {
@@ -747,6 +1805,8 @@ static void validate_bootloader(void) {
         panic("Bad memmap request\n");
     if (hhdm_request.response == NULL)
         panic("Bad hhdm request\n");
+    if (executable_address_request.response == NULL)
+        panic("Bad executable address request\n");
 }
 
 static void load_framebuffer(void) {
@@ -797,191 +1857,462 @@ static void load_memmap(void) {
     }
 }
 
-static void load_hhdm(void) {
-    hhdm = hhdm_request.response->offset;
+static void load_executable_address(void) {
+    kernel_phys_base = executable_address_request.response->physical_base;
 }
 
-static uintptr_t p2v(uintptr_t phys) {
-    return phys + hhdm;
-}
+static void load_modules(void) {
+    struct limine_module_response *response = module_request.response;
+    if (!response)
+        return;
 
-static uintptr_t v2p(uintptr_t virt) {
-    return virt - hhdm;
-}
+    for (size_t i = 0; i < response->module_count; i++) {
+        if (boot_module_count >= MAX_BOOT_MODULES) {
+            early_printf("Too many modules, ignoring the rest\n");
+            break;
+        }
+
+        struct limine_file *file = response->modules[i];
+        struct boot_module *m = &boot_modules[boot_module_count++];
+        m->data = file->address;
+        m->size = file->size;
 
-static size_t page_round_up(uintptr_t addr) {
-    return (addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        const char *name = file->path;
+        for (const char *p = file->path; *p; p++) {
+            if (*p == '/')
+                name = p + 1;
+        }
+        size_t len = 0;
+        for (; name[len] && len < BOOT_MODULE_NAME - 1; len++)
+            m->name[len] = name[len];
+        m->name[len] = 0;
+    }
 }
 
-static size_t page_round_down(uintptr_t addr) {
-    return addr & ~(PAGE_SIZE - 1);
+static void load_hhdm(void) {
+    hhdm = hhdm_request.response->offset;
 }
 
-static void early_kfree(void *addr, size_t order) {
-    if ((size_t)addr % PAGE_SIZE != 0) {
-        panic("Attempted to free unaligned page\n");
-    }
+static void free_usable_regions(void) {
+    for (size_t i = 0; i < memmap.region_count; i++) {
+        if (memmap.regions[i].type != MEMMAP_REGION_USABLE)
+            continue;
 
-    struct free_list_node *n = (struct free_list_node *)addr;
-    n->next = 0;
+        char *base = (char *)p2v(memmap.regions[i].phys);
+        char *end = base + memmap.regions[i].size;
 
-    struct free_list_node **pcurr = &free_list[order];
-    struct free_list_node *curr = free_list[order];
+        free_range(base, end);
+    }
+}
 
-    while (curr) {
-        if (order < MAX_ORDER) {
-            uintptr_t buddy = (uintptr_t)n ^ (PAGE_SIZE << order);
-            if ((uintptr_t)curr == buddy) {
-                *pcurr = curr->next;
+// Memory the allocator owns now or after reclaim_boot_memory
+static int region_is_ram(enum memmap_region_type type) {
+    return type == MEMMAP_REGION_USABLE || type == MEMMAP_REGION_BOOTLOADER_RECLAIMABLE ||
+           type == MEMMAP_REGION_ACPI_RECLAIMABLE;
+}
 
-                void *block;
-                if (n < curr)
-                    block = n;
-                else
-                    block = curr;
+// Hands the bootloader's and firmware's leftovers to the allocator. The
+// memmap, framebuffer and ACPI tables were all copied out by the load_*
+// and *_parse functions, and the caller is off the boot stack.
+static void reclaim_boot_memory(void) {
+    size_t reclaimed = 0;
 
-                early_kfree(block, order + 1);
-                return;
-            }
-        }
+    for (size_t i = 0; i < memmap.region_count; i++) {
+        if (memmap.regions[i].type != MEMMAP_REGION_BOOTLOADER_RECLAIMABLE &&
+            memmap.regions[i].type != MEMMAP_REGION_ACPI_RECLAIMABLE)
+            continue;
 
-        pcurr = &curr->next;
-        curr = curr->next;
+        char *base = (char *)p2v(memmap.regions[i].phys);
+        free_range(base, base + memmap.regions[i].size);
+        memmap.regions[i].type = MEMMAP_REGION_USABLE;
+        reclaimed += memmap.regions[i].size;
     }
 
-    n->next = *pcurr;
-    *pcurr = n;
+    early_printf("reclaimed %lu KB of boot memory\n", reclaimed >> 10);
 }
 
-static void free_range(void *base, void *end) {
-    size_t p = page_round_up((uintptr_t)base);
-    size_t e = page_round_down((uintptr_t)end);
+static void kmem_cache_init(struct kmem_cache *cache, size_t size) {
+    if (size < sizeof(struct free_list_node))
+        size = sizeof(struct free_list_node);
+    if (size > PAGE_SIZE)
+        panic("kmem_cache object larger than a page\n");
 
-    while (p < e) {
-        size_t remaining = e - p;
-        size_t order = MAX_ORDER;
+    cache->size = (size + 7) & ~7UL;
+    cache->active = 0;
+    cache->free = 0;
+}
 
-        while (order > 0 && ((size_t)PAGE_SIZE << order > remaining || (p & (((size_t)PAGE_SIZE << order) - 1)) != 0))
-            order--;
+// Objects are carved out of whole pages that are never handed back to the
+// buddy allocator, so a cache only ever grows to its high water mark.
+static void *kmem_cache_alloc(struct kmem_cache *cache) {
+    if (!cache->free) {
+        char *page = try_early_kalloc(0);
+        if (!page)
+            return 0;
 
-        early_kfree((void *)p, order);
-        p += PAGE_SIZE << order;
+        for (size_t off = 0; off + cache->size <= PAGE_SIZE; off += cache->size) {
+            struct free_list_node *n = (struct free_list_node *)(page + off);
+            n->next = cache->free;
+            cache->free = n;
+        }
     }
+
+    struct free_list_node *n = cache->free;
+    cache->free = n->next;
+    cache->active++;
+    memset(n, 0, cache->size);
+
+    return n;
 }
 
-static void free_usable_regions(void) {
-    for (size_t i = 0; i < memmap.region_count; i++) {
-        if (memmap.regions[i].type != MEMMAP_REGION_USABLE)
-            continue;
+static void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    struct free_list_node *n = obj;
+    n->next = cache->free;
+    cache->free = n;
+    cache->active--;
+}
 
-        char *base = (char *)p2v(memmap.regions[i].phys);
-        char *end = base + memmap.regions[i].size;
+static void list_init(struct list *l) {
+    l->next = l;
+    l->prev = l;
+}
 
-        free_range(base, end);
-    }
+static int list_empty(struct list *l) {
+    return l->next == l;
 }
 
-static void *early_kalloc(size_t order) {
-    if (order > MAX_ORDER) {
-        panic("Invalid order for early_kalloc\n");
-    }
+static void list_add_tail(struct list *head, struct list *n) {
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+}
 
-    struct free_list_node **pcurr = &free_list[order];
-    struct free_list_node *curr = free_list[order];
+static void list_del(struct list *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->next = n;
+    n->prev = n;
+}
 
-    if (curr) {
-        *pcurr = curr->next;
-        memset(curr, 0, PAGE_SIZE << order);
+// Radix tree of IDR_LEVELS levels with IDR_SIZE slots per node. The full
+// bitmaps let idr_alloc find the lowest free id without scanning.
+static int idr_alloc(struct idr *idr, void *ptr) {
+    struct idr_node *path[IDR_LEVELS];
 
-        return (void *)curr;
+    if (!idr->root) {
+        idr->root = kmem_cache_alloc(&idr_node_cache);
+        if (!idr->root)
+            return -1;
     }
 
-    for (size_t higher = order + 1; higher <= MAX_ORDER; higher++) {
-        struct free_list_node **phigh = &free_list[higher];
-        struct free_list_node *high_curr = free_list[higher];
+    struct idr_node *node = idr->root;
+    int id = 0;
 
-        if (high_curr) {
-            *phigh = high_curr->next;
+    for (int level = IDR_LEVELS - 1; level >= 0; level--) {
+        if (node->full == ~0ULL)
+            return -1;
 
-            while (higher > order) {
-                higher--;
+        int slot = __builtin_ctzll(~node->full);
+        path[level] = node;
+        id = (id << IDR_BITS) | slot;
 
-                struct free_list_node *buddy = (struct free_list_node *)((uintptr_t)high_curr + (PAGE_SIZE << higher));
+        if (level == 0)
+            break;
 
-                buddy->next = free_list[higher];
-                free_list[higher] = buddy;
-            }
+        if (!node->slots[slot]) {
+            node->slots[slot] = kmem_cache_alloc(&idr_node_cache);
+            if (!node->slots[slot])
+                return -1;
+        }
+        node = node->slots[slot];
+    }
 
-            memset(high_curr, 0, PAGE_SIZE << order);
+    node->slots[id & IDR_MASK] = ptr;
 
-            return (void *)high_curr;
-        }
+    for (int level = 0; level < IDR_LEVELS; level++) {
+        path[level]->full |= 1ULL << ((id >> (level * IDR_BITS)) & IDR_MASK);
+        if (path[level]->full != ~0ULL)
+            break;
     }
 
-    panic("Could not find suitable block for early_kalloc\n");
+    idr->count++;
+    return id;
 }
 
-static ptl3_t *walk_ptl4(ptl4_t *ptl4, size_t index, int create) {
-    if (!(ptl4->table[index].entry & PAGE_P)) {
-        if (!create)
-            return 0;
+static void *idr_find(struct idr *idr, int id) {
+    if (id < 0 || id >= IDR_MAX)
+        return 0;
 
-        void *new_page = early_kalloc(0);
-        memset(new_page, 0, PAGE_SIZE);
-        ptl4->table[index].entry = v2p((uintptr_t)new_page) | PAGE_P | PAGE_RW;
-    }
+    struct idr_node *node = idr->root;
+    for (int level = IDR_LEVELS - 1; level > 0 && node; level--)
+        node = node->slots[(id >> (level * IDR_BITS)) & IDR_MASK];
 
-    return (ptl3_t *)p2v(ptl4->table[index].entry & ~0xFFF);
+    if (!node || !(node->full & (1ULL << (id & IDR_MASK))))
+        return 0;
+
+    return node->slots[id & IDR_MASK];
 }
 
-static ptl2_t *walk_ptl3(ptl3_t *ptl3, size_t index, int create) {
-    if (!(ptl3->table[index].entry & PAGE_P)) {
-        if (!create)
-            return 0;
+static void idr_remove(struct idr *idr, int id) {
+    if (id < 0 || id >= IDR_MAX)
+        return;
 
-        void *new_page = early_kalloc(0);
-        memset(new_page, 0, PAGE_SIZE);
-        ptl3->table[index].entry = v2p((uintptr_t)new_page) | PAGE_P | PAGE_RW;
-    }
+    // An id that is not allocated never sits under a full bit, so clearing
+    // the path on the way down is harmless in that case.
+    struct idr_node *node = idr->root;
+    for (int level = IDR_LEVELS - 1; level >= 0 && node; level--) {
+        int slot = (id >> (level * IDR_BITS)) & IDR_MASK;
+        u64 bit = 1ULL << slot;
+
+        if (level == 0) {
+            if (node->full & bit) {
+                node->full &= ~bit;
+                node->slots[slot] = 0;
+                idr->count--;
+            }
+            return;
+        }
 
-    return (ptl2_t *)p2v(ptl3->table[index].entry & ~0xFFF);
+        node->full &= ~bit;
+        node = node->slots[slot];
+    }
 }
 
-static ptl1_t *walk_ptl2(ptl2_t *ptl2, size_t index, int create) {
-    if (!(ptl2->table[index].entry & PAGE_P)) {
-        if (!create)
-            return 0;
+static void rb_rotate_left(struct rb_tree *t, struct rb_node *x) {
+    struct rb_node *y = x->right;
 
-        void *new_page = early_kalloc(0);
-        memset(new_page, 0, PAGE_SIZE);
-        ptl2->table[index].entry = v2p((uintptr_t)new_page) | PAGE_P | PAGE_RW;
-    }
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
 
-    return (ptl1_t *)p2v(ptl2->table[index].entry & ~0xFFF);
+    y->parent = x->parent;
+    if (!x->parent)
+        t->root = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+
+    y->left = x;
+    x->parent = y;
 }
 
-static void map_page_early(ptl4_t *l4, uintptr_t pa, uintptr_t va, uintptr_t flags) {
-    uintptr_t l4_index = (va >> 39) & 0x1FF;
-    uintptr_t l3_index = (va >> 30) & 0x1FF;
-    uintptr_t l2_index = (va >> 21) & 0x1FF;
-    uintptr_t l1_index = (va >> 12) & 0x1FF;
+static void rb_rotate_right(struct rb_tree *t, struct rb_node *x) {
+    struct rb_node *y = x->left;
 
-    ptl3_t *l3 = walk_ptl4(l4, l4_index, 1);
-    ptl2_t *l2 = walk_ptl3(l3, l3_index, 1);
-    ptl1_t *l1 = walk_ptl2(l2, l2_index, 1);
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+
+    y->parent = x->parent;
+    if (!x->parent)
+        t->root = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
 
-    l1->table[l1_index].entry = (pa & ~0xFFF) | (flags & 0xFFF);
+    y->right = x;
+    x->parent = y;
+}
+
+static struct rb_node *rb_next(struct rb_node *n) {
+    if (n->right) {
+        n = n->right;
+        while (n->left)
+            n = n->left;
+        return n;
+    }
+
+    while (n->parent && n == n->parent->right)
+        n = n->parent;
+
+    return n->parent;
+}
+
+// Links n at *link below parent, as found by the caller's search
+static void rb_insert(struct rb_tree *t, struct rb_node *n, struct rb_node *parent, struct rb_node **link, int leftmost) {
+    n->parent = parent;
+    n->left = 0;
+    n->right = 0;
+    n->red = 1;
+    *link = n;
+
+    if (leftmost)
+        t->leftmost = n;
+
+    while (n->parent && n->parent->red) {
+        struct rb_node *gp = n->parent->parent;
+
+        if (n->parent == gp->left) {
+            struct rb_node *uncle = gp->right;
+            if (uncle && uncle->red) {
+                n->parent->red = 0;
+                uncle->red = 0;
+                gp->red = 1;
+                n = gp;
+            } else {
+                if (n == n->parent->right) {
+                    n = n->parent;
+                    rb_rotate_left(t, n);
+                }
+                n->parent->red = 0;
+                gp->red = 1;
+                rb_rotate_right(t, gp);
+            }
+        } else {
+            struct rb_node *uncle = gp->left;
+            if (uncle && uncle->red) {
+                n->parent->red = 0;
+                uncle->red = 0;
+                gp->red = 1;
+                n = gp;
+            } else {
+                if (n == n->parent->left) {
+                    n = n->parent;
+                    rb_rotate_right(t, n);
+                }
+                n->parent->red = 0;
+                gp->red = 1;
+                rb_rotate_left(t, gp);
+            }
+        }
+    }
+
+    t->root->red = 0;
+}
+
+static void rb_transplant(struct rb_tree *t, struct rb_node *u, struct rb_node *v) {
+    if (!u->parent)
+        t->root = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+
+    if (v)
+        v->parent = u->parent;
+}
+
+static void rb_erase_fixup(struct rb_tree *t, struct rb_node *x, struct rb_node *parent) {
+    while (x != t->root && (!x || !x->red)) {
+        if (x == parent->left) {
+            struct rb_node *w = parent->right;
+            if (w->red) {
+                w->red = 0;
+                parent->red = 1;
+                rb_rotate_left(t, parent);
+                w = parent->right;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = 1;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!w->right || !w->right->red) {
+                    w->left->red = 0;
+                    w->red = 1;
+                    rb_rotate_right(t, w);
+                    w = parent->right;
+                }
+                w->red = parent->red;
+                parent->red = 0;
+                if (w->right)
+                    w->right->red = 0;
+                rb_rotate_left(t, parent);
+                x = t->root;
+            }
+        } else {
+            struct rb_node *w = parent->left;
+            if (w->red) {
+                w->red = 0;
+                parent->red = 1;
+                rb_rotate_right(t, parent);
+                w = parent->left;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = 1;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!w->left || !w->left->red) {
+                    w->right->red = 0;
+                    w->red = 1;
+                    rb_rotate_left(t, w);
+                    w = parent->left;
+                }
+                w->red = parent->red;
+                parent->red = 0;
+                if (w->left)
+                    w->left->red = 0;
+                rb_rotate_right(t, parent);
+                x = t->root;
+            }
+        }
+    }
+
+    if (x)
+        x->red = 0;
+}
+
+static void rb_erase(struct rb_tree *t, struct rb_node *z) {
+    struct rb_node *x;
+    struct rb_node *parent;
+    int removed_red = z->red;
+
+    if (t->leftmost == z)
+        t->leftmost = rb_next(z);
+
+    if (!z->left) {
+        x = z->right;
+        parent = z->parent;
+        rb_transplant(t, z, z->right);
+    } else if (!z->right) {
+        x = z->left;
+        parent = z->parent;
+        rb_transplant(t, z, z->left);
+    } else {
+        struct rb_node *y = z->right;
+        while (y->left)
+            y = y->left;
+
+        removed_red = y->red;
+        x = y->right;
+
+        if (y->parent == z) {
+            parent = y;
+        } else {
+            parent = y->parent;
+            rb_transplant(t, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+
+        rb_transplant(t, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    if (!removed_red)
+        rb_erase_fixup(t, x, parent);
 }
 
 static void switch_ptl4(ptl4_t *l4) {
     asm volatile ("mov %0, %%cr3" : :  "r"(v2p((uintptr_t)l4)) : "memory");
 }
 
+// One line for the whole direct map, polled serial is slow enough to
+// show up in the boot profile
 static void init_paging(void) {
     kernel_ptl4 = early_kalloc(0);
-    memset(kernel_ptl4, 0, PAGE_SIZE);
+    size_t mapped = 0;
 
     for (size_t i = 0; i < memmap.region_count; i++) {
+        uintptr_t phys = memmap.regions[i].phys;
+        size_t size = page_round_up(memmap.regions[i].size);
+
         switch (memmap.regions[i].type) {
             case MEMMAP_REGION_USABLE:
             case MEMMAP_REGION_RESERVED:
@@ -991,432 +2322,6488 @@ static void init_paging(void) {
             case MEMMAP_REGION_BOOTLOADER_RECLAIMABLE:
             case MEMMAP_REGION_FRAMEBUFFER:
             case MEMMAP_REGION_ACPI_TABLES:
-                early_printf("mapping region: %lx -> %lx, size: %lx\n", memmap.regions[i].phys, p2v(memmap.regions[i].phys), memmap.regions[i].size);
-                for (uintptr_t j = 0; j < memmap.regions[i].size; j += PAGE_SIZE) {
-                    uintptr_t pa = j + memmap.regions[i].phys;
-                    uintptr_t va = p2v(pa);
-                    map_page_early(kernel_ptl4, pa, va, PAGE_P | PAGE_RW);
-                }
+                map_range_early(kernel_ptl4, phys, p2v(phys), size, PAGE_P | PAGE_RW);
+                mapped += size;
                 break;
             case MEMMAP_REGION_EXECUTABLE_AND_MODULES: {
-                for (uintptr_t j = 0; j < memmap.regions[i].size; j += PAGE_SIZE) {
-                    uintptr_t pa = j + memmap.regions[i].phys;
-                    uintptr_t va = j + (uintptr_t)__kernel_offset;
-                    uintptr_t flags = PAGE_P;
-                    early_printf("mapping region: %lx -> %lx, size: %lx\n", pa, va, memmap.regions[i].size);
-                    if (va >= (uintptr_t)__data_start)
-                        flags |= PAGE_RW;
-                    map_page_early(kernel_ptl4, pa, va, flags);
-                }
+                // Modules are read through the direct map like everything
+                // else, only the kernel also gets its own mapping
+                map_range_early(kernel_ptl4, phys, p2v(phys), size, PAGE_P | PAGE_RW);
+                mapped += size;
+                if (kernel_phys_base < phys || kernel_phys_base >= phys + size)
+                    break;
+
+                // Text and rodata read only, the rest from __data_start on
+                // writable
+                size_t image = phys + size - kernel_phys_base;
+                size_t ro = page_round_up((uintptr_t)__data_start - (uintptr_t)__kernel_offset);
+                if (ro > image)
+                    ro = image;
+                map_range_early(kernel_ptl4, kernel_phys_base, (uintptr_t)__kernel_offset, ro, PAGE_P);
+                map_range_early(kernel_ptl4, kernel_phys_base + ro, (uintptr_t)__kernel_offset + ro, image - ro, PAGE_P | PAGE_RW);
+                early_printf("mapping kernel: %lx -> %lx, size: %lx\n", kernel_phys_base, (uintptr_t)__kernel_offset, image);
                 break;
             }
         }
     }
+    early_printf("mapping direct map: %lu regions, %lu MB\n", memmap.region_count, mapped >> 20);
+
+    // Address spaces copy the upper half of kernel_ptl4, so every kernel
+    // ptl3 has to exist before the first one is created
+    for (size_t i = PTL4_ENTRY_COUNT / 2; i < PTL4_ENTRY_COUNT; i++) {
+        if (!walk_ptl4(kernel_ptl4, i, 1))
+            panic("Out of memory for page tables\n");
+    }
 
     switch_ptl4(kernel_ptl4);
 }
 
-static void madt_parse(struct acpi_madt *madt) {
-    lapic = (volatile u32 *)p2v(madt->lapic_addr);
+static u32 *frame_ref(uintptr_t pa) {
+    size_t pfn = pa / PAGE_SIZE;
+    size_t chunk = pfn / FRAME_REFS_PER_CHUNK;
 
-    u8 *ptr = madt->entries;
-    u8 *end = (u8 *)madt + madt->header.length;
+    if (chunk >= frame_ref_chunks || !frame_refs[chunk])
+        panic("frame_ref - not a usable frame\n");
 
-    while (ptr + 2 <= end) {
-        u8 type = ptr[0];
-        u8 len = ptr[1];
+    return &frame_refs[chunk][pfn % FRAME_REFS_PER_CHUNK];
+}
 
-        if (len < 2 || ptr + len > end)
-            break;
+static void frame_get(uintptr_t pa) {
+    (*frame_ref(pa))++;
+}
 
-        switch (type) {
-            case MADT_IOAPIC: {
-                struct madt_ioapic_entry *ioe = (struct madt_ioapic_entry *)ptr;
-                if (ioapic_count >= MAX_IOAPICS) {
-                    panic("Too many ioapics\n");
-                }
-                ioapics[ioapic_count].id = ioe->ioapic_id;
-                ioapics[ioapic_count].addr = (volatile u32 *)p2v(ioe->ioapic_addr);
-                ioapics[ioapic_count].gsi_base = ioe->gsi_base;
-                ioapic_count++;
-                break;
-            }
-            case MADT_LAPIC: {
-                struct madt_lapic_entry *le = (struct madt_lapic_entry *)ptr;
-                if (lapic_count >= MAX_LAPICS) {
-                    panic("Too many lapics\n");
+static void frame_put(uintptr_t pa) {
+    u32 *ref = frame_ref(pa);
+
+    if (*ref == 0)
+        panic("frame_put - frame not referenced\n");
+    if (--*ref == 0)
+        early_kfree((void *)p2v(pa), 0);
+}
+
+// Memory the allocator owns now or after reclaim_boot_memory, and modules
+// that get mapped into user space
+static int region_has_frames(enum memmap_region_type type) {
+    return region_is_ram(type) || type == MEMMAP_REGION_EXECUTABLE_AND_MODULES;
+}
+
+// Allocates count chunks only for the parts of memory that have frames
+static void init_frames(void) {
+    uintptr_t end = 0;
+    for (size_t i = 0; i < memmap.region_count; i++) {
+        if (region_has_frames(memmap.regions[i].type) && memmap.regions[i].phys + memmap.regions[i].size > end)
+            end = memmap.regions[i].phys + memmap.regions[i].size;
+    }
+
+    frame_ref_chunks = (end / PAGE_SIZE + FRAME_REFS_PER_CHUNK - 1) / FRAME_REFS_PER_CHUNK;
+
+    size_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < frame_ref_chunks * sizeof(*frame_refs))
+        order++;
+    frame_refs = early_kalloc(order);
+
+    for (size_t i = 0; i < memmap.region_count; i++) {
+        if (!region_has_frames(memmap.regions[i].type) || !memmap.regions[i].size)
+            continue;
+
+        size_t first = memmap.regions[i].phys / PAGE_SIZE / FRAME_REFS_PER_CHUNK;
+        size_t last = (memmap.regions[i].phys + memmap.regions[i].size - 1) / PAGE_SIZE / FRAME_REFS_PER_CHUNK;
+        for (size_t c = first; c <= last; c++) {
+            if (!frame_refs[c])
+                frame_refs[c] = early_kalloc(0);
+        }
+    }
+}
+
+static void tlb_batch_init(struct tlb_batch *b, struct vm_space *vm) {
+    b->vm = vm;
+    b->full_flush = 0;
+    b->page_count = 0;
+    b->frame_count = 0;
+}
+
+// Only this cpu can have b->vm loaded until the APs run threads, after
+// that the other cpus in the mask will need a shootdown here too
+static void tlb_flush(struct tlb_batch *b) {
+    struct cpu *c = my_cpu();
+
+    if (c->vm == b->vm) {
+        if (b->full_flush) {
+            switch_ptl4(b->vm->ptl4);
+        } else {
+            for (size_t i = 0; i < b->page_count; i++)
+                asm volatile("invlpg (%0)" : : "r"(b->pages[i]) : "memory");
+        }
+    }
+
+    for (size_t i = 0; i < b->frame_count; i++)
+        frame_put(b->frames[i]);
+
+    b->full_flush = 0;
+    b->page_count = 0;
+    b->frame_count = 0;
+}
+
+static void tlb_batch_add(struct tlb_batch *b, uintptr_t va) {
+    if (b->page_count < TLB_BATCH_PAGES)
+        b->pages[b->page_count++] = va;
+    else
+        b->full_flush = 1;
+}
+
+static void tlb_batch_put_frame(struct tlb_batch *b, uintptr_t pa) {
+    if (b->frame_count == TLB_BATCH_FRAMES)
+        tlb_flush(b);
+    b->frames[b->frame_count++] = pa;
+}
+
+static void vm_activate(struct cpu *c, struct vm_space *vm) {
+    if (c->vm == vm)
+        return;
+
+    c->vm = vm;
+    switch_ptl4(vm ? vm->ptl4 : kernel_ptl4);
+}
+
+static void init_vm(void) {
+    init_frames();
+    kmem_cache_init(&vm_cache, sizeof(struct vm_space));
+    kmem_cache_init(&vm_area_cache, sizeof(struct vm_area));
+}
+
+static void vm_destroy(struct vm_space *vm) {
+    pushcli();
+
+    struct cpu *c = my_cpu();
+    if (c->vm == vm)
+        vm_activate(c, 0);
+
+    for (size_t i = 0; i < PTL4_ENTRY_COUNT / 2; i++) {
+        ptl3_t *l3 = walk_ptl4(vm->ptl4, i, 0);
+        if (!l3)
+            continue;
+        for (size_t j = 0; j < PTL3_ENTRY_COUNT; j++) {
+            ptl2_t *l2 = walk_ptl3(l3, j, 0);
+            if (!l2)
+                continue;
+            for (size_t k = 0; k < PTL2_ENTRY_COUNT; k++) {
+                ptl1_t *l1 = walk_ptl2(l2, k, 0);
+                if (!l1)
+                    continue;
+                for (size_t l = 0; l < PTL1_ENTRY_COUNT; l++) {
+                    if (l1->table[l].entry & PAGE_P)
+                        frame_put(l1->table[l].entry & PAGE_ADDR_MASK);
                 }
-                lapics[lapic_count].cpu_id = le->cpu_id;
-                lapics[lapic_count].apic_id = le->apic_id;
-                lapics[lapic_count].flags = le->flags;
-                lapic_count++;
+                early_kfree(l1, 0);
             }
-            default:
-                break;
+            early_kfree(l2, 0);
         }
-        ptr += len;
+        early_kfree(l3, 0);
     }
+
+    while (!list_empty(&vm->areas)) {
+        struct vm_area *a = container_of(vm->areas.next, struct vm_area, node);
+        list_del(&a->node);
+        kmem_cache_free(&vm_area_cache, a);
+    }
+
+    early_kfree(vm->ptl4, 0);
+    kmem_cache_free(&vm_cache, vm);
+
+    popcli();
 }
 
-static void xsdt_parse(struct acpi_xsdt *xsdt) {
-    size_t entries = (xsdt->header.length - sizeof(xsdt->header)) / 8;
+// Leaf entry for a user va, allocating the tables on the way when create.
+// NULL if a table is missing, or could not be allocated.
+static ptl1e_t *vm_pte(struct vm_space *vm, uintptr_t va, int create) {
+    size_t l4_index = (va >> 39) & 0x1FF;
+    size_t l3_index = (va >> 30) & 0x1FF;
+    size_t l2_index = (va >> 21) & 0x1FF;
+
+    ptl3_t *l3 = walk_ptl4(vm->ptl4, l4_index, create);
+    if (!l3)
+        return 0;
+    ptl2_t *l2 = walk_ptl3(l3, l3_index, create);
+    if (!l2)
+        return 0;
+    ptl1_t *l1 = walk_ptl2(l2, l2_index, create);
+    if (!l1)
+        return 0;
+
+    if (create) {
+        vm->ptl4->table[l4_index].entry |= PAGE_U;
+        l3->table[l3_index].entry |= PAGE_U;
+        l2->table[l2_index].entry |= PAGE_U;
+    }
 
-    for (size_t i = 0; i < entries; i++) {
-        struct acpi_sdt_header *hdr = (struct acpi_sdt_header *)p2v(xsdt->entries[i]);
-        if (!hdr)
-            continue;
+    return &l1->table[(va >> 12) & 0x1FF];
+}
 
-        if (hdr->signature[0] == 'A' && hdr->signature[1] == 'P' && hdr->signature[2] == 'I' && hdr->signature[3] == 'C') {
-            madt_parse((struct acpi_madt *)hdr);
-            return;
-        }
+// Returns NULL when out of memory
+static struct vm_space *vm_create(void) {
+    pushcli();
+
+    struct vm_space *vm = kmem_cache_alloc(&vm_cache);
+    if (!vm) {
+        popcli();
+        return NULL;
+    }
+    list_init(&vm->areas);
+    vm->refs = 1;
+
+    vm->ptl4 = try_early_kalloc(0);
+    if (!vm->ptl4) {
+        kmem_cache_free(&vm_cache, vm);
+        popcli();
+        return NULL;
+    }
+
+    memcpy(&vm->ptl4->table[PTL4_ENTRY_COUNT / 2], &kernel_ptl4->table[PTL4_ENTRY_COUNT / 2],
+           sizeof(ptl4e_t) * PTL4_ENTRY_COUNT / 2);
+
+    ptl1e_t *pte = vm_pte(vm, TIME_PAGE_VA, 1);
+    if (!pte) {
+        popcli();
+        vm_destroy(vm);
+        return NULL;
     }
+    frame_get(v2p((uintptr_t)time_page));
+    pte->entry = v2p((uintptr_t)time_page) | PAGE_P | PAGE_U;
 
-    panic("APIC entry not found in xsdt\n");
+    popcli();
+    return vm;
 }
 
-static void rsdt_parse(struct acpi_rsdt *rsdt) {
-    size_t entries = (rsdt->header.length - sizeof(rsdt->header)) / 8;
+static void vm_get(struct vm_space *vm) {
+    __atomic_fetch_add(&vm->refs, 1, __ATOMIC_RELAXED);
+}
 
-    for (size_t i = 0; i < entries; i++) {
-        struct acpi_sdt_header *hdr = (struct acpi_sdt_header *)p2v(rsdt->entries[i]);
-        if (!hdr)
+// Frees vm when the last thread or capability lets go of it
+static void vm_put(struct vm_space *vm) {
+    if (__atomic_sub_fetch(&vm->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        vm_destroy(vm);
+}
+
+// Ranges end below the time page, which stays mapped for the life of the
+// vm
+static int vm_range_ok(uintptr_t va, size_t count) {
+    return va % PAGE_SIZE == 0 && count && count <= TIME_PAGE_VA / PAGE_SIZE &&
+           va <= TIME_PAGE_VA - count * PAGE_SIZE;
+}
+
+// Every page in the range mapped when present, unmapped otherwise
+static int vm_range_is(struct vm_space *vm, uintptr_t va, size_t count, int present) {
+    for (size_t i = 0; i < count; i++) {
+        ptl1e_t *pte = vm_pte(vm, va + i * PAGE_SIZE, 0);
+        int mapped = pte && (pte->entry & PAGE_P);
+        if (mapped != present)
+            return 0;
+    }
+    return 1;
+}
+
+// Creates every page table a range needs, so it can then be filled in
+// without a failure halfway. Tables made before running out of memory stay
+// and are freed with the vm.
+static int vm_prepare(struct vm_space *vm, uintptr_t va, size_t count) {
+    for (size_t i = 0; i < count; i += PTL1_ENTRY_COUNT - ((va >> 12) + i) % PTL1_ENTRY_COUNT) {
+        if (!vm_pte(vm, va + i * PAGE_SIZE, 1))
+            return -1;
+    }
+    return 0;
+}
+
+static uintptr_t vm_lookup(struct vm_space *vm, uintptr_t va) {
+    ptl1e_t *pte = vm_pte(vm, va, 0);
+
+    if (!pte || !(pte->entry & PAGE_P))
+        return 0;
+    return pte->entry & PAGE_ADDR_MASK;
+}
+
+static void vm_unmap_batch(struct vm_space *vm, uintptr_t va, size_t count, struct tlb_batch *b) {
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t page = va + i * PAGE_SIZE;
+        ptl1e_t *pte = vm_pte(vm, page, 0);
+        if (!pte || !(pte->entry & PAGE_P))
             continue;
 
-        if (hdr->signature[0] == 'A' && hdr->signature[1] == 'P' && hdr->signature[2] == 'I' && hdr->signature[3] == 'C') {
-            madt_parse((struct acpi_madt *)hdr);
-            return;
+        uintptr_t pa = pte->entry & PAGE_ADDR_MASK;
+        pte->entry = 0;
+        tlb_batch_add(b, page);
+        tlb_batch_put_frame(b, pa);
+    }
+}
+
+static int vm_unmap(struct vm_space *vm, uintptr_t va, size_t count) {
+    if (!vm_range_ok(va, count))
+        return -1;
+
+    pushcli();
+    struct tlb_batch b;
+    tlb_batch_init(&b, vm);
+    vm_unmap_batch(vm, va, count, &b);
+    tlb_flush(&b);
+    popcli();
+    return 0;
+}
+
+// A zeroed frame for user memory, taken from the page cache when memory is
+// short. NULL when nothing more can be freed.
+static void *user_frame_alloc(void) {
+    void *frame = try_early_kalloc(0);
+
+    while (!frame && reclaim_memory())
+        frame = try_early_kalloc(0);
+    return frame;
+}
+
+// Backs an unmapped range with fresh zeroed frames. flags may add PAGE_RW.
+static int vm_alloc(struct vm_space *vm, uintptr_t va, size_t count, u64 flags) {
+    if (!vm_range_ok(va, count))
+        return -1;
+
+    pushcli();
+    if (!vm_range_is(vm, va, count, 0) || vm_prepare(vm, va, count) < 0) {
+        popcli();
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        void *frame = user_frame_alloc();
+        if (!frame) {
+            struct tlb_batch b;
+            tlb_batch_init(&b, vm);
+            vm_unmap_batch(vm, va, i, &b);
+            tlb_flush(&b);
+            popcli();
+            return -1;
         }
+
+        uintptr_t pa = v2p((uintptr_t)frame);
+        *frame_ref(pa) = 1;
+        vm_pte(vm, va + i * PAGE_SIZE, 1)->entry = pa | (flags & PAGE_RW) | PAGE_U | PAGE_P;
     }
 
-    panic("APIC entry not found in rsdt\n");
+    popcli();
+    return 0;
 }
 
-static void load_apic(void) {
-    if (rsdp_request.response == NULL) {
-        early_printf("No acpi present\n");
+// Shares count pages of src with dst. dst gets write access only if flags
+// has PAGE_RW and src had it. The frames stay alive until every mapping is
+// gone.
+static int vm_grant(struct vm_space *src, uintptr_t src_va, struct vm_space *dst, uintptr_t dst_va,
+                    size_t count, u64 flags) {
+    if (!vm_range_ok(src_va, count) || !vm_range_ok(dst_va, count))
+        return -1;
+
+    pushcli();
+    if (!vm_range_is(src, src_va, count, 1) || !vm_range_is(dst, dst_va, count, 0) ||
+        vm_prepare(dst, dst_va, count) < 0) {
+        popcli();
+        return -1;
+    }
+
+    // dst entries were not present so no tlb can hold them
+    for (size_t i = 0; i < count; i++) {
+        u64 entry = vm_pte(src, src_va + i * PAGE_SIZE, 0)->entry;
+        u64 rw = entry & flags & PAGE_RW;
+
+        frame_get(entry & PAGE_ADDR_MASK);
+        vm_pte(dst, dst_va + i * PAGE_SIZE, 1)->entry = (entry & PAGE_ADDR_MASK) | rw | PAGE_U | PAGE_P;
+    }
+
+    popcli();
+    return 0;
+}
+
+// Maps a kernel page into vm. Caller holds pushcli and owns a reference
+// on the page, so it outlives the mapping.
+static int vm_map_kernel(struct vm_space *vm, uintptr_t va, void *page, u64 flags) {
+    ptl1e_t *pte = vm_pte(vm, va, 1);
+    if (!pte)
+        return -1;
+
+    frame_get(v2p((uintptr_t)page));
+    pte->entry = v2p((uintptr_t)page) | (flags & PAGE_RW) | PAGE_U | PAGE_P;
+    return 0;
+}
+
+// Moves count pages from src to dst without copying. Ownership moves with
+// the mapping so frame references are untouched, and src is invalidated
+// once for the whole range.
+static int vm_transfer(struct vm_space *src, uintptr_t src_va, struct vm_space *dst, uintptr_t dst_va,
+                       size_t count) {
+    if (!vm_range_ok(src_va, count) || !vm_range_ok(dst_va, count))
+        return -1;
+
+    pushcli();
+    if (!vm_range_is(src, src_va, count, 1) || !vm_range_is(dst, dst_va, count, 0) ||
+        vm_prepare(dst, dst_va, count) < 0) {
+        popcli();
+        return -1;
+    }
+
+    struct tlb_batch b;
+    tlb_batch_init(&b, src);
+
+    for (size_t i = 0; i < count; i++) {
+        ptl1e_t *from = vm_pte(src, src_va + i * PAGE_SIZE, 0);
+
+        vm_pte(dst, dst_va + i * PAGE_SIZE, 1)->entry = from->entry;
+        from->entry = 0;
+        tlb_batch_add(&b, src_va + i * PAGE_SIZE);
+    }
+
+    tlb_flush(&b);
+    popcli();
+    return 0;
+}
+
+static size_t initrd_page_offset(struct initrd_file *f) {
+    return (uintptr_t)f->data % PAGE_SIZE;
+}
+
+static u64 tar_octal(const char *s, size_t len) {
+    u64 v = 0;
+    for (size_t i = 0; i < len && s[i] >= '0' && s[i] <= '7'; i++)
+        v = v * 8 + s[i] - '0';
+    return v;
+}
+
+static struct list *initrd_bucket(const char *name, size_t len) {
+    u32 h = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (u8)name[i]) * 16777619U;
+    return &initrd_table[h & (INITRD_HASH_SIZE - 1)];
+}
+
+static void initrd_add(const char *name, size_t len, const u8 *data, size_t size) {
+    if (len >= 2 && name[0] == '.' && name[1] == '/') {
+        name += 2;
+        len -= 2;
+    }
+    if (!len)
         return;
+
+    struct initrd_file *f = kmem_cache_alloc(&initrd_file_cache);
+    if (!f)
+        panic("Could not index initrd\n");
+    f->name = name;
+    f->name_len = len;
+    f->data = data;
+    f->size = size;
+    list_add_tail(initrd_bucket(name, len), &f->node);
+    initrd_file_count++;
+}
+
+// Regular files only. Names and data are left where they are in the
+// module.
+static void initrd_parse_tar(struct boot_module *m) {
+    for (size_t off = 0; off + TAR_BLOCK <= m->size;) {
+        const struct tar_header *h = (const struct tar_header *)(m->data + off);
+        if (!h->name[0])
+            break;
+
+        u64 size = tar_octal(h->size, sizeof(h->size));
+        off += TAR_BLOCK;
+        if (size > m->size - off) {
+            early_printf("initrd: %s is truncated\n", m->name);
+            break;
+        }
+
+        if ((h->typeflag == TAR_REGULAR || !h->typeflag) && !h->prefix[0]) {
+            size_t len = 0;
+            while (len < sizeof(h->name) && h->name[len])
+                len++;
+            initrd_add(h->name, len, m->data + off, size);
+        }
+
+        off += (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
     }
-    struct acpi_rsdp *rsdp = (struct acpi_rsdp *)rsdp_request.response->address;
-    if (rsdp->revision >= 2)
-        xsdt_parse((struct acpi_xsdt *)p2v(rsdp->xsdt_addr));
-    else
-        rsdt_parse((struct acpi_rsdt *)p2v(rsdp->rsdt_addr));
 }
 
-static void gdt_set_entry(int num, u32 base, u32 limit, u8 access, u8 gran) {
-    gdt[num].base_low = base & 0xFFFF;
-    gdt[num].base_middle = (base >> 16) & 0xFF;
-    gdt[num].base_high = (base >> 24) & 0xFF;
+// Indexes every file in ustar modules and every other module by its own
+// name. Module frames get a reference for good so user mappings of them
+// never free anything.
+static void init_initrd(void) {
+    kmem_cache_init(&initrd_file_cache, sizeof(struct initrd_file));
+    for (size_t i = 0; i < INITRD_HASH_SIZE; i++)
+        list_init(&initrd_table[i]);
+
+    for (size_t i = 0; i < boot_module_count; i++) {
+        struct boot_module *m = &boot_modules[i];
+        uintptr_t end = v2p((uintptr_t)m->data) + m->size;
+        for (uintptr_t pa = page_round_down(v2p((uintptr_t)m->data)); pa < end; pa += PAGE_SIZE)
+            frame_get(pa);
+
+        if (m->size >= TAR_BLOCK && !memcmp(((const struct tar_header *)m->data)->magic, "ustar", 5)) {
+            initrd_parse_tar(m);
+        } else {
+            size_t len = 0;
+            while (m->name[len])
+                len++;
+            initrd_add(m->name, len, m->data, m->size);
+        }
+    }
 
-    gdt[num].limit_low = limit & 0xFFFF;
-    gdt[num].granularity = ((limit >> 16) & 0x0F);
+    if (boot_module_count)
+        early_printf("initrd: %lu modules, %lu files\n", boot_module_count, initrd_file_count);
+}
 
-    gdt[num].granularity |= (gran & 0xF0);
-    gdt[num].access = access;
+// NULL if there is no such file
+static struct initrd_file *initrd_find(const char *name) {
+    size_t len = 0;
+    while (name[len])
+        len++;
+
+    struct list *bucket = initrd_bucket(name, len);
+    for (struct list *l = bucket->next; l != bucket; l = l->next) {
+        struct initrd_file *f = container_of(l, struct initrd_file, node);
+        if (f->name_len == len && !memcmp(f->name, name, len))
+            return f;
+    }
+    return NULL;
 }
 
-static void init_gdt(void) {
-    // Null entry
-    gdt_set_entry(0, 0, 0, 0, 0);
+#ifdef BENCH
+// Maps the module pages holding f read only at va, without copying. Tar
+// data is only 512 byte aligned, so the file starts at
+// va + initrd_page_offset(f) and its neighbours in the archive are
+// visible around it.
+static int initrd_map(struct vm_space *vm, uintptr_t va, struct initrd_file *f) {
+    size_t count = (initrd_page_offset(f) + f->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uintptr_t page = page_round_down((uintptr_t)f->data);
+
+    if (!count || !vm_range_ok(va, count))
+        return -1;
+
+    pushcli();
+    if (!vm_range_is(vm, va, count, 0)) {
+        popcli();
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (vm_map_kernel(vm, va + i * PAGE_SIZE, (void *)(page + i * PAGE_SIZE), 0) < 0) {
+            popcli();
+            vm_unmap(vm, va, i);
+            return -1;
+        }
+    }
+
+    popcli();
+    return 0;
+}
+#endif
+
+// The frame holding page i of f, shared by every mapping of it and kept
+// for good. Module frames are used as they are when the archive happened
+// to page align the file, otherwise the page is copied out once. 0 when
+// out of memory.
+static uintptr_t initrd_file_page(struct initrd_file *f, size_t i) {
+    if (!f->pages) {
+        size_t count = (f->size + PAGE_SIZE - 1) / PAGE_SIZE;
+        while (((size_t)PAGE_SIZE << f->pages_order) < count * sizeof(*f->pages))
+            f->pages_order++;
+        f->pages = try_early_kalloc(f->pages_order);
+        if (!f->pages)
+            return 0;
+    }
+
+    if (!f->pages[i]) {
+        if (!initrd_page_offset(f)) {
+            f->pages[i] = v2p((uintptr_t)f->data) + i * PAGE_SIZE;
+        } else {
+            void *frame = try_early_kalloc(0);
+            if (!frame)
+                return 0;
+            size_t off = i * PAGE_SIZE;
+            memcpy(frame, f->data + off, f->size - off < PAGE_SIZE ? f->size - off : PAGE_SIZE);
+            f->pages[i] = v2p((uintptr_t)frame);
+            *frame_ref(f->pages[i]) = 1;
+        }
+    }
+    return f->pages[i];
+}
+
+static struct vm_area *vm_find_area(struct vm_space *vm, uintptr_t va) {
+    for (struct list *l = vm->areas.next; l != &vm->areas; l = l->next) {
+        struct vm_area *a = container_of(l, struct vm_area, node);
+        if (va >= a->start && va < a->end)
+            return a;
+    }
+    return NULL;
+}
+
+// Reserves [start, end) to be filled in by vm_fault, from file at offset
+// up to file_end and with zeroes after it. file may be NULL. -1 if the
+// range is bad or overlaps another area.
+static int vm_add_area(struct vm_space *vm, uintptr_t start, uintptr_t end, u64 flags,
+                       struct initrd_file *file, u64 offset, uintptr_t file_end) {
+    if (end <= start || !vm_range_ok(start, (end - start) / PAGE_SIZE) || end % PAGE_SIZE)
+        return -1;
+
+    pushcli();
+    for (struct list *l = vm->areas.next; l != &vm->areas; l = l->next) {
+        struct vm_area *a = container_of(l, struct vm_area, node);
+        if (start < a->end && a->start < end) {
+            popcli();
+            return -1;
+        }
+    }
+
+    struct vm_area *a = kmem_cache_alloc(&vm_area_cache);
+    if (!a) {
+        popcli();
+        return -1;
+    }
+    a->start = start;
+    a->end = end;
+    a->flags = flags & PAGE_RW;
+    a->file = file;
+    a->offset = offset;
+    a->file_end = file ? file_end : start;
+    list_add_tail(&vm->areas, &a->node);
+
+    popcli();
+    return 0;
+}
+
+// The first write to a shared page
+static int vm_cow(uintptr_t va, ptl1e_t *pte) {
+    uintptr_t old = pte->entry & PAGE_ADDR_MASK;
+
+    void *frame = user_frame_alloc();
+    if (!frame)
+        return -1;
+    memcpy(frame, (void *)p2v(old), PAGE_SIZE);
+
+    uintptr_t pa = v2p((uintptr_t)frame);
+    *frame_ref(pa) = 1;
+    pte->entry = pa | PAGE_RW | PAGE_U | PAGE_P;
+    asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+    frame_put(old);
+    return 0;
+}
+
+// Caller holds pushcli. Fills in a page of an area on first touch: whole
+// file pages are mapped shared, read only in writable areas until the
+// first write copies them, and the rest gets a zeroed frame with
+// whatever file bytes reach into it. -1 if the access is not allowed.
+static int vm_fault(struct vm_space *vm, uintptr_t addr, u64 error) {
+    uintptr_t va = page_round_down(addr);
+    int write = error & PF_WRITE;
+
+    if (addr >= USER_VA_END)
+        return -1;
+
+    ptl1e_t *pte = vm_pte(vm, va, 0);
+    if (pte && (pte->entry & PAGE_P)) {
+        if (write && (pte->entry & PAGE_COW))
+            return vm_cow(va, pte);
+        // Already there, unless the cpu says the access was denied
+        return error & PF_PRESENT ? -1 : 0;
+    }
+
+    struct vm_area *a = vm_find_area(vm, va);
+    if (!a || (write && !(a->flags & PAGE_RW)))
+        return -1;
+
+    pte = vm_pte(vm, va, 1);
+    if (!pte)
+        return -1;
+
+    uintptr_t file_pa = 0;
+    if (va < a->file_end) {
+        file_pa = initrd_file_page(a->file, (a->offset + va - a->start) / PAGE_SIZE);
+        if (!file_pa)
+            return -1;
+    }
+
+    if (file_pa && va + PAGE_SIZE <= a->file_end && !write) {
+        frame_get(file_pa);
+        pte->entry = file_pa | (a->flags & PAGE_RW ? PAGE_COW : 0) | PAGE_U | PAGE_P;
+        return 0;
+    }
+
+    void *frame = user_frame_alloc();
+    if (!frame)
+        return -1;
+    if (file_pa)
+        memcpy(frame, (void *)p2v(file_pa), va + PAGE_SIZE <= a->file_end ? PAGE_SIZE : a->file_end - va);
+
+    uintptr_t pa = v2p((uintptr_t)frame);
+    *frame_ref(pa) = 1;
+    pte->entry = pa | a->flags | PAGE_U | PAGE_P;
+    return 0;
+}
+
+// Turns every PT_LOAD of f into an area of vm that is only filled in on
+// first touch, so loading costs the same for any binary size and text is
+// shared by every instance. Position independent binaries go at
+// ELF_DYN_BASE, moved up to the largest segment alignment so segments
+// that could use huge pages stay aligned for them. Returns the entry
+// point, 0 if f is not a loadable x86_64 ELF64. The caller destroys vm
+// on failure.
+static uintptr_t elf_load(struct vm_space *vm, struct initrd_file *f) {
+    const struct elf64_ehdr *eh = (const struct elf64_ehdr *)f->data;
+
+    if (f->size < sizeof(*eh) || memcmp(eh->ident, ELF_MAGIC, 4) || eh->ident[ELF_IDENT_CLASS] != ELF_CLASS64 ||
+        eh->ident[ELF_IDENT_DATA] != ELF_DATA_LSB || eh->machine != ELF_MACHINE_X86_64 ||
+        (eh->type != ELF_TYPE_EXEC && eh->type != ELF_TYPE_DYN) || eh->phentsize != sizeof(struct elf64_phdr) ||
+        eh->phoff > f->size || eh->phnum > (f->size - eh->phoff) / sizeof(struct elf64_phdr))
+        return 0;
+
+    const struct elf64_phdr *ph = (const struct elf64_phdr *)(f->data + eh->phoff);
+    uintptr_t bias = 0;
+    if (eh->type == ELF_TYPE_DYN) {
+        u64 align = HUGE_PAGE_SIZE;
+        for (size_t i = 0; i < eh->phnum; i++) {
+            if (ph[i].type == ELF_PT_LOAD && ph[i].align > align && !(ph[i].align & (ph[i].align - 1)))
+                align = ph[i].align;
+        }
+        bias = (ELF_DYN_BASE + align - 1) & ~(align - 1);
+    }
+
+    for (size_t i = 0; i < eh->phnum; i++) {
+        if (ph[i].type != ELF_PT_LOAD || !ph[i].memsz)
+            continue;
+
+        u64 vaddr = ph[i].vaddr + bias;
+        if (ph[i].offset % PAGE_SIZE != ph[i].vaddr % PAGE_SIZE || ph[i].filesz > ph[i].memsz ||
+            ph[i].offset > f->size || ph[i].filesz > f->size - ph[i].offset ||
+            vaddr < bias || ph[i].memsz > USER_VA_END || vaddr > USER_VA_END - ph[i].memsz)
+            return 0;
+
+        uintptr_t start = page_round_down(vaddr);
+        if (vm_add_area(vm, start, page_round_up(vaddr + ph[i].memsz), ph[i].flags & ELF_PF_W ? PAGE_RW : 0,
+                        f, ph[i].offset - (vaddr - start), vaddr + ph[i].filesz) < 0)
+            return 0;
+    }
+
+    return eh->entry + bias;
+}
+
+static void madt_parse(struct acpi_madt *madt) {
+    lapic = (volatile u32 *)p2v(madt->lapic_addr);
+
+    for (u32 i = 0; i < ISA_IRQS; i++)
+        isa_routes[i].gsi = i;
+
+    u8 *ptr = madt->entries;
+    u8 *end = (u8 *)madt + madt->header.length;
+
+    while (ptr + 2 <= end) {
+        u8 type = ptr[0];
+        u8 len = ptr[1];
+
+        if (len < 2 || ptr + len > end)
+            break;
+
+        switch (type) {
+            case MADT_IOAPIC: {
+                struct madt_ioapic_entry *ioe = (struct madt_ioapic_entry *)ptr;
+                if (ioapic_count >= MAX_IOAPICS) {
+                    panic("Too many ioapics\n");
+                }
+                ioapics[ioapic_count].id = ioe->ioapic_id;
+                ioapics[ioapic_count].addr = (volatile u32 *)p2v(ioe->ioapic_addr);
+                ioapics[ioapic_count].gsi_base = ioe->gsi_base;
+                ioapic_count++;
+                break;
+            }
+            case MADT_LAPIC: {
+                struct madt_lapic_entry *le = (struct madt_lapic_entry *)ptr;
+                if (lapic_count >= MAX_LAPICS) {
+                    panic("Too many lapics\n");
+                }
+                lapics[lapic_count].cpu_id = le->cpu_id;
+                lapics[lapic_count].apic_id = le->apic_id;
+                lapics[lapic_count].flags = le->flags;
+                lapic_count++;
+                break;
+            }
+            case MADT_OVERRIDE: {
+                struct madt_override_entry *oe = (struct madt_override_entry *)ptr;
+                if (oe->bus != 0 || oe->source >= ISA_IRQS)
+                    break;
+
+                // Conforming to the isa bus means edge triggered, active high
+                struct isa_route *r = &isa_routes[oe->source];
+                r->gsi = oe->gsi;
+                r->redirect = 0;
+                if ((oe->flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW)
+                    r->redirect |= IOAPIC_ACTIVELOW;
+                if ((oe->flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL)
+                    r->redirect |= IOAPIC_LEVEL;
+                break;
+            }
+            default:
+                break;
+        }
+        ptr += len;
+    }
+}
+
+static void mcfg_parse(struct acpi_mcfg *mcfg) {
+    size_t entries = (mcfg->header.length - sizeof(*mcfg)) / sizeof(mcfg->entries[0]);
+
+    for (size_t i = 0; i < entries; i++) {
+        if (pci_segment_count >= MAX_PCI_SEGMENTS) {
+            early_printf("pci: too many segments, ignoring the rest\n");
+            break;
+        }
+        pci_segments[pci_segment_count].base = mcfg->entries[i].base;
+        pci_segments[pci_segment_count].segment = mcfg->entries[i].segment;
+        pci_segments[pci_segment_count].start_bus = mcfg->entries[i].start_bus;
+        pci_segments[pci_segment_count].end_bus = mcfg->entries[i].end_bus;
+        pci_segment_count++;
+    }
+}
+
+static int acpi_signature_is(struct acpi_sdt_header *hdr, const char *sig) {
+    return hdr->signature[0] == sig[0] && hdr->signature[1] == sig[1] && hdr->signature[2] == sig[2] && hdr->signature[3] == sig[3];
+}
+
+// Returns whether hdr was the MADT
+static int acpi_table_parse(struct acpi_sdt_header *hdr) {
+    if (acpi_signature_is(hdr, "MCFG"))
+        mcfg_parse((struct acpi_mcfg *)hdr);
+
+    if (acpi_signature_is(hdr, "APIC")) {
+        madt_parse((struct acpi_madt *)hdr);
+        return 1;
+    }
+    return 0;
+}
+
+static void xsdt_parse(struct acpi_xsdt *xsdt) {
+    size_t entries = (xsdt->header.length - sizeof(xsdt->header)) / sizeof(xsdt->entries[0]);
+    int found = 0;
+
+    for (size_t i = 0; i < entries; i++) {
+        struct acpi_sdt_header *hdr = (struct acpi_sdt_header *)p2v(xsdt->entries[i]);
+        if (!hdr)
+            continue;
+
+        found |= acpi_table_parse(hdr);
+    }
+
+    if (!found)
+        panic("APIC entry not found in xsdt\n");
+}
+
+static void rsdt_parse(struct acpi_rsdt *rsdt) {
+    size_t entries = (rsdt->header.length - sizeof(rsdt->header)) / sizeof(rsdt->entries[0]);
+    int found = 0;
+
+    for (size_t i = 0; i < entries; i++) {
+        struct acpi_sdt_header *hdr = (struct acpi_sdt_header *)p2v(rsdt->entries[i]);
+        if (!hdr)
+            continue;
+
+        found |= acpi_table_parse(hdr);
+    }
+
+    if (!found)
+        panic("APIC entry not found in rsdt\n");
+}
+
+static void load_apic(void) {
+    if (rsdp_request.response == NULL) {
+        early_printf("No acpi present\n");
+        return;
+    }
+    struct acpi_rsdp *rsdp = (struct acpi_rsdp *)rsdp_request.response->address;
+    if (rsdp->revision >= 2)
+        xsdt_parse((struct acpi_xsdt *)p2v(rsdp->xsdt_addr));
+    else
+        rsdt_parse((struct acpi_rsdt *)p2v(rsdp->rsdt_addr));
+}
+
+static void gdt_set_entry(int num, u32 base, u32 limit, u8 access, u8 gran) {
+    gdt[num].base_low = base & 0xFFFF;
+    gdt[num].base_middle = (base >> 16) & 0xFF;
+    gdt[num].base_high = (base >> 24) & 0xFF;
+
+    gdt[num].limit_low = limit & 0xFFFF;
+    gdt[num].granularity = ((limit >> 16) & 0x0F);
+
+    gdt[num].granularity |= (gran & 0xF0);
+    gdt[num].access = access;
+}
+
+// Available 64-bit tss, the upper half of the base goes in the next entry
+static void gdt_set_tss(int num, struct tss *tss) {
+    uintptr_t base = (uintptr_t)tss;
+
+    gdt_set_entry(num, base & 0xFFFFFFFF, sizeof(*tss) - 1, 0x89, 0x00);
+    gdt[num + 1] = (struct gdt_entry){ (base >> 32) & 0xFFFF, (base >> 48) & 0xFFFF, 0, 0, 0, 0 };
+}
+
+// rsp0 is filled in per thread by finish_switch. The ist stacks give
+// double faults, nmis and machine checks a known good stack.
+static void init_tss(size_t cpu) {
+    struct tss *tss = &cpus[cpu].tss;
+
+    for (size_t i = 1; i <= IST_COUNT; i++)
+        tss->ist[i - 1] = (uintptr_t)early_kalloc(0) + IST_STACK_SIZE;
+    tss->iomap_base = sizeof(*tss);
+
+    asm volatile("ltr %0" : : "r"((u16)((SEG_TSS + 2 * cpu) << 3)));
+}
+
+static void init_gdt(void) {
+    // Null entry
+    gdt_set_entry(0, 0, 0, 0, 0);
+
+    // Kernel code segment (index 1)
+    gdt_set_entry(SEG_KCODE, 0, 0xFFFFF, 0x9A, 0xAF);
+
+    // Kernel data segment (index 2)
+    gdt_set_entry(SEG_KDATA, 0, 0xFFFFF, 0x92, 0xAF);
+
+    // User code segment (index 3)
+    gdt_set_entry(SEG_UCODE, 0, 0xFFFFF, 0xFA, 0xAF);
+
+    // User data segment (index 4)
+    gdt_set_entry(SEG_UDATA, 0, 0xFFFFF, 0xF2, 0xAF);
+
+    for (size_t i = 0; i < MAX_CPUS; i++)
+        gdt_set_tss(SEG_TSS + 2 * i, &cpus[i].tss);
+
+    lgdt(gdt, sizeof(gdt));
+    reset_segment_registers(); // <- this guys a loser
+
+    init_tss(0);
+}
+
+static void lapic_write(size_t index, int value) {
+    lapic[index] = value;
+    (void)lapic[APIC_ID];
+}
+
+static u32 lapic_read(size_t index) {
+    return lapic[index];
+}
+
+static void init_lapic(void) {
+    if (!lapic) {
+        panic("No lapic found\n");
+    }
+
+    map_page_early(kernel_ptl4, v2p((uintptr_t)lapic), (uintptr_t)lapic, PAGE_P | PAGE_RW);
+
+    lapic_write(APIC_SVR, APIC_ENABLE | (TRAP_IRQ0 + IRQ_SPURIOUS));
+
+    u32 timer_frequency_hz = 1000;
+    u32 lapic_clock_hz = 1000000000;
+    lapic_write(APIC_TDCR, APIC_X1);
+    lapic_write(APIC_TIMER, APIC_PERIODIC | (TRAP_IRQ0 + IRQ_TIMER));
+    lapic_write(APIC_TICR, lapic_clock_hz / timer_frequency_hz);
+
+    lapic_write(APIC_LINT0, APIC_MASKED);
+    lapic_write(APIC_LINT1, APIC_MASKED);
+
+    if (((lapic[APIC_VER] >> 16) & 0xFF) >= 4)
+        lapic_write(APIC_PCINT, APIC_MASKED);
+
+    lapic_write(APIC_ERROR, TRAP_IRQ0 + IRQ_ERROR);
+
+    lapic_write(APIC_ESR, 0);
+    lapic_write(APIC_ESR, 0);
+
+    lapic_write(APIC_EOI, 0);
+
+    lapic_write(APIC_TPR, 0);
+
+    // Only this cpu so far, nothing starts the aps yet
+    my_cpu()->started = 1;
+}
+
+static void init_pic(void) {
+    // Disable
+    outb(0x12, 0xFF);
+    outb(0xA1, 0xFF);
+}
+
+// Times PIT channel 2 counting down PIT_CALIBRATE_MS milliseconds
+static void calibrate_tsc(void) {
+    u8 gate = inb(PIT_GATE) & ~(PIT_GATE_SPEAKER | PIT_GATE_CH2);
+    outb(PIT_GATE, gate);
+
+    u16 count = PIT_HZ * PIT_CALIBRATE_MS / 1000;
+    outb(PIT_CMD, 0xB0); // channel 2, lobyte/hibyte, mode 0
+    outb(PIT_CH2, count & 0xFF);
+    outb(PIT_CH2, count >> 8);
+
+    outb(PIT_GATE, gate | PIT_GATE_CH2);
+    u64 start = rdtsc();
+    while (!(inb(PIT_GATE) & PIT_GATE_OUT2));
+    u64 end = rdtsc();
+
+    outb(PIT_GATE, gate);
+
+    tsc_khz = (end - start) / PIT_CALIBRATE_MS;
+    if (!tsc_khz)
+        panic("TSC calibration failed\n");
+    tsc_ns_mult = (1000000ULL << 32) / tsc_khz;
+    boot_tsc = end;
+
+    early_printf("tsc: %lu kHz\n", tsc_khz);
+}
+
+static u64 tsc_to_ns(u64 cycles) {
+    return ((unsigned __int128)cycles * tsc_ns_mult) >> 32;
+}
+
+// Ends the current boot phase. Raw tsc stamps only, they are converted
+// once calibrate_tsc has run.
+static void boot_mark(const char *name) {
+    if (boot_phase_count < BOOT_PHASES_MAX) {
+        boot_phases[boot_phase_count].name = name;
+        boot_phases[boot_phase_count].end_tsc = rdtsc();
+        boot_phase_count++;
+    }
+}
+
+static void print_boot_phases(void) {
+    u64 start = boot_phases[0].end_tsc;
+    u64 total = tsc_to_ns(boot_phases[boot_phase_count - 1].end_tsc - start);
+
+    for (size_t i = 1; i < boot_phase_count; i++) {
+        u64 ns = tsc_to_ns(boot_phases[i].end_tsc - boot_phases[i - 1].end_tsc);
+        early_printf("boot: %s %luus %lu%%\n", boot_phases[i].name, ns / 1000, total ? ns * 100 / total : 0);
+    }
+    early_printf("boot: %luus from kmain to the first thread\n", total / 1000);
+}
+
+// Nanoseconds since calibrate_tsc
+static u64 clock_ns(void) {
+    return tsc_to_ns(rdtsc() - boot_tsc);
+}
+
+// The kernel keeps a reference so the frame outlives every address space
+static void init_time_page(void) {
+    time_page = early_kalloc(0);
+    frame_get(v2p((uintptr_t)time_page));
+
+    time_page->tsc_khz = tsc_khz;
+    time_page->tsc_ns_mult = tsc_ns_mult;
+    time_page->boot_tsc = boot_tsc;
+}
+
+static void time_page_tick(void) {
+    __atomic_store_n(&time_page->seq, time_page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    time_page->ticks = sched_ticks;
+    __atomic_store_n(&time_page->seq, time_page->seq + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef BENCH
+// What ring 3 does against TIME_PAGE_VA, the bench checks it agrees with
+// clock_ns
+static u64 time_page_ns(const struct time_page *tp) {
+    u32 seq;
+    u64 ns;
+
+    do {
+        seq = __atomic_load_n(&tp->seq, __ATOMIC_ACQUIRE);
+        ns = ((unsigned __int128)(rdtsc() - tp->boot_tsc) * tp->tsc_ns_mult) >> 32;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&tp->seq, __ATOMIC_RELAXED));
+
+    return ns;
+}
+#endif
+
+static int ioapicread(size_t index, u32 reg) {
+    volatile u32 *mmio = ioapics[index].addr;
+    mmio[IOAPIC_IO_REG_SELECT] = reg;
+    return mmio[IOAPIC_IO_DATA];
+}
+
+static void ioapicwrite(size_t index, u32 reg, u32 data) {
+    volatile u32 *mmio = ioapics[index].addr;
+    mmio[IOAPIC_IO_REG_SELECT] = reg;
+    mmio[IOAPIC_IO_DATA] = data;
+}
+
+static void init_ioapic(void) {
+    for (size_t i = 0; i < ioapic_count; i++) {
+        map_page_early(kernel_ptl4, v2p((uintptr_t)ioapics[i].addr), (uintptr_t)ioapics[i].addr, PAGE_P | PAGE_RW);
+
+        u32 id;
+        u32 maxintr;
+
+        maxintr = (ioapicread(i, IOAPIC_REG_VERSION) >> 16) & 0xFF;
+        id = ioapicread(i, IOAPIC_REG_ID) >> 24;
+        if (id != ioapics[i].id) {
+            continue;
+        }
+        ioapics[i].pins = maxintr + 1;
+
+        for (u32 j = 0; j <= maxintr; j++) {
+            ioapicwrite(i, IOAPIC_REG_TABLE + 2 * j, IOAPIC_INT_DISABLED | (TRAP_IRQ0 + j));
+            ioapicwrite(i, IOAPIC_REG_TABLE + 2 * j + 1, 0);
+        }
+    }
+}
+
+static void init_idt(void) {
+    lidt(idt, sizeof(idt));
+}
+
+#define set_gate(gate, istrap, sel, off, d)                             \
+    {                                                                   \
+        (gate).off_15_0 = (uintptr_t)(off) & 0xffff;                    \
+        (gate).cs = (sel);                                              \
+        (gate).args = 0;                                                \
+        (gate).rsv1 = 0;                                                \
+        (gate).type = (istrap) ? STS_TG64 : STS_IG64;                   \
+        (gate).s = 0;                                                   \
+        (gate).dpl = (d);                                               \
+        (gate).p = 1;                                                   \
+        (gate).off_31_16 = (uintptr_t)(off) >> 16 & 0xffff;             \
+        (gate).off_32_63 = (uintptr_t)(off) >> 32 & 0xffffffff;         \
+    }
+
+static void init_tv(void) {
+    for (size_t i = 0; i < INTERRUPT_COUNT; i++)
+        set_gate(idt[i], 0, SEG_KCODE << 3, trap_vectors[i], 0);
+    set_gate(idt[TRAP_SYSCALL], 1, SEG_KCODE << 3, trap_vectors[TRAP_SYSCALL], DPL_USER);
+
+    // The low three bits of args select the ist stack in long mode
+    idt[TRAP_DOUBLE_FAULT].args = IST_DOUBLE_FAULT;
+    idt[TRAP_NON_MASKABLE_INTERRUPT].args = IST_NMI;
+    idt[TRAP_MACHINE_CHECK].args = IST_MACHINE_CHECK;
+}
+
+static void lapic_eoi(void) {
+    if (lapic)
+        lapic_write(APIC_EOI, 0);
+}
+
+static void print_tf(struct trap_frame *tf) {
+    early_printf("r15: %lx\n", tf->r15);
+    early_printf("r14: %lx\n", tf->r14);
+    early_printf("r13: %lx\n", tf->r13);
+    early_printf("r12: %lx\n", tf->r12);
+    early_printf("r11: %lx\n", tf->r11);
+    early_printf("r10: %lx\n", tf->r10);
+    early_printf("r9: %lx\n", tf->r9);
+    early_printf("r8: %lx\n", tf->r8);
+    early_printf("rdi: %lx\n", tf->rdi);
+    early_printf("rsi: %lx\n", tf->rsi);
+    early_printf("rbp: %lx\n", tf->rbp);
+    early_printf("rbx: %lx\n", tf->rbx);
+    early_printf("rdx: %lx\n", tf->rdx);
+    early_printf("rcx: %lx\n", tf->rcx);
+    early_printf("rax: %lx\n", tf->rax);
+    early_printf("vector: %lx\n", tf->vector);
+    early_printf("error: %lx\n", tf->error);
+    early_printf("rip: %lx\n", tf->rip);
+    early_printf("cs: %lx\n", tf->cs);
+    early_printf("rflags: %lx\n", tf->rflags);
+    early_printf("rsp: %lx\n", tf->rsp);
+    early_printf("ss: %lx\n", tf->ss);
+}
+
+static struct proc *my_proc(void) {
+    return my_cpu()->proc;
+}
+
+static void *kstack_alloc(void) {
+    struct cpu *c = my_cpu();
+
+    if (c->stack_cache) {
+        struct free_list_node *n = c->stack_cache;
+        c->stack_cache = n->next;
+        c->stack_cache_count--;
+        return n;
+    }
+
+    return try_early_kalloc(KSTACK_ORDER);
+}
+
+static void kstack_free(void *stack) {
+    struct cpu *c = my_cpu();
+
+    if (c->stack_cache_count >= KSTACK_CACHE_SIZE) {
+        early_kfree(stack, KSTACK_ORDER);
+        return;
+    }
+
+    struct free_list_node *n = stack;
+    n->next = c->stack_cache;
+    c->stack_cache = n;
+    c->stack_cache_count++;
+}
+
+// Called once the dead thread's stack is no longer in use
+static void reap(struct proc *p) {
+    if (p->vm)
+        vm_put(p->vm);
+    if (p->caps)
+        cap_table_put(p->caps);
+    idr_remove(&tid_idr, p->tid);
+    kstack_free(p->stack);
+    kmem_cache_free(&proc_cache, p);
+}
+
+static struct proc *rb_proc(struct rb_node *n) {
+    return container_of(n, struct proc, rb);
+}
+
+static int sched_class_rank(struct proc *p) {
+    switch (p->policy) {
+        case SCHED_DEADLINE:
+            return 2;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void update_min_vruntime(struct cpu *c) {
+    struct proc *curr = c->proc && c->proc->policy == SCHED_NORMAL ? c->proc : 0;
+    struct rb_node *left = c->fair_tree.leftmost;
+    u64 v;
+
+    if (curr)
+        v = curr->vruntime;
+    else if (left)
+        v = rb_proc(left)->vruntime;
+    else
+        return;
+
+    if (curr && left && (s64)(rb_proc(left)->vruntime - v) < 0)
+        v = rb_proc(left)->vruntime;
+
+    if ((s64)(v - c->min_vruntime) > 0)
+        c->min_vruntime = v;
+}
+
+// Charges the running thread for the time since it was last accounted
+static void update_curr(struct cpu *c) {
+    struct proc *curr = c->proc;
+    if (!curr)
+        return;
+
+    u64 now = clock_ns();
+    u64 delta = now - curr->exec_start;
+    curr->exec_start = now;
+    curr->sum_exec += delta;
+
+    switch (curr->policy) {
+        case SCHED_DEADLINE:
+            curr->dl_remaining -= delta;
+            break;
+        case SCHED_RR:
+            curr->rr_remaining -= delta;
+            break;
+        case SCHED_FIFO:
+            break;
+        default:
+            curr->vruntime += delta * NICE_0_WEIGHT / curr->weight;
+            update_min_vruntime(c);
+            break;
+    }
+}
+
+static void fair_enqueue(struct cpu *c, struct proc *p) {
+    struct rb_node **link = &c->fair_tree.root;
+    struct rb_node *parent = 0;
+    int leftmost = 1;
+
+    while (*link) {
+        parent = *link;
+        if ((s64)(p->vruntime - rb_proc(parent)->vruntime) < 0) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+
+    rb_insert(&c->fair_tree, &p->rb, parent, link, leftmost);
+    c->fair_load += p->weight;
+}
+
+// Credits a waking sleeper at most half a latency period so it runs soon
+// without being able to bank time while asleep
+static void fair_place(struct cpu *c, struct proc *p) {
+    u64 floor = c->min_vruntime - SCHED_LATENCY_NS / 2;
+
+    if ((s64)(p->vruntime - floor) < 0)
+        p->vruntime = floor;
+}
+
+static void rt_enqueue(struct cpu *c, struct proc *p, int head) {
+    struct list *q = &c->rt_queue[p->rt_priority];
+
+    if (head)
+        list_add_tail(q->next, &p->node);
+    else
+        list_add_tail(q, &p->node);
+    c->rt_bitmap |= 1ULL << p->rt_priority;
+}
+
+static void dl_enqueue(struct cpu *c, struct proc *p) {
+    struct rb_node **link = &c->dl_tree.root;
+    struct rb_node *parent = 0;
+    int leftmost = 1;
+
+    while (*link) {
+        parent = *link;
+        if ((s64)(p->dl_abs_deadline - rb_proc(parent)->dl_abs_deadline) < 0) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+
+    rb_insert(&c->dl_tree, &p->rb, parent, link, leftmost);
+}
+
+static void dl_new_job(struct proc *p, u64 start) {
+    p->dl_abs_deadline = start + p->dl_deadline;
+    p->dl_remaining = p->dl_runtime;
+    p->dl_missed = 0;
+    p->dl_jobs++;
+}
+
+// CBS wakeup rule: the old deadline is kept only if the leftover runtime
+// still fits before it at the reserved bandwidth
+static void dl_wakeup(struct proc *p, u64 now) {
+    if (p->dl_remaining <= 0 || (s64)(p->dl_abs_deadline - now) <= 0 ||
+        (unsigned __int128)p->dl_remaining * p->dl_period >
+        (unsigned __int128)(p->dl_abs_deadline - now) * p->dl_runtime)
+        dl_new_job(p, now);
+}
+
+// Parks a deadline thread off the run queue until its budget is replenished
+static void dl_throttle(struct cpu *c, struct proc *p, u64 until) {
+    p->state = PROC_RUNNABLE;
+    p->dl_throttled = 1;
+    p->dl_replenish_at = until;
+    list_add_tail(&c->dl_throttled, &p->node);
+}
+
+static void dl_account_finish(struct proc *p, u64 now) {
+    if ((s64)(now - p->dl_abs_deadline) <= 0)
+        return;
+
+    u64 lateness = now - p->dl_abs_deadline;
+    if (lateness > p->dl_max_lateness)
+        p->dl_max_lateness = lateness;
+    if (!p->dl_missed) {
+        p->dl_missed = 1;
+        p->dl_misses++;
+    }
+}
+
+static void enqueue_proc(struct cpu *c, struct proc *p, int flags) {
+    p->state = PROC_RUNNABLE;
+
+    switch (p->policy) {
+        case SCHED_DEADLINE:
+            if (flags & ENQUEUE_WAKEUP)
+                dl_wakeup(p, clock_ns());
+            dl_enqueue(c, p);
+            break;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            rt_enqueue(c, p, flags & ENQUEUE_HEAD);
+            break;
+        default:
+            if (flags & ENQUEUE_WAKEUP)
+                fair_place(c, p);
+            fair_enqueue(c, p);
+            break;
+    }
+
+    c->nr_running++;
+}
+
+static void dequeue_proc(struct cpu *c, struct proc *p) {
+    switch (p->policy) {
+        case SCHED_DEADLINE:
+            if (p->dl_throttled) {
+                list_del(&p->node);
+                p->dl_throttled = 0;
+                return;
+            }
+            rb_erase(&c->dl_tree, &p->rb);
+            break;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            list_del(&p->node);
+            if (list_empty(&c->rt_queue[p->rt_priority]))
+                c->rt_bitmap &= ~(1ULL << p->rt_priority);
+            break;
+        default:
+            rb_erase(&c->fair_tree, &p->rb);
+            c->fair_load -= p->weight;
+            break;
+    }
+
+    c->nr_running--;
+}
+
+// Requeues the thread sched() is switching away from
+static void put_prev(struct cpu *c, struct proc *p) {
+    switch (p->policy) {
+        case SCHED_DEADLINE:
+            if (p->dl_throttled)
+                return;
+            if (p->dl_remaining <= 0) {
+                p->dl_overruns++;
+                dl_throttle(c, p, p->dl_abs_deadline);
+                return;
+            }
+            enqueue_proc(c, p, 0);
+            break;
+        case SCHED_RR:
+            if (p->rr_remaining <= 0) {
+                p->rr_remaining = RR_TIMESLICE_NS;
+                enqueue_proc(c, p, 0);
+                break;
+            }
+            // fallthrough
+        case SCHED_FIFO:
+            // A preempted rt thread keeps its place at the head of its priority
+            enqueue_proc(c, p, c->need_resched ? ENQUEUE_HEAD : 0);
+            break;
+        default:
+            enqueue_proc(c, p, 0);
+            break;
+    }
+}
+
+static struct proc *pick_next(struct cpu *c) {
+    struct proc *p;
+
+    if (c->dl_tree.leftmost)
+        p = rb_proc(c->dl_tree.leftmost);
+    else if (c->rt_bitmap)
+        p = container_of(c->rt_queue[63 - __builtin_clzll(c->rt_bitmap)].next, struct proc, node);
+    else if (c->fair_tree.leftmost)
+        p = rb_proc(c->fair_tree.leftmost);
+    else
+        return 0;
+
+    dequeue_proc(c, p);
+
+    p->exec_start = clock_ns();
+    p->slice_start = p->sum_exec;
+    return p;
+}
+
+// p's share of the latency period, stretched once there are too many
+// threads to give each of them the minimum granularity
+static u64 sched_slice(struct cpu *c, struct proc *p) {
+    u64 nr = c->nr_running + 1;
+    u64 period = nr > SCHED_NR_LATENCY ? nr * SCHED_MIN_GRANULARITY_NS : SCHED_LATENCY_NS;
+    u64 slice = period * p->weight / (c->fair_load + p->weight);
+
+    return slice < SCHED_MIN_GRANULARITY_NS ? SCHED_MIN_GRANULARITY_NS : slice;
+}
+
+static void fair_tick(struct cpu *c, struct proc *curr) {
+    if (!c->fair_tree.leftmost)
+        return;
+
+    u64 ideal = sched_slice(c, curr);
+    u64 ran = curr->sum_exec - curr->slice_start;
+
+    if (ran > ideal) {
+        c->need_resched = 1;
+        return;
+    }
+
+    if (ran < SCHED_MIN_GRANULARITY_NS)
+        return;
+
+    if ((s64)(curr->vruntime - rb_proc(c->fair_tree.leftmost)->vruntime) > (s64)ideal)
+        c->need_resched = 1;
+}
+
+// Decides whether a newly runnable p should preempt the current thread
+static void check_preempt(struct cpu *c, struct proc *p) {
+    struct proc *curr = c->proc;
+    if (!curr)
+        return;
+
+    int rank = sched_class_rank(p);
+    int curr_rank = sched_class_rank(curr);
+
+    if (rank != curr_rank) {
+        if (rank > curr_rank)
+            c->need_resched = 1;
+        return;
+    }
+
+    switch (p->policy) {
+        case SCHED_DEADLINE:
+            if ((s64)(p->dl_abs_deadline - curr->dl_abs_deadline) < 0)
+                c->need_resched = 1;
+            break;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            if (p->rt_priority > curr->rt_priority)
+                c->need_resched = 1;
+            break;
+        default: {
+            if (!sched_wakeup_preempt)
+                break;
+
+            update_curr(c);
+
+            u64 gran = SCHED_WAKEUP_GRANULARITY_NS * NICE_0_WEIGHT / p->weight;
+            if ((s64)(curr->vruntime - p->vruntime) > (s64)gran)
+                c->need_resched = 1;
+            break;
+        }
+    }
+}
+
+static void dl_replenish(struct cpu *c, u64 now) {
+    for (struct list *n = c->dl_throttled.next; n != &c->dl_throttled;) {
+        struct proc *p = container_of(n, struct proc, node);
+        n = n->next;
+
+        if ((s64)(now - p->dl_replenish_at) < 0)
+            continue;
+
+        list_del(&p->node);
+        p->dl_throttled = 0;
+
+        // Keep releases periodic unless we are already past the deadline
+        u64 start = p->dl_replenish_at;
+        if ((s64)(now - (start + p->dl_deadline)) >= 0)
+            start = now;
+        dl_new_job(p, start);
+
+        enqueue_proc(c, p, 0);
+        check_preempt(c, p);
+    }
+}
+
+static void sched_tick(struct cpu *c) {
+    u64 now = clock_ns();
+
+    dl_replenish(c, now);
+
+    struct proc *curr = c->proc;
+    if (!curr)
+        return;
+
+    update_curr(c);
+
+    switch (curr->policy) {
+        case SCHED_DEADLINE:
+            if ((s64)(now - curr->dl_abs_deadline) > 0 && !curr->dl_missed) {
+                curr->dl_missed = 1;
+                curr->dl_misses++;
+            }
+            if (curr->dl_remaining <= 0)
+                c->need_resched = 1;
+            break;
+        case SCHED_RR:
+            if (curr->rr_remaining <= 0) {
+                if (list_empty(&c->rt_queue[curr->rt_priority]))
+                    curr->rr_remaining = RR_TIMESLICE_NS;
+                else
+                    c->need_resched = 1;
+            }
+            break;
+        case SCHED_FIFO:
+            break;
+        default:
+            fair_tick(c, curr);
+            break;
+    }
+}
+
+static void make_runnable(struct proc *p) {
+    struct cpu *c = my_cpu();
+
+    p->wakeup_ns = clock_ns();
+    enqueue_proc(c, p, ENQUEUE_WAKEUP);
+    check_preempt(c, p);
+}
+
+// Resolution is one timer tick
+static void timer_add(struct timer *t, u64 expires, void (*fn)(struct timer *)) {
+    pushcli();
+    struct list *timers = &my_cpu()->timers;
+    struct list *pos = timers->next;
+
+    while (pos != timers && (s64)(container_of(pos, struct timer, node)->expires - expires) <= 0)
+        pos = pos->next;
+
+    t->expires = expires;
+    t->fn = fn;
+    t->pending = 1;
+    list_add_tail(pos, &t->node);
+    popcli();
+}
+
+// Returns whether t was still pending
+static int timer_del(struct timer *t) {
+    pushcli();
+    int pending = t->pending;
+    if (pending) {
+        list_del(&t->node);
+        t->pending = 0;
+    }
+    popcli();
+    return pending;
+}
+
+static void run_timers(struct cpu *c, u64 now) {
+    pushcli();
+    while (!list_empty(&c->timers)) {
+        struct timer *t = container_of(c->timers.next, struct timer, node);
+        if ((s64)(now - t->expires) < 0)
+            break;
+
+        list_del(&t->node);
+        t->pending = 0;
+        t->fn(t);
+    }
+    popcli();
+}
+
+// Takes p off its class so its policy can change. Returns whether it was
+// queued.
+static int sched_detach(struct cpu *c, struct proc *p) {
+    if (p == c->proc)
+        update_curr(c);
+
+    int queued = p->state == PROC_RUNNABLE;
+    if (queued)
+        dequeue_proc(c, p);
+
+    if (p->policy == SCHED_DEADLINE) {
+        c->dl_bw -= p->dl_bw;
+        p->dl_bw = 0;
+    }
+
+    return queued;
+}
+
+static void sched_attach(struct cpu *c, struct proc *p, int queued) {
+    if (queued) {
+        enqueue_proc(c, p, 0);
+        check_preempt(c, p);
+    } else if (p == c->proc) {
+        c->need_resched = 1;
+    }
+}
+
+static void set_nice(struct proc *p, int nice) {
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+
+    pushcli();
+    struct cpu *c = my_cpu();
+    u32 weight = nice_to_weight[nice - NICE_MIN];
+
+    if (p == c->proc)
+        update_curr(c);
+    else if (p->state == PROC_RUNNABLE && p->policy == SCHED_NORMAL)
+        c->fair_load = c->fair_load - p->weight + weight;
+
+    p->nice = nice;
+    p->weight = weight;
+    popcli();
+}
+
+// Moves p between the normal, fifo and rr classes. rt_priority is in
+// [0, RT_PRIO_COUNT) with higher values running first.
+static int sched_setscheduler(struct proc *p, enum sched_policy policy, int rt_priority) {
+    if (policy == SCHED_DEADLINE)
+        return -1;
+    if (policy != SCHED_NORMAL && (rt_priority < 0 || rt_priority >= RT_PRIO_COUNT))
+        return -1;
+
+    pushcli();
+    struct cpu *c = my_cpu();
+    int queued = sched_detach(c, p);
+
+    if (policy == SCHED_NORMAL && p->policy != SCHED_NORMAL)
+        p->vruntime = c->min_vruntime;
+
+    p->policy = policy;
+    p->rt_priority = policy == SCHED_NORMAL ? 0 : rt_priority;
+    p->rr_remaining = RR_TIMESLICE_NS;
+
+    sched_attach(c, p, queued);
+    popcli();
+    return 0;
+}
+
+// Reserves runtime every period, to be used before deadline (all in ns).
+// Fails when the cpu's total deadline bandwidth would exceed DL_BW_LIMIT.
+static int sched_setdeadline(struct proc *p, u64 runtime, u64 deadline, u64 period) {
+    if (!runtime || runtime > deadline || deadline > period || runtime >> (64 - DL_BW_SHIFT))
+        return -1;
+
+    u64 bw = (runtime << DL_BW_SHIFT) / period;
+
+    pushcli();
+    struct cpu *c = my_cpu();
+    u64 others = c->dl_bw - (p->policy == SCHED_DEADLINE ? p->dl_bw : 0);
+
+    if (others + bw > DL_BW_LIMIT) {
+        popcli();
+        return -1;
+    }
+
+    int queued = sched_detach(c, p);
+
+    p->policy = SCHED_DEADLINE;
+    p->dl_runtime = runtime;
+    p->dl_deadline = deadline;
+    p->dl_period = period;
+    p->dl_bw = bw;
+    c->dl_bw += bw;
+    dl_new_job(p, clock_ns());
+
+    sched_attach(c, p, queued);
+    popcli();
+    return 0;
+}
+
+// Runs on whichever stack switch_proc landed on
+static void finish_switch(void) {
+    struct cpu *c = my_cpu();
+
+    // Kernel stacks have no guard page, so an overflow only shows up here
+    if ((c->dead && *(u64 *)c->dead->stack != KSTACK_CANARY) ||
+        (c->proc && *(u64 *)c->proc->stack != KSTACK_CANARY))
+        panic("Kernel stack overflow\n");
+
+    if (c->dead) {
+        reap(c->dead);
+        c->dead = 0;
+    }
+
+    // Threads without their own address space run on whatever is loaded.
+    // Only those can enter ring 3, so kernel threads skip the rsp0 store.
+    if (c->proc && c->proc->vm) {
+        vm_activate(c, c->proc->vm);
+        c->tss.rsp[0] = (uintptr_t)c->proc->stack + KSTACK_SIZE;
+    }
+}
+
+// Called with interrupts off and an empty run queue. sti only takes effect
+// after the following instruction so no wakeup can slip in before we wait.
+static void idle_wait(struct cpu *c) {
+    u64 start = rdtsc();
+
+    if (cpu_has_mwait) {
+        // Every enqueue writes nr_running, which ends the wait without
+        // needing an IPI. Interrupts still wake us as with hlt.
+        asm volatile("monitor" : : "a"(&c->nr_running), "c"(0), "d"(0));
+        if (!c->nr_running)
+            asm volatile("sti; mwait" : : "a"(0), "c"(0));
+    } else {
+        asm volatile("sti; hlt");
+    }
+    cli();
+
+    u64 now = rdtsc();
+    c->idle_cycles += now - start;
+    c->idle_count++;
+
+    // Interrupts were on while we waited, the irq-off span restarts here
+    c->irqoff.start = now;
+}
+
+#ifdef BENCH
+static void print_idle_stats(void) {
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        struct cpu *c = &cpus[i];
+        u64 total = rdtsc() - c->start_tsc;
+
+        early_printf("idle: cpu %lu waits %lu cycles %lu residency %lu%%\n",
+                     i, c->idle_count, c->idle_cycles, total ? c->idle_cycles * 100 / total : 0);
+    }
+}
+#endif
+
+// Per-cpu idle loop. sched() only switches here when nothing is runnable.
+static void scheduler() {
+    struct cpu *c = my_cpu();
+
+    c->start_tsc = rdtsc();
+    sti();
+
+    for (;;) {
+        pushcli();
+
+        struct proc *p = pick_next(c);
+        if (p) {
+            c->proc = p;
+            p->state = PROC_RUNNING;
+
+            switch_proc(&c->scheduler_context, &p->context);
+
+            finish_switch();
+        } else {
+            idle_wait(c);
+        }
+
+        popcli();
+    }
+}
+
+static struct list *sleep_bucket(void *channel) {
+    return &sleep_table[((uintptr_t)channel * 0x9E3779B97F4A7C15ULL) >> (64 - SLEEP_HASH_BITS)];
+}
+
+static void _wake_up(void *channel) {
+    struct list *bucket = sleep_bucket(channel);
+
+    for (struct list *n = bucket->next; n != bucket;) {
+        struct proc *p = container_of(n, struct proc, node);
+        n = n->next;
+
+        if (p->channel == channel) {
+            list_del(&p->node);
+            make_runnable(p);
+        }
+    }
+}
+
+static void preempt_check(void);
+
+static void wake_up(void *channel) {
+    pushcli();
+    _wake_up(channel);
+    popcli();
+
+    preempt_check();
+}
+
+static void sched(void) {
+    struct proc *p = my_proc();
+    struct cpu *c = my_cpu();
+
+    if (c->cli_count != 1)
+        panic("cli_count != 1 in sched\n");
+    if (p->state == PROC_RUNNING)
+        panic("process already running in sched\n");
+    if (p->preempt_count)
+        panic("sched with preemption disabled\n");
+    if (readrflags() & RFLAG_IF)
+        panic("sched is interruptable\n");
+    int int_enabled = c->interrupts_enabled;
+
+    update_curr(c);
+    if (p->state == PROC_RUNNABLE)
+        put_prev(c, p);
+    c->need_resched = 0;
+
+    struct proc *next = sched_direct_switch ? pick_next(c) : 0;
+    if (p->state == PROC_DEAD)
+        c->dead = p;
+
+    if (next == p) {
+        p->state = PROC_RUNNING;
+    } else if (next) {
+        c->proc = next;
+        next->state = PROC_RUNNING;
+        switch_proc(&p->context, &next->context);
+        finish_switch();
+    } else {
+        // Nothing else to run, fall back to the scheduler context to idle
+        c->proc = 0;
+        switch_proc(&p->context, &c->scheduler_context);
+        finish_switch();
+    }
+
+    my_cpu()->interrupts_enabled = int_enabled;
+}
+
+// Caller holds a single pushcli and has already checked its wake condition
+static void _sleep(void *channel) {
+    struct proc *p = my_proc();
+
+    p->channel = channel;
+    p->state = PROC_SLEEPING;
+    list_add_tail(sleep_bucket(channel), &p->node);
+
+    sched();
+
+    p->channel = NULL;
+}
+
+static void sleep(void *channel) {
+    pushcli();
+    _sleep(channel);
+    popcli();
+}
+
+static void exit(void) {
+    pushcli();
+    struct proc *p = my_proc();
+    if (p->policy == SCHED_DEADLINE)
+        my_cpu()->dl_bw -= p->dl_bw;
+
+    // Nobody else would ever wake the caller we owe a reply
+    if (p->ipc_caller) {
+        p->ipc_caller->ipc_failed = 1;
+        make_runnable(p->ipc_caller);
+        p->ipc_caller = 0;
+    }
+
+    p->state = PROC_DEAD;
+    sched();
+    panic("dead process exit\n");
+}
+
+// Queues the caller behind the leftmost thread so yield always gives way
+static void yield(void) {
+    pushcli();
+    struct cpu *c = my_cpu();
+    struct proc *p = my_proc();
+
+    update_curr(c);
+    struct rb_node *left = c->fair_tree.leftmost;
+    if (p->policy == SCHED_NORMAL && left && (s64)(rb_proc(left)->vruntime - p->vruntime) > 0)
+        p->vruntime = rb_proc(left)->vruntime;
+
+    p->state = PROC_RUNNABLE;
+    sched();
+    popcli();
+}
+
+// Switches from the blocked current thread straight to next, which is on no
+// run queue. next carries on with what is left of the caller's slice.
+static void sched_handoff(struct proc *next) {
+    struct proc *p = my_proc();
+    struct cpu *c = my_cpu();
+
+    if (c->cli_count != 1)
+        panic("cli_count != 1 in sched_handoff\n");
+    if (p->state != PROC_SLEEPING)
+        panic("sched_handoff from a runnable thread\n");
+    if (p->preempt_count)
+        panic("sched_handoff with preemption disabled\n");
+    int int_enabled = c->interrupts_enabled;
+
+    update_curr(c);
+    next->exec_start = p->exec_start;
+    next->slice_start = next->sum_exec - (p->sum_exec - p->slice_start);
+
+    c->proc = next;
+    next->state = PROC_RUNNING;
+    switch_proc(&p->context, &next->context);
+    finish_switch();
+
+    my_cpu()->interrupts_enabled = int_enabled;
+}
+
+// Involuntary switch. Unlike yield the thread keeps its place in its class.
+static void preempt_schedule(void) {
+    pushcli();
+    my_proc()->state = PROC_RUNNABLE;
+    sched();
+    popcli();
+}
+
+// Preemption point for code that may have left need_resched pending while
+// it could not be preempted. Does nothing in interrupt context.
+static void preempt_check(void) {
+    struct cpu *c = my_cpu();
+    struct proc *p = c->proc;
+
+    if (!c->need_resched || !p || p->state != PROC_RUNNING || p->preempt_count)
+        return;
+    if (c->cli_count || !(readrflags() & RFLAG_IF))
+        return;
+
+    preempt_schedule();
+}
+
+static __attribute__((noinline)) void preempt_disable(void) {
+    struct proc *p = my_proc();
+    if (!p)
+        return;
+
+    if (p->preempt_count++ == 0 && TRACE_LATENCY) {
+        struct cpu *c = my_cpu();
+        c->preemptoff.start = rdtsc();
+        c->preemptoff.start_site = (uintptr_t)__builtin_return_address(0);
+    }
+    barrier();
+}
+
+static __attribute__((noinline)) void preempt_enable(void) {
+    struct proc *p = my_proc();
+    if (!p)
+        return;
+
+    barrier();
+    if (--p->preempt_count == 0) {
+        if (TRACE_LATENCY) {
+            struct cpu *c = my_cpu();
+            trace_record(&c->preemptoff, c->preemptoff.start, c->preemptoff.start_site, (uintptr_t)__builtin_return_address(0));
+        }
+        preempt_check();
+    }
+}
+
+// Preemption point for long loops that hold a single preempt_disable
+static void cond_resched(void) {
+    struct proc *p = my_proc();
+
+    if (!p || p->preempt_count != 1 || !my_cpu()->need_resched)
+        return;
+
+    preempt_enable();
+    preempt_disable();
+}
+
+#ifdef BENCH
+static void print_latency_stats(void) {
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        struct cpu *c = &cpus[i];
+
+        early_printf("latency: cpu %lu irqoff %luns %p -> %p preemptoff %luns %p -> %p\n",
+                     i, tsc_to_ns(c->irqoff.max), c->irqoff.max_site, c->irqoff.max_end_site,
+                     tsc_to_ns(c->preemptoff.max), c->preemptoff.max_site, c->preemptoff.max_end_site);
+    }
+}
+#endif
+
+// Ends the current job of a deadline thread and sleeps until its next
+// period starts
+static void sched_wait_period(void) {
+    pushcli();
+    struct cpu *c = my_cpu();
+    struct proc *p = my_proc();
+
+    if (p->policy != SCHED_DEADLINE) {
+        popcli();
+        yield();
+        return;
+    }
+
+    update_curr(c);
+    dl_account_finish(p, clock_ns());
+    dl_throttle(c, p, p->dl_abs_deadline - p->dl_deadline + p->dl_period);
+    sched();
+    popcli();
+}
+
+// First C code run by a new thread, entered through kthread_entry with the
+// pushcli of the thread that switched to it still held
+void kthread_start(void (* fn)()) {
+    finish_switch();
+    // The switching thread may have come from a trap with interrupts off
+    my_cpu()->interrupts_enabled = 1;
+    popcli();
+    fn();
+    exit();
+}
+
+// First C code run by a new user thread, entered through uthread_entry.
+// Interrupts stay off until the iretq into ring 3 turns them on.
+void uthread_start(void) {
+    finish_switch();
+    my_cpu()->interrupts_enabled = 0;
+    popcli();
+}
+
+// Caller holds pushcli. Returns NULL when out of memory or thread ids.
+static struct proc *proc_alloc(void) {
+    struct proc *p = kmem_cache_alloc(&proc_cache);
+    if (!p)
+        return NULL;
+
+    p->stack = kstack_alloc();
+    if (!p->stack) {
+        kmem_cache_free(&proc_cache, p);
+        return NULL;
+    }
+
+    p->tid = idr_alloc(&tid_idr, p);
+    if (p->tid < 0) {
+        kstack_free(p->stack);
+        kmem_cache_free(&proc_cache, p);
+        return NULL;
+    }
+    *(u64 *)p->stack = KSTACK_CANARY;
+
+    p->nice = 0;
+    p->weight = NICE_0_WEIGHT;
+    p->vruntime = my_cpu()->min_vruntime;
+    return p;
+}
+
+// Returns NULL when out of memory or thread ids
+static struct proc *kthread_create(void (* fn)()) {
+    pushcli();
+
+    struct proc *p = proc_alloc();
+    if (!p) {
+        popcli();
+        return NULL;
+    }
+
+    uintptr_t *sp = (uintptr_t *)((char *)p->stack + KSTACK_SIZE);
+    *--sp = (uintptr_t)kthread_entry;
+    p->context.rsp = (uintptr_t)sp;
+    p->context.r12 = (uintptr_t)fn;
+
+    enqueue_proc(my_cpu(), p, 0);
+
+    popcli();
+    return p;
+}
+
+// Starts a ring 3 thread at entry in vm with arg in rdi. The kernel stack
+// starts out holding the trap frame that uthread_entry returns through.
+// Returns NULL when out of memory or thread ids.
+static struct proc *uthread_create(struct vm_space *vm, struct cap_table *caps, uintptr_t entry,
+                                   uintptr_t user_sp, u64 arg) {
+    pushcli();
+
+    struct proc *p = proc_alloc();
+    if (!p) {
+        popcli();
+        return NULL;
+    }
+
+    p->vm = vm;
+    p->caps = caps;
+    vm_get(vm);
+    if (caps)
+        cap_table_get(caps);
+
+    struct trap_frame *tf = (struct trap_frame *)((char *)p->stack + KSTACK_SIZE) - 1;
+    memset(tf, 0, sizeof(*tf));
+    tf->rip = entry;
+    tf->cs = (SEG_UCODE << 3) | DPL_USER;
+    tf->rflags = RFLAG_IF;
+    tf->rsp = user_sp;
+    tf->ss = (SEG_UDATA << 3) | DPL_USER;
+    tf->rdi = arg;
+
+    uintptr_t *sp = (uintptr_t *)((char *)p->stack + KSTACK_SIZE - sizeof(*tf));
+    *--sp = (uintptr_t)uthread_entry;
+    p->context.rsp = (uintptr_t)sp;
+
+    enqueue_proc(my_cpu(), p, 0);
+
+    popcli();
+    return p;
+}
+
+#ifndef BENCH
+// Starts a thread running name from the initrd in a fresh address space
+// with a lazily filled stack below ELF_STACK_TOP and arg in rdi. NULL if
+// the file is missing or not loadable, or out of memory.
+static struct proc *elf_spawn(const char *name, struct cap_table *caps, u64 arg) {
+    struct initrd_file *f = initrd_find(name);
+    if (!f)
+        return NULL;
+
+    struct vm_space *vm = vm_create();
+    if (!vm)
+        return NULL;
+
+    uintptr_t entry = elf_load(vm, f);
+    if (!entry || vm_add_area(vm, ELF_STACK_TOP - ELF_STACK_SIZE, ELF_STACK_TOP, PAGE_RW, NULL, 0, 0) < 0) {
+        vm_put(vm);
+        return NULL;
+    }
+
+    // The thread holds its own reference
+    struct proc *p = uthread_create(vm, caps, entry, ELF_STACK_TOP, arg);
+    vm_put(vm);
+    return p;
+}
+#endif
+
+static void init_sched(void) {
+    kmem_cache_init(&proc_cache, sizeof(struct proc));
+    kmem_cache_init(&idr_node_cache, sizeof(struct idr_node));
+
+    for (size_t i = 0; i < SLEEP_HASH_SIZE; i++)
+        list_init(&sleep_table[i]);
+    for (size_t i = 0; i < FUTEX_HASH_SIZE; i++)
+        list_init(&futex_table[i]);
+
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        list_init(&cpus[i].dl_throttled);
+        list_init(&cpus[i].timers);
+        for (size_t j = 0; j < RT_PRIO_COUNT; j++)
+            list_init(&cpus[i].rt_queue[j]);
+    }
+
+    u32 eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    cpu_has_mwait = (ecx & CPUID_ECX_MONITOR) != 0;
+}
+
+static void init_ipc(void) {
+    kmem_cache_init(&endpoint_cache, sizeof(struct endpoint));
+    kmem_cache_init(&channel_cache, sizeof(struct channel));
+    kmem_cache_init(&cap_table_cache, sizeof(struct cap_table));
+}
+
+// Returns NULL when out of memory
+static struct endpoint *endpoint_create(void) {
+    pushcli();
+
+    struct endpoint *ep = kmem_cache_alloc(&endpoint_cache);
+    if (!ep) {
+        popcli();
+        return NULL;
+    }
+
+    list_init(&ep->senders);
+    list_init(&ep->receivers);
+
+    popcli();
+    return ep;
+}
+
+#ifdef BENCH
+// Frees ep once no thread is queued on it. Capabilities naming it have to
+// be deleted first, and no thread may be between looking one up and
+// queueing, which only the bench can promise for now. -1 while a caller or
+// a server still waits on it.
+static int endpoint_destroy(struct endpoint *ep) {
+    pushcli();
+
+    if (!list_empty(&ep->senders) || !list_empty(&ep->receivers)) {
+        popcli();
+        return -1;
+    }
+
+    kmem_cache_free(&endpoint_cache, ep);
+    popcli();
+    return 0;
+}
+#endif
+
+// Gives the cpu straight to the ipc partner unless something more urgent
+// is already waiting
+static void ipc_switch(struct cpu *c, struct proc *next) {
+    if (c->need_resched) {
+        make_runnable(next);
+        sched();
+    } else {
+        sched_handoff(next);
+    }
+}
+
+// Sends msg on ep and blocks until a server replies into it. The server
+// sees badge, which names the capability the call was made through.
+// Returns -1, leaving msg alone, when the server exits instead.
+static int ipc_call(struct endpoint *ep, u64 badge, struct ipc_msg *msg) {
+    pushcli();
+    struct cpu *c = my_cpu();
+    struct proc *p = c->proc;
+
+    p->ipc_msg = *msg;
+    p->ipc_badge = badge;
+    p->ipc_failed = 0;
+    p->state = PROC_SLEEPING;
+
+    if (list_empty(&ep->receivers)) {
+        list_add_tail(&ep->senders, &p->node);
+        sched();
+    } else {
+        struct proc *server = container_of(ep->receivers.next, struct proc, node);
+        list_del(&server->node);
+        server->ipc_msg = p->ipc_msg;
+        server->ipc_badge = badge;
+        server->ipc_caller = p;
+        ipc_switch(c, server);
+    }
+
+    int failed = p->ipc_failed;
+    if (!failed)
+        *msg = p->ipc_msg;
+    popcli();
+    return failed ? -1 : 0;
+}
+
+// Sends msg back to the pending caller, if any, without blocking
+static void ipc_reply(struct ipc_msg *msg) {
+    pushcli();
+    struct proc *p = my_proc();
+    struct proc *caller = p->ipc_caller;
+
+    if (caller) {
+        p->ipc_caller = 0;
+        caller->ipc_msg = *msg;
+        make_runnable(caller);
+    }
+
+    popcli();
+    preempt_check();
+}
+
+// Replies to the pending caller, if any, with msg, then waits for the next
+// call on ep and returns it in msg and its badge. The caller runs next
+// unless another call is already queued.
+static void ipc_reply_wait(struct endpoint *ep, struct ipc_msg *msg, u64 *badge) {
+    pushcli();
+    struct cpu *c = my_cpu();
+    struct proc *p = c->proc;
+    struct proc *caller = p->ipc_caller;
+
+    p->ipc_caller = 0;
+    if (caller)
+        caller->ipc_msg = *msg;
+
+    if (!list_empty(&ep->senders)) {
+        struct proc *next = container_of(ep->senders.next, struct proc, node);
+        list_del(&next->node);
+        p->ipc_caller = next;
+        *msg = next->ipc_msg;
+        *badge = next->ipc_badge;
+        if (caller)
+            make_runnable(caller);
+        popcli();
+        preempt_check();
+        return;
+    }
+
+    p->state = PROC_SLEEPING;
+    list_add_tail(&ep->receivers, &p->node);
+    if (caller)
+        ipc_switch(c, caller);
+    else
+        sched();
+
+    *msg = p->ipc_msg;
+    *badge = p->ipc_badge;
+    popcli();
+}
+
+static void channel_free_pages(struct channel *ch) {
+    if (ch->ctl)
+        early_kfree(ch->ctl, 0);
+    for (size_t i = 0; i < 2; i++) {
+        if (ch->rings[i].entries)
+            early_kfree(ch->rings[i].entries, RING_ORDER);
+    }
+}
+
+// Page i of the layout CHANNEL_PAGES describes
+static void *channel_page(struct channel *ch, size_t i) {
+    size_t ring_pages = 1 << RING_ORDER;
+
+    if (!i)
+        return ch->ctl;
+    return (u8 *)ch->rings[(i - 1) / ring_pages].entries + (i - 1) % ring_pages * PAGE_SIZE;
+}
+
+// Returns NULL when out of memory
+static struct channel *channel_create(void) {
+    pushcli();
+
+    struct channel *ch = kmem_cache_alloc(&channel_cache);
+    if (!ch) {
+        popcli();
+        return NULL;
+    }
+
+    ch->ctl = try_early_kalloc(0);
+    for (size_t i = 0; i < 2; i++) {
+        ch->rings[i].ctl = &ch->ctl[i];
+        ch->rings[i].entries = try_early_kalloc(RING_ORDER);
+    }
+
+    if (!ch->ctl || !ch->rings[RING_SQ].entries || !ch->rings[RING_CQ].entries) {
+        channel_free_pages(ch);
+        kmem_cache_free(&channel_cache, ch);
+        popcli();
+        return NULL;
+    }
+
+    // The kernel's reference, so a party unmapping its view never frees a
+    // page the other side still uses
+    for (size_t i = 0; i < CHANNEL_PAGES; i++)
+        frame_get(v2p((uintptr_t)channel_page(ch, i)));
+
+    popcli();
+    return ch;
+}
+
+// Drops the kernel's references. Pages still mapped into an address space
+// stay until they are unmapped there. -1 while a capability names ch or a
+// consumer sleeps in ring_wait.
+static int channel_destroy(struct channel *ch) {
+    pushcli();
+
+    if (__atomic_load_n(&ch->caps, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&ch->rings[RING_SQ].sleepers, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&ch->rings[RING_CQ].sleepers, __ATOMIC_ACQUIRE)) {
+        popcli();
+        return -1;
+    }
+
+    for (size_t i = 0; i < CHANNEL_PAGES; i++)
+        frame_put(v2p((uintptr_t)channel_page(ch, i)));
+    kmem_cache_free(&channel_cache, ch);
+
+    popcli();
+    return 0;
+}
+
+// Maps all CHANNEL_PAGES of ch at va in vm, each party into its own space.
+// Writable, since each side moves one index of each ring.
+static int channel_map(struct channel *ch, struct vm_space *vm, uintptr_t va) {
+    if (!vm_range_ok(va, CHANNEL_PAGES))
+        return -1;
+
+    pushcli();
+    if (!vm_range_is(vm, va, CHANNEL_PAGES, 0)) {
+        popcli();
+        return -1;
+    }
+
+    for (size_t i = 0; i < CHANNEL_PAGES; i++) {
+        if (vm_map_kernel(vm, va + i * PAGE_SIZE, channel_page(ch, i), PAGE_RW) < 0) {
+            popcli();
+            vm_unmap(vm, va, i);
+            return -1;
+        }
+    }
+
+    popcli();
+    return 0;
+}
+
+// Copies in up to n messages and publishes them with a single tail store.
+// Returns how many fit.
+static u32 ring_push(struct ring *r, const struct ipc_msg *msgs, u32 n) {
+    struct ring_ctl *ctl = r->ctl;
+    u32 tail = __atomic_load_n(&ctl->tail, __ATOMIC_RELAXED);
+    u32 head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+    u32 space = RING_ENTRIES - (tail - head);
+
+    if (n > space)
+        n = space;
+    for (u32 i = 0; i < n; i++)
+        r->entries[(tail + i) & RING_MASK] = msgs[i];
+
+    __atomic_store_n(&ctl->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Copies out up to max messages and frees their slots with a single head
+// store. Returns how many were taken.
+static u32 ring_pop(struct ring *r, struct ipc_msg *msgs, u32 max) {
+    struct ring_ctl *ctl = r->ctl;
+    u32 head = __atomic_load_n(&ctl->head, __ATOMIC_RELAXED);
+    u32 tail = __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE);
+    u32 n = tail - head;
+
+    if (n > max)
+        n = max;
+    for (u32 i = 0; i < n; i++)
+        msgs[i] = r->entries[(head + i) & RING_MASK];
+
+    __atomic_store_n(&ctl->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Blocks the consumer until r has entries. waiting is rechecked against
+// tail after being set so a push that missed the flag is not lost.
+static void ring_wait(struct ring *r) {
+    struct ring_ctl *ctl = r->ctl;
+
+    pushcli();
+    __atomic_fetch_add(&r->sleepers, 1, __ATOMIC_ACQ_REL);
+    for (;;) {
+        __atomic_store_n(&ctl->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ctl->tail, __ATOMIC_SEQ_CST) != ctl->head)
+            break;
+        _sleep(&ctl->waiting);
+    }
+    __atomic_store_n(&ctl->waiting, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&r->sleepers, 1, __ATOMIC_ACQ_REL);
+    popcli();
+}
+
+static void ring_notify(struct ring *r) {
+    pushcli();
+    __atomic_store_n(&r->ctl->waiting, 0, __ATOMIC_RELAXED);
+    _wake_up(&r->ctl->waiting);
+    popcli();
+
+    preempt_check();
+}
+
+// Producer side after one or more ring_push calls. Only enters the kernel
+// when the consumer is asleep, returns whether it did.
+static int ring_kick(struct ring *r) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&r->ctl->waiting, __ATOMIC_RELAXED))
+        return 0;
+
+    ring_notify(r);
+    return 1;
+}
+
+// Returns NULL when out of memory
+static struct cap_table *cap_table_create(void) {
+    pushcli();
+
+    struct cap_table *t = kmem_cache_alloc(&cap_table_cache);
+    if (!t) {
+        popcli();
+        return NULL;
+    }
+
+    t->slots = try_early_kalloc(CAP_TABLE_ORDER);
+    if (!t->slots) {
+        kmem_cache_free(&cap_table_cache, t);
+        popcli();
+        return NULL;
+    }
+
+    for (u32 i = 0; i < CAP_TABLE_SLOTS; i++)
+        t->slots[i].next_free = i + 1 < CAP_TABLE_SLOTS ? i + 1 : CAP_NO_SLOT;
+    t->free_head = 0;
+    t->count = 0;
+    t->refs = 1;
+
+    popcli();
+    return t;
+}
+
+static u64 cap_handle(struct cap *c) {
+    return (u64)c->gen << 32 | (u64)(c - c->table->slots);
+}
+
+// Lock-free. The slot is read between two loads of its generation, so a
+// concurrent delete makes the lookup fail rather than return a stale
+// object. Returns the object if the handle names a live capability of type
+// with at least rights.
+static void *cap_lookup(struct cap_table *t, u64 handle, enum cap_type type, u32 rights, u64 *badge) {
+    u32 index = (u32)handle;
+    u32 gen = handle >> 32;
+
+    if (!t || index >= CAP_TABLE_SLOTS)
+        return 0;
+
+    struct cap *c = &t->slots[index];
+    if (__atomic_load_n(&c->gen, __ATOMIC_ACQUIRE) != gen)
+        return 0;
+
+    u32 ctype = __atomic_load_n(&c->type, __ATOMIC_RELAXED);
+    u32 crights = __atomic_load_n(&c->rights, __ATOMIC_RELAXED);
+    u64 cbadge = __atomic_load_n(&c->badge, __ATOMIC_RELAXED);
+    void *obj = __atomic_load_n(&c->obj, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&c->gen, __ATOMIC_RELAXED) != gen)
+        return 0;
+
+    if (ctype != type || (crights & rights) != rights)
+        return 0;
+    if (badge)
+        *badge = cbadge;
+    return obj;
+}
+
+// Writers run under pushcli. Returns NULL when the table is full.
+static struct cap *cap_slot_alloc(struct cap_table *t) {
+    if (t->free_head == CAP_NO_SLOT)
+        return 0;
+
+    struct cap *c = &t->slots[t->free_head];
+    t->free_head = c->next_free;
+    t->count++;
+
+    c->table = t;
+    c->parent = 0;
+    c->child = 0;
+    c->next = 0;
+    c->prev = 0;
+    return c;
+}
+
+static void cap_link_child(struct cap *parent, struct cap *c) {
+    c->parent = parent;
+    c->prev = 0;
+    c->next = parent->child;
+    if (parent->child)
+        parent->child->prev = c;
+    parent->child = c;
+}
+
+static void cap_unlink(struct cap *c) {
+    if (c->prev)
+        c->prev->next = c->next;
+    else if (c->parent)
+        c->parent->child = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+}
+
+// Capabilities keep the objects that are reference counted alive, and
+// channels from being destroyed under them
+static void cap_obj_get(struct cap *c) {
+    if (c->type == CAP_VM)
+        vm_get(c->obj);
+    else if (c->type == CAP_CHANNEL)
+        __atomic_fetch_add(&((struct channel *)c->obj)->caps, 1, __ATOMIC_RELAXED);
+}
+
+static void cap_obj_put(enum cap_type type, void *obj) {
+    if (type == CAP_VM)
+        vm_put(obj);
+    else if (type == CAP_CHANNEL)
+        __atomic_fetch_sub(&((struct channel *)obj)->caps, 1, __ATOMIC_RELEASE);
+}
+
+// Retires the slot. The generation is bumped before anything else is
+// touched so lock-free readers notice.
+static void cap_free(struct cap *c) {
+    struct cap_table *t = c->table;
+    enum cap_type type = c->type;
+    void *obj = c->obj;
+
+    __atomic_store_n(&c->gen, (c->gen + 1) & CAP_GEN_MASK, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    cap_unlink(c);
+    c->type = CAP_NONE;
+    c->rights = 0;
+    c->obj = 0;
+
+    c->next_free = t->free_head;
+    t->free_head = c - t->slots;
+    t->count--;
+
+    cap_obj_put(type, obj);
+}
+
+// Installs an original capability with no parent. Returns its handle or
+// -1 when the table is full.
+static s64 cap_install(struct cap_table *t, enum cap_type type, void *obj, u32 rights) {
+    pushcli();
+
+    struct cap *c = cap_slot_alloc(t);
+    if (!c) {
+        popcli();
+        return -1;
+    }
+
+    c->type = type;
+    c->rights = rights & CAP_RIGHTS_ALL;
+    c->badge = 0;
+    c->obj = obj;
+    cap_obj_get(c);
+
+    s64 handle = cap_handle(c);
+    popcli();
+    return handle;
+}
+
+static struct cap *cap_get(struct cap_table *t, u64 handle) {
+    u32 index = (u32)handle;
+
+    if (!t || index >= CAP_TABLE_SLOTS)
+        return 0;
+
+    struct cap *c = &t->slots[index];
+    if (c->gen != handle >> 32 || c->type == CAP_NONE)
+        return 0;
+    return c;
+}
+
+// Derives a capability in dst with at most the source's rights. Needs
+// CAP_RIGHT_GRANT on the source. Only an unbadged capability can be
+// minted with a badge, so a server can trust the badge it receives.
+static s64 cap_derive(struct cap_table *src, u64 handle, struct cap_table *dst, u32 rights, int mint, u64 badge) {
+    pushcli();
+
+    struct cap *from = cap_get(src, handle);
+    if (!from || !(from->rights & CAP_RIGHT_GRANT) || (mint && from->badge)) {
+        popcli();
+        return -1;
+    }
+
+    struct cap *c = cap_slot_alloc(dst);
+    if (!c) {
+        popcli();
+        return -1;
+    }
+
+    c->type = from->type;
+    c->rights = from->rights & rights;
+    c->badge = mint ? badge : from->badge;
+    c->obj = from->obj;
+    cap_obj_get(c);
+    cap_link_child(from, c);
+
+    s64 h = cap_handle(c);
+    popcli();
+    return h;
+}
+
+static s64 cap_copy(struct cap_table *src, u64 handle, struct cap_table *dst, u32 rights) {
+    return cap_derive(src, handle, dst, rights, 0, 0);
+}
+
+static s64 cap_mint(struct cap_table *src, u64 handle, struct cap_table *dst, u32 rights, u64 badge) {
+    return cap_derive(src, handle, dst, rights, 1, badge);
+}
+
+// Deletes every capability derived from handle, in any table, but keeps
+// handle itself. Each node of the subtree is visited a bounded number of
+// times and no table is scanned.
+static int cap_revoke(struct cap_table *t, u64 handle) {
+    pushcli();
+
+    struct cap *root = cap_get(t, handle);
+    if (!root) {
+        popcli();
+        return -1;
+    }
+
+    struct cap *n = root->child;
+    while (n) {
+        if (n->child) {
+            n = n->child;
+            continue;
+        }
+
+        struct cap *parent = n->parent;
+        cap_free(n);
+        n = parent == root ? root->child : parent;
+    }
+
+    popcli();
+    return 0;
+}
+
+// Deletes one capability. Anything derived from it is handed to its parent
+// so a later revoke higher up still reaches it.
+static void cap_remove(struct cap *c) {
+    while (c->child) {
+        struct cap *child = c->child;
+        cap_unlink(child);
+        if (c->parent)
+            cap_link_child(c->parent, child);
+        else
+            child->parent = 0;
+    }
+    cap_free(c);
+}
+
+static int cap_delete(struct cap_table *t, u64 handle) {
+    pushcli();
+
+    struct cap *c = cap_get(t, handle);
+    if (!c) {
+        popcli();
+        return -1;
+    }
+
+    cap_remove(c);
+
+    popcli();
+    return 0;
+}
+
+static void cap_table_get(struct cap_table *t) {
+    __atomic_fetch_add(&t->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Deletes every capability in t as cap_delete would, so copies in other
+// tables survive, then frees t once no thread uses it
+static void cap_table_put(struct cap_table *t) {
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    pushcli();
+    for (u32 i = 0; i < CAP_TABLE_SLOTS; i++) {
+        if (t->slots[i].type != CAP_NONE)
+            cap_remove(&t->slots[i]);
+    }
+
+    early_kfree(t->slots, CAP_TABLE_ORDER);
+    kmem_cache_free(&cap_table_cache, t);
+    popcli();
+}
+
+static int sys_ipc(struct trap_frame *tf) {
+    struct cap_table *caps = my_proc()->caps;
+    struct ipc_msg msg = { { tf->rsi, tf->rdx, tf->r8, tf->r9 } };
+    struct endpoint *ep;
+    u64 badge;
+
+    switch (tf->rax) {
+        case SYS_IPC_CALL:
+            ep = cap_lookup(caps, tf->rdi, CAP_ENDPOINT, CAP_RIGHT_SEND, &badge);
+            if (!ep)
+                return -1;
+            if (ipc_call(ep, badge, &msg) < 0)
+                return -1;
+            break;
+        case SYS_IPC_REPLY_WAIT:
+            ep = cap_lookup(caps, tf->rdi, CAP_ENDPOINT, CAP_RIGHT_RECV, 0);
+            if (!ep)
+                return -1;
+            ipc_reply_wait(ep, &msg, &badge);
+            tf->rdi = badge;
+            break;
+        default:
+            ipc_reply(&msg);
+            break;
+    }
+
+    tf->rsi = msg.w[0];
+    tf->rdx = msg.w[1];
+    tf->r8 = msg.w[2];
+    tf->r9 = msg.w[3];
+    return 0;
+}
+
+// CREATE returns a handle with every right. MAP: rdi = channel handle and
+// rsi = CAP_VM handle, both with CAP_RIGHT_MAP, rdx = va of the
+// CHANNEL_PAGES pages.
+static s64 sys_channel(struct trap_frame *tf) {
+    struct cap_table *caps = my_proc()->caps;
+
+    if (tf->rax == SYS_CHANNEL_CREATE) {
+        struct channel *ch = channel_create();
+        if (!ch)
+            return -1;
+
+        s64 handle = cap_install(caps, CAP_CHANNEL, ch, CAP_RIGHTS_ALL);
+        if (handle < 0)
+            channel_destroy(ch);
+        return handle;
+    }
+
+    struct channel *ch = cap_lookup(caps, tf->rdi, CAP_CHANNEL, CAP_RIGHT_MAP, 0);
+    struct vm_space *vm = cap_lookup(caps, tf->rsi, CAP_VM, CAP_RIGHT_MAP, 0);
+    if (!ch || !vm)
+        return -1;
+    return channel_map(ch, vm, tf->rdx);
+}
+
+// rdi = channel handle, rsi = RING_SQ or RING_CQ
+static int sys_ring(struct trap_frame *tf) {
+    u32 rights = tf->rax == SYS_RING_WAIT ? CAP_RIGHT_RECV : CAP_RIGHT_SEND;
+    struct channel *ch = cap_lookup(my_proc()->caps, tf->rdi, CAP_CHANNEL, rights, 0);
+
+    if (!ch || tf->rsi > RING_CQ)
+        return -1;
+
+    if (tf->rax == SYS_RING_WAIT)
+        ring_wait(&ch->rings[tf->rsi]);
+    else
+        ring_notify(&ch->rings[tf->rsi]);
+    return 0;
+}
+
+// ioapic_count if no ioapic has gsi
+static size_t ioapic_for_gsi(u32 gsi) {
+    for (size_t i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi - ioapics[i].gsi_base < ioapics[i].pins)
+            return i;
+    }
+    return ioapic_count;
+}
+
+static u32 isa_irq_gsi(u8 isa_irq) {
+    return isa_routes[isa_irq].gsi;
+}
+
+// Isa lines follow their override, the rest are PCI lines and so level
+// triggered active low
+static u32 gsi_redirect_flags(u32 gsi) {
+    for (size_t i = 0; i < ISA_IRQS; i++) {
+        if (isa_routes[i].gsi == gsi)
+            return isa_routes[i].redirect;
+    }
+    return gsi < ISA_IRQS ? 0 : IOAPIC_LEVEL | IOAPIC_ACTIVELOW;
+}
+
+// Enabled in the madt is not enough, the cpu has to be running to take
+// interrupts
+static int cpu_online(size_t cpu) {
+    return cpu < lapic_count && (lapics[cpu].flags & MADT_LAPIC_ENABLED) && cpus[cpu].started;
+}
+
+// Round robin over the online cpus
+static size_t irq_pick_cpu(void) {
+    if (!irq_balancing)
+        return 0;
+
+    for (size_t i = 0; i < lapic_count; i++) {
+        size_t cpu = irq_next_cpu++ % lapic_count;
+        if (cpu_online(cpu))
+            return cpu;
+    }
+    return 0;
+}
+
+// cpus[i] runs on the lapic of lapics[i]. An msi-x entry is rewritten
+// as a whole, so the device cannot send a torn message meanwhile.
+static void irq_route(struct irq *irq, size_t cpu) {
+    irq->cpu = cpu;
+
+    if (irq->msix) {
+        volatile u32 *entry = (volatile u32 *)(irq->msix->msix_table + irq->msix_entry * MSIX_ENTRY_SIZE);
+        u32 control = entry[MSIX_ENTRY_CONTROL / 4];
+
+        entry[MSIX_ENTRY_CONTROL / 4] = MSIX_ENTRY_MASKED;
+        entry[MSIX_ENTRY_ADDR / 4] = MSI_ADDRESS_BASE | (u32)lapics[cpu].apic_id << 12;
+        entry[MSIX_ENTRY_ADDR / 4 + 1] = 0;
+        entry[MSIX_ENTRY_DATA / 4] = irq->vector;
+        entry[MSIX_ENTRY_CONTROL / 4] = control;
+        return;
+    }
+
+    ioapicwrite(irq->ioapic, IOAPIC_REG_TABLE + 2 * irq->pin + 1, (u32)lapics[cpu].apic_id << 24);
+}
+
+// Caller holds pushcli. NULL when every vector is taken.
+static struct irq *irq_alloc(int boost) {
+    for (size_t i = 0; i < MAX_IRQS; i++) {
+        struct irq *irq = &irqs[i];
+        if (irq->bound)
+            continue;
+
+        irq->bound = 1;
+        irq->boost = boost;
+        irq->msix = 0;
+        irq->vector = IRQ_VECTOR_BASE + i;
+        irq->pinned = 0;
+        irq->count = 0;
+        irq->pending = 0;
+        irq->waiter = 0;
+        irq->handler = 0;
+        return irq;
+    }
+    return NULL;
+}
+
+static void irq_set_masked(struct irq *irq, int masked) {
+    if (irq->msix) {
+        volatile u32 *entry = (volatile u32 *)(irq->msix->msix_table + irq->msix_entry * MSIX_ENTRY_SIZE);
+        entry[MSIX_ENTRY_CONTROL / 4] = masked ? MSIX_ENTRY_MASKED : 0;
+        return;
+    }
+    ioapicwrite(irq->ioapic, IOAPIC_REG_TABLE + 2 * irq->pin, irq->redirect | (masked ? IOAPIC_INT_DISABLED : 0));
+}
+
+// Routes gsi to a vector of its own, using the MADT trigger mode and
+// polarity. Isa drivers translate their line with isa_irq_gsi first.
+// Returns NULL if no ioapic has gsi, it is already bound or vectors ran
+// out.
+static struct irq *irq_bind(u32 gsi, int boost) {
+    pushcli();
+
+    for (size_t i = 0; i < MAX_IRQS; i++) {
+        if (irqs[i].bound && !irqs[i].msix && irqs[i].gsi == gsi) {
+            popcli();
+            return NULL;
+        }
+    }
+
+    size_t index = ioapic_for_gsi(gsi);
+    struct irq *irq = index == ioapic_count ? 0 : irq_alloc(boost);
+    if (!irq) {
+        popcli();
+        return NULL;
+    }
+
+    irq->gsi = gsi;
+    irq->ioapic = index;
+    irq->pin = gsi - ioapics[index].gsi_base;
+    irq->redirect = irq->vector | gsi_redirect_flags(gsi);
+
+    irq_route(irq, irq_pick_cpu());
+    irq_set_masked(irq, 0);
+
+    popcli();
+    return irq;
+}
+
+// Steers irq to cpu for good. Returns -1 if cpu is not online.
+static int irq_set_affinity(struct irq *irq, size_t cpu) {
+    if (!cpu_online(cpu))
+        return -1;
+
+    pushcli();
+    irq->pinned = 1;
+    irq_route(irq, cpu);
+    popcli();
+    return 0;
+}
+
+// Moves the busiest unpinned irqs, one at a time, to whichever cpu has
+// taken the fewest deliveries so far this period
+static void irq_balance(struct timer *t) {
+    u64 load[MAX_CPUS] = { 0 };
+    u8 moved[MAX_IRQS] = { 0 };
+
+    for (size_t i = 0; i < MAX_IRQS; i++) {
+        if (irqs[i].bound && irqs[i].pinned)
+            load[irqs[i].cpu] += irqs[i].count;
+    }
+
+    for (;;) {
+        struct irq *busiest = 0;
+        for (size_t i = 0; i < MAX_IRQS; i++) {
+            if (irqs[i].bound && !irqs[i].pinned && !moved[i] && (!busiest || irqs[i].count > busiest->count))
+                busiest = &irqs[i];
+        }
+        if (!busiest)
+            break;
+
+        size_t target = busiest->cpu;
+        for (size_t cpu = 0; cpu < lapic_count; cpu++) {
+            if (cpu_online(cpu) && load[cpu] < load[target])
+                target = cpu;
+        }
+
+        load[target] += busiest->count;
+        moved[busiest - irqs] = 1;
+        if (target != busiest->cpu)
+            irq_route(busiest, target);
+    }
+
+    for (size_t i = 0; i < MAX_IRQS; i++)
+        irqs[i].count = 0;
+
+    timer_add(t, t->expires + IRQ_BALANCE_NS, irq_balance);
+}
+
+// Balancing needs a second online cpu. With MAX_LAPICS at 1 and no ap
+// startup there never is one, so the timer stays off for now.
+static void init_irq_balance(void) {
+    size_t online = 0;
+    for (size_t cpu = 0; cpu < lapic_count; cpu++)
+        online += cpu_online(cpu);
+
+    if (irq_balancing && online > 1)
+        timer_add(&irq_balance_timer, clock_ns() + IRQ_BALANCE_NS, irq_balance);
+}
+
+static u8 pci_read8(struct pci_dev *dev, size_t off) {
+    return *(volatile u8 *)(dev->cfg + off);
+}
+
+static u16 pci_read16(struct pci_dev *dev, size_t off) {
+    return *(volatile u16 *)(dev->cfg + off);
+}
+
+static u32 pci_read32(struct pci_dev *dev, size_t off) {
+    return *(volatile u32 *)(dev->cfg + off);
+}
+
+static void pci_write16(struct pci_dev *dev, size_t off, u16 val) {
+    *(volatile u16 *)(dev->cfg + off) = val;
+}
+
+static void pci_write32(struct pci_dev *dev, size_t off, u32 val) {
+    *(volatile u32 *)(dev->cfg + off) = val;
+}
+
+// Only the config pages of functions we probe get mapped, not the whole
+// ecam window
+static uintptr_t pci_cfg_map(struct pci_segment *seg, u8 bus, u8 dev, u8 func) {
+    uintptr_t pa = seg->base + ((uintptr_t)bus << 20 | (uintptr_t)dev << 15 | (uintptr_t)func << 12);
+    map_page_early(kernel_ptl4, pa, p2v(pa), PAGE_P | PAGE_RW);
+    return p2v(pa);
+}
+
+// The next capability with id after the one at from, or the first when
+// from is 0. 0 when there are no more.
+static u8 pci_find_cap(struct pci_dev *dev, u8 id, u8 from) {
+    if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+        return 0;
+
+    u8 ptr = (from ? pci_read8(dev, from + 1) : pci_read8(dev, PCI_CAP_PTR)) & ~3;
+    // A malformed list could loop, there is only room for 48 capabilities
+    for (size_t i = 0; ptr && i < 48; i++) {
+        if (pci_read8(dev, ptr) == id)
+            return ptr;
+        ptr = pci_read8(dev, ptr + 1) & ~3;
+    }
+    return 0;
+}
+
+static void pci_scan_bus(struct pci_segment *seg, u8 bus) {
+    for (u8 d = 0; d < PCI_DEVS_PER_BUS; d++) {
+        size_t funcs = 1;
+
+        for (u8 f = 0; f < funcs; f++) {
+            uintptr_t cfg = pci_cfg_map(seg, bus, d, f);
+            u16 vendor = *(volatile u16 *)(cfg + PCI_VENDOR_ID);
+            if (vendor == 0xFFFF)
+                continue;
+
+            u8 header = *(volatile u8 *)(cfg + PCI_HEADER_TYPE);
+            if (f == 0 && (header & PCI_HEADER_MULTIFUNCTION))
+                funcs = PCI_FUNCS_PER_DEV;
+
+            if (pci_dev_count < MAX_PCI_DEVS) {
+                struct pci_dev *dev = &pci_devs[pci_dev_count++];
+                dev->segment = seg->segment;
+                dev->bus = bus;
+                dev->dev = d;
+                dev->func = f;
+                dev->cfg = cfg;
+                dev->vendor = vendor;
+                dev->device = pci_read16(dev, PCI_DEVICE_ID);
+                dev->class = pci_read8(dev, PCI_CLASS);
+                dev->subclass = pci_read8(dev, PCI_SUBCLASS);
+                dev->prog_if = pci_read8(dev, PCI_PROG_IF);
+                dev->msix_cap = pci_find_cap(dev, PCI_CAP_MSIX, 0);
+                if (dev->msix_cap)
+                    dev->msix_count = (pci_read16(dev, dev->msix_cap + MSIX_CONTROL) & MSIX_TABLE_SIZE_MASK) + 1;
+
+                early_printf("pci: %x:%x:%x.%x %x:%x class %x.%x msix %d\n", dev->segment, bus, d, f,
+                             dev->vendor, dev->device, dev->class, dev->subclass, dev->msix_count);
+            }
+
+            if ((header & ~PCI_HEADER_MULTIFUNCTION) == PCI_HEADER_BRIDGE) {
+                u8 secondary = *(volatile u8 *)(cfg + PCI_SECONDARY_BUS);
+                if (secondary > bus && secondary <= seg->end_bus)
+                    pci_scan_bus(seg, secondary);
+            }
+        }
+    }
+}
+
+// Walks the bridges from each segment's first bus
+static void init_pci(void) {
+    if (!pci_segment_count) {
+        early_printf("pci: no MCFG, not enumerating\n");
+        return;
+    }
+
+    for (size_t i = 0; i < pci_segment_count; i++)
+        pci_scan_bus(&pci_segments[i], pci_segments[i].start_bus);
+}
+
+// The next vendor:device match after from, or the first when from is NULL
+static struct pci_dev *pci_find(u16 vendor, u16 device, struct pci_dev *from) {
+    for (struct pci_dev *dev = from ? from + 1 : pci_devs; dev < pci_devs + pci_dev_count; dev++) {
+        if (dev->vendor == vendor && dev->device == device)
+            return dev;
+    }
+    return NULL;
+}
+
+// Kernel address of a memory bar, mapped on first use. 0 for io bars and
+// unimplemented ones. Decoding is off while the bar is sized.
+static uintptr_t pci_map_bar(struct pci_dev *dev, size_t bar) {
+    if (bar >= PCI_BAR_COUNT)
+        return 0;
+    if (dev->bars[bar])
+        return dev->bars[bar];
+
+    size_t off = PCI_BAR0 + 4 * bar;
+    u32 lo = pci_read32(dev, off);
+    if (lo & PCI_BAR_IO)
+        return 0;
+    int wide = (lo & PCI_BAR_64) && bar + 1 < PCI_BAR_COUNT;
+
+    pushcli();
+    u16 command = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, command & ~PCI_COMMAND_MEMORY);
+
+    pci_write32(dev, off, 0xFFFFFFFF);
+    u64 mask = pci_read32(dev, off) & ~0xFULL;
+    pci_write32(dev, off, lo);
+
+    u64 hi = 0;
+    if (wide) {
+        hi = pci_read32(dev, off + 4);
+        pci_write32(dev, off + 4, 0xFFFFFFFF);
+        mask |= (u64)pci_read32(dev, off + 4) << 32;
+        pci_write32(dev, off + 4, hi);
+    } else {
+        mask |= 0xFFFFFFFF00000000ULL;
+    }
+
+    pci_write16(dev, PCI_COMMAND, command);
+
+    uintptr_t pa = (lo & ~0xFULL) | hi << 32;
+    u64 size = ~mask + 1;
+    if (!pa || !mask) {
+        popcli();
+        return 0;
+    }
+
+    for (u64 o = 0; o < size; o += PAGE_SIZE)
+        map_page_early(kernel_ptl4, pa + o, p2v(pa + o), PAGE_P | PAGE_RW);
+    dev->bars[bar] = p2v(pa);
+
+    popcli();
+    return dev->bars[bar];
+}
+
+// Switches dev from INTx to msi-x with every entry masked
+static int pci_msix_enable(struct pci_dev *dev) {
+    if (!dev->msix_cap)
+        return -1;
+    if (dev->msix_table)
+        return 0;
+
+    u32 table = pci_read32(dev, dev->msix_cap + MSIX_TABLE);
+    uintptr_t bar = pci_map_bar(dev, table & MSIX_BIR_MASK);
+    if (!bar)
+        return -1;
+
+    pushcli();
+    dev->msix_table = bar + (table & ~MSIX_BIR_MASK);
+
+    u16 control = pci_read16(dev, dev->msix_cap + MSIX_CONTROL);
+    pci_write16(dev, dev->msix_cap + MSIX_CONTROL, control | MSIX_ENABLE | MSIX_MASK_ALL);
+    for (size_t i = 0; i < dev->msix_count; i++) {
+        volatile u32 *entry = (volatile u32 *)(dev->msix_table + i * MSIX_ENTRY_SIZE);
+        entry[MSIX_ENTRY_CONTROL / 4] = MSIX_ENTRY_MASKED;
+    }
+    pci_write16(dev, dev->msix_cap + MSIX_CONTROL, (control | MSIX_ENABLE) & ~MSIX_MASK_ALL);
+
+    u16 command = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+    popcli();
+    return 0;
+}
+
+// Gives msi-x entry its own vector aimed at cpu, typically one per queue
+// and cpu so completions are handled where they were submitted. The irq
+// is pinned, irq_balance leaves it alone. NULL if the entry or cpu is
+// invalid, already bound or vectors ran out.
+static struct irq *pci_msix_bind(struct pci_dev *dev, u32 entry, size_t cpu, int boost) {
+    if (pci_msix_enable(dev) < 0 || entry >= dev->msix_count || !cpu_online(cpu))
+        return NULL;
+
+    pushcli();
+
+    for (size_t i = 0; i < MAX_IRQS; i++) {
+        if (irqs[i].bound && irqs[i].msix == dev && irqs[i].msix_entry == entry) {
+            popcli();
+            return NULL;
+        }
+    }
+
+    struct irq *irq = irq_alloc(boost);
+    if (!irq) {
+        popcli();
+        return NULL;
+    }
+
+    irq->msix = dev;
+    irq->msix_entry = entry;
+    irq->pinned = 1;
+
+    irq_route(irq, cpu);
+    irq_set_masked(irq, 0);
+
+    popcli();
+    return irq;
+}
+
+// Interrupt context. The line stays masked until the driver acks so a
+// level triggered device cannot storm us before it is serviced.
+static void irq_deliver(struct irq *irq) {
+    if (irq->handler) {
+        irq->count++;
+        irq->handler(irq);
+        lapic_eoi();
+        return;
+    }
+
+    irq_set_masked(irq, 1);
+    lapic_eoi();
+
+    pushcli();
+    irq->count++;
+    if (!irq->pending++)
+        irq->raised_tsc = rdtsc();
+
+    struct proc *p = irq->waiter;
+    if (p) {
+        struct cpu *c = my_cpu();
+        irq->waiter = 0;
+
+        // Full sleeper credit puts the driver ahead of every normal thread
+        u64 floor = c->min_vruntime - SCHED_LATENCY_NS / 2;
+        if (irq->boost && p->policy == SCHED_NORMAL && (s64)(p->vruntime - floor) > 0)
+            p->vruntime = floor;
+
+        make_runnable(p);
+    }
+    popcli();
+}
+
+// Blocks the driver until irq has fired. Returns how many deliveries
+// were coalesced.
+static u64 irq_wait(struct irq *irq) {
+    pushcli();
+    struct proc *p = my_proc();
+
+    while (!irq->pending) {
+        irq->waiter = p;
+        p->state = PROC_SLEEPING;
+        sched();
+    }
+
+    u64 n = irq->pending;
+    irq->pending = 0;
+
+    popcli();
+    return n;
+}
+
+static void irq_ack(struct irq *irq) {
+    pushcli();
+    irq_set_masked(irq, 0);
+    popcli();
+}
+
+// Completions interrupt while a waiter sleeps or async requests, whose
+// end callbacks nobody would otherwise run, are out. Caller holds pushcli.
+static void blk_queue_irqs(struct blk_queue *q) {
+    int on = q->irq && (q->sleepers || q->async);
+    __atomic_store_n(&q->dma->ring.avail.flags, on ? 0 : VIRTQ_AVAIL_F_NO_INTERRUPT, __ATOMIC_SEQ_CST);
+}
+
+// Reaps finished requests. Caller holds pushcli.
+static size_t blk_queue_poll(struct blk_queue *q) {
+    struct blk_queue_dma *dma = q->dma;
+    u16 used = __atomic_load_n(&dma->ring.used.idx, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    while (q->last_used != used) {
+        u16 head = dma->ring.used.ring[q->last_used % VIRTQ_SIZE].id;
+        struct blk_req *req = q->reqs[head];
+
+        u16 tail = head;
+        u16 count = 1;
+        while (dma->ring.desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+            tail = dma->ring.desc[tail].next;
+            count++;
+        }
+        dma->ring.desc[tail].next = q->free_head;
+        q->free_head = head;
+        q->free_count += count;
+
+        q->reqs[head] = 0;
+        q->last_used++;
+        n++;
+
+        req->status = dma->status[head];
+        req->complete_tsc = rdtsc();
+
+        // Waiters spin for twice the recent latency
+        u64 poll_ns = (q->poll_ns * 7 + tsc_to_ns(req->complete_tsc - req->submit_tsc) * 2) / 8;
+        q->poll_ns = poll_ns < BLK_POLL_MIN_NS ? BLK_POLL_MIN_NS : poll_ns > BLK_POLL_MAX_NS ? BLK_POLL_MAX_NS : poll_ns;
+
+        req->done = 1;
+        if (req->end) {
+            q->async--;
+            req->end(req);
+        }
+    }
+
+    if (n) {
+        blk_queue_irqs(q);
+        wake_up(q);
+    }
+    return n;
+}
+
+static void blk_queue_irq(struct irq *irq) {
+    blk_queue_poll(irq->data);
+}
+
+static void blk_reap_tick(struct timer *t) {
+    struct blk_queue *q = container_of(t, struct blk_queue, reap_timer);
+
+    blk_queue_poll(q);
+    if (q->async)
+        timer_add(t, t->expires + BLK_REAP_NS, blk_reap_tick);
+}
+
+// Queues a transfer between the sectors from sector on and segs, which
+// have to come from the page allocator. The device works on them in
+// place. Nothing reaches the device before blk_kick, so a batch costs one
+// notification. Returns -1 when the queue is full or the request is out of
+// range.
+static int blk_submit_segs(struct blk_queue *q, int write, u64 sector, struct blk_seg *segs, size_t count, struct blk_req *req) {
+    u64 len = 0;
+    for (size_t i = 0; i < count; i++)
+        len += segs[i].len;
+
+    if (!count || count > BLK_MAX_SEGS || !len || len % VIRTIO_BLK_SECTOR_SIZE ||
+        sector + len / VIRTIO_BLK_SECTOR_SIZE > virtio_blk.capacity)
+        return -1;
+
+    pushcli();
+    if (q->free_count < count + 2) {
+        popcli();
+        return -1;
+    }
+
+    struct blk_queue_dma *dma = q->dma;
+    u16 head = q->free_head;
+    u16 d = head;
+
+    dma->hdrs[head].type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    dma->hdrs[head].sector = sector;
+    dma->status[head] = 0xFF;
+
+    dma->ring.desc[d].addr = v2p((uintptr_t)&dma->hdrs[head]);
+    dma->ring.desc[d].len = sizeof(dma->hdrs[head]);
+    dma->ring.desc[d].flags = VIRTQ_DESC_F_NEXT;
+    d = dma->ring.desc[d].next;
+
+    for (size_t i = 0; i < count; i++) {
+        dma->ring.desc[d].addr = v2p((uintptr_t)segs[i].buf);
+        dma->ring.desc[d].len = segs[i].len;
+        dma->ring.desc[d].flags = VIRTQ_DESC_F_NEXT | (write ? 0 : VIRTQ_DESC_F_WRITE);
+        d = dma->ring.desc[d].next;
+    }
+
+    dma->ring.desc[d].addr = v2p((uintptr_t)&dma->status[head]);
+    dma->ring.desc[d].len = 1;
+    dma->ring.desc[d].flags = VIRTQ_DESC_F_WRITE;
+    q->free_head = dma->ring.desc[d].next;
+    q->free_count -= count + 2;
+
+    req->done = 0;
+    req->submit_tsc = rdtsc();
+    q->reqs[head] = req;
+
+    // Before the kick, so the completion cannot beat the irq being on
+    if (req->end && !q->async++) {
+        if (q->irq)
+            blk_queue_irqs(q);
+        else if (!q->reap_timer.pending)
+            timer_add(&q->reap_timer, clock_ns() + BLK_REAP_NS, blk_reap_tick);
+    }
+
+    dma->ring.avail.ring[q->avail_idx % VIRTQ_SIZE] = head;
+    q->avail_idx++;
+    __atomic_store_n(&dma->ring.avail.idx, q->avail_idx, __ATOMIC_RELEASE);
+    q->unkicked++;
+
+    popcli();
+    return 0;
+}
+
+#ifdef BENCH
+// A single contiguous buffer
+static int blk_submit(struct blk_queue *q, int write, u64 sector, void *buf, u32 len, struct blk_req *req) {
+    struct blk_seg seg = { buf, len };
+    return blk_submit_segs(q, write, sector, &seg, 1, req);
+}
+#endif
+
+// Tells the device about everything submitted since the last kick,
+// unless it is already busy draining the queue and asked not to be told
+static void blk_kick(struct blk_queue *q) {
+    pushcli();
+    if (q->unkicked) {
+        q->unkicked = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!(__atomic_load_n(&q->dma->ring.used.flags, __ATOMIC_RELAXED) & VIRTQ_USED_F_NO_NOTIFY))
+            *q->notify = q->index;
+    }
+    popcli();
+}
+
+#ifdef BENCH
+// Spins for a while first since a fast device completes before a sleep
+// and wakeup would. The spin adapts to the recent latency, see
+// blk_queue_poll. Only then are interrupts turned on.
+static void blk_wait_until(struct blk_queue *q, volatile int *done) {
+    u64 spin_until = rdtsc() + q->poll_ns * tsc_khz / 1000000;
+
+    while (!*done && (s64)(rdtsc() - spin_until) < 0) {
+        pushcli();
+        blk_queue_poll(q);
+        popcli();
+    }
+
+    if (!*done && q->irq) {
+        pushcli();
+        q->sleepers++;
+        blk_queue_irqs(q);
+        blk_queue_poll(q);
+        while (!*done)
+            _sleep(q);
+        q->sleepers--;
+        blk_queue_irqs(q);
+        popcli();
+    }
+
+    while (!*done) {
+        pushcli();
+        blk_queue_poll(q);
+        popcli();
+    }
+}
+
+static void blk_wait(struct blk_queue *q, struct blk_req *req) {
+    blk_wait_until(q, &req->done);
+}
+#endif
+
+// The queue for the calling cpu. NULL without a disk.
+static struct blk_queue *blk_my_queue(void) {
+    if (!virtio_blk.ready)
+        return NULL;
+    return &virtio_blk.queues[(my_cpu() - cpus) % virtio_blk.queue_count];
+}
+
+static uintptr_t virtio_cap_map(struct pci_dev *dev, u8 cap) {
+    uintptr_t bar = pci_map_bar(dev, pci_read8(dev, cap + VIRTIO_CAP_BAR));
+    return bar ? bar + pci_read32(dev, cap + VIRTIO_CAP_OFFSET) : 0;
+}
+
+// Resets dev and negotiates the wanted features, which must include
+// VIRTIO_F_VERSION_1. Leaves the device ready for queue setup. Returns
+// -1 if it has no modern interface or refuses.
+static int virtio_pci_init(struct virtio_pci *vp, struct pci_dev *dev, u64 wanted, u64 *features, const char *name) {
+    vp->pci = dev;
+    for (u8 cap = pci_find_cap(dev, PCI_CAP_VENDOR, 0); cap; cap = pci_find_cap(dev, PCI_CAP_VENDOR, cap)) {
+        switch (pci_read8(dev, cap + VIRTIO_CAP_TYPE)) {
+            case VIRTIO_CAP_COMMON:
+                if (!vp->common)
+                    vp->common = (volatile struct virtio_common_cfg *)virtio_cap_map(dev, cap);
+                break;
+            case VIRTIO_CAP_NOTIFY:
+                if (!vp->notify_base) {
+                    vp->notify_base = virtio_cap_map(dev, cap);
+                    vp->notify_mult = pci_read32(dev, cap + VIRTIO_CAP_NOTIFY_MULT);
+                }
+                break;
+            case VIRTIO_CAP_DEVICE:
+                if (!vp->device_cfg)
+                    vp->device_cfg = virtio_cap_map(dev, cap);
+                break;
+        }
+    }
+    if (!vp->common || !vp->notify_base || !vp->device_cfg) {
+        early_printf("%s: no modern interface, ignored\n", name);
+        return -1;
+    }
+
+    volatile struct virtio_common_cfg *common = vp->common;
+    common->device_status = 0;
+    while (common->device_status)
+        ;
+    common->device_status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+
+    common->device_feature_select = 0;
+    u64 offered = common->device_feature;
+    common->device_feature_select = 1;
+    offered |= (u64)common->device_feature << 32;
+
+    if (!(offered & VIRTIO_F_VERSION_1)) {
+        common->device_status = VIRTIO_STATUS_FAILED;
+        early_printf("%s: device is legacy only, ignored\n", name);
+        return -1;
+    }
+    *features = offered & (wanted | VIRTIO_F_VERSION_1);
+
+    common->driver_feature_select = 0;
+    common->driver_feature = *features;
+    common->driver_feature_select = 1;
+    common->driver_feature = *features >> 32;
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        common->device_status = VIRTIO_STATUS_FAILED;
+        early_printf("%s: features rejected\n", name);
+        return -1;
+    }
+
+    common->msix_config = VIRTIO_NO_VECTOR;
+    return 0;
+}
+
+// Hands ring to the device as queue index, interrupting through msi-x
+// entry msix unless that is VIRTIO_NO_VECTOR. Returns the queue's notify
+// register, NULL if the queue is smaller than VIRTQ_SIZE. *msix_ok says
+// whether the device took the vector.
+static volatile u16 *virtio_pci_queue(struct virtio_pci *vp, u16 index, u16 msix, struct virtq_ring *ring, int *msix_ok) {
+    volatile struct virtio_common_cfg *common = vp->common;
+
+    common->queue_select = index;
+    if (common->queue_size < VIRTQ_SIZE)
+        return NULL;
+    common->queue_size = VIRTQ_SIZE;
+
+    common->queue_msix_vector = msix;
+    *msix_ok = msix != VIRTIO_NO_VECTOR && common->queue_msix_vector == msix;
+    if (!*msix_ok)
+        common->queue_msix_vector = VIRTIO_NO_VECTOR;
+
+    common->queue_desc = v2p((uintptr_t)ring->desc);
+    common->queue_driver = v2p((uintptr_t)&ring->avail);
+    common->queue_device = v2p((uintptr_t)&ring->used);
+    common->queue_enable = 1;
+
+    return (volatile u16 *)(vp->notify_base + common->queue_notify_off * vp->notify_mult);
+}
+
+// Reads a device config field that may be torn by a concurrent update
+static u64 virtio_cfg_read64(struct virtio_pci *vp, size_t off) {
+    u8 gen;
+    u64 val;
+
+    do {
+        gen = vp->common->config_generation;
+        val = *(volatile u32 *)(vp->device_cfg + off) |
+              (u64)*(volatile u32 *)(vp->device_cfg + off + 4) << 32;
+    } while (gen != vp->common->config_generation);
+
+    return val;
+}
+
+static int virtio_blk_setup_queue(struct virtio_blk *blk, u16 index) {
+    struct blk_queue *q = &blk->queues[index];
+
+    q->dma = early_kalloc(BLK_QUEUE_DMA_ORDER);
+    q->index = index;
+    for (u16 i = 0; i < VIRTQ_SIZE; i++)
+        q->dma->ring.desc[i].next = i + 1;
+    q->free_head = 0;
+    q->free_count = VIRTQ_SIZE;
+    q->poll_ns = BLK_POLL_MIN_NS;
+    q->dma->ring.avail.flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    // Queue i interrupts cpu i through msi-x entry i, or is polled
+    q->irq = pci_msix_bind(blk->vp.pci, index, index, 1);
+    if (q->irq) {
+        q->irq->handler = blk_queue_irq;
+        q->irq->data = q;
+    }
+
+    int msix_ok;
+    q->notify = virtio_pci_queue(&blk->vp, index, q->irq ? index : VIRTIO_NO_VECTOR, &q->dma->ring, &msix_ok);
+    if (!q->notify) {
+        early_kfree(q->dma, BLK_QUEUE_DMA_ORDER);
+        return -1;
+    }
+    if (!msix_ok)
+        q->irq = 0;
+    return 0;
+}
+
+// Modern virtio over pci, one queue per cpu as far as the device allows
+static void init_virtio_blk(void) {
+    struct virtio_blk *blk = &virtio_blk;
+    struct pci_dev *dev = pci_find(VIRTIO_VENDOR, VIRTIO_DEVICE_BLK, 0);
+    if (!dev)
+        dev = pci_find(VIRTIO_VENDOR, VIRTIO_DEVICE_BLK_TRANSITIONAL, 0);
+    if (!dev)
+        return;
+
+    u64 features;
+    if (virtio_pci_init(&blk->vp, dev, VIRTIO_BLK_F_MQ, &features, "virtio-blk") < 0)
+        return;
+
+    volatile struct virtio_common_cfg *common = blk->vp.common;
+    size_t queues = 1;
+    if (features & VIRTIO_BLK_F_MQ)
+        queues = *(volatile u16 *)(blk->vp.device_cfg + VIRTIO_BLK_CFG_NUM_QUEUES);
+    if (queues > lapic_count)
+        queues = lapic_count;
+    if (queues > common->num_queues)
+        queues = common->num_queues;
+
+    for (blk->queue_count = 0; blk->queue_count < queues; blk->queue_count++) {
+        if (virtio_blk_setup_queue(blk, blk->queue_count) < 0)
+            break;
+    }
+    if (!blk->queue_count) {
+        common->device_status = VIRTIO_STATUS_FAILED;
+        early_printf("virtio-blk: no usable queue\n");
+        return;
+    }
+
+    blk->capacity = virtio_cfg_read64(&blk->vp, 0);
+    common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+    blk->ready = 1;
+
+    early_printf("virtio-blk: %lu sectors, %lu queues, %s\n", blk->capacity, blk->queue_count,
+                 blk->queues[0].irq ? "msi-x" : "polled");
+}
+
+#ifdef BENCH
+// Caller holds pushcli for all the pcache_* tree operations
+static struct cached_page *pcache_lookup(struct page_cache *cache, u64 index) {
+    struct pcache_node *node = cache->root;
+
+    for (int level = PCACHE_LEVELS - 1; level >= 0 && node; level--) {
+        size_t slot = (index >> (level * PCACHE_BITS)) & PCACHE_MASK;
+        if (!(node->present & (1ULL << slot)))
+            return NULL;
+        node = node->slots[slot];
+    }
+    return (struct cached_page *)node;
+}
+
+static int pcache_insert(struct page_cache *cache, struct cached_page *pg) {
+    if (!cache->root) {
+        cache->root = kmem_cache_alloc(&pcache_node_cache);
+        if (!cache->root)
+            return -1;
+    }
+
+    struct pcache_node *node = cache->root;
+    for (int level = PCACHE_LEVELS - 1; level > 0; level--) {
+        size_t slot = (pg->index >> (level * PCACHE_BITS)) & PCACHE_MASK;
+        if (!(node->present & (1ULL << slot))) {
+            node->slots[slot] = kmem_cache_alloc(&pcache_node_cache);
+            if (!node->slots[slot])
+                return -1;
+            node->present |= 1ULL << slot;
+        }
+        node = node->slots[slot];
+    }
+
+    node->slots[pg->index & PCACHE_MASK] = pg;
+    node->present |= 1ULL << (pg->index & PCACHE_MASK);
+    return 0;
+}
+#endif
+
+// Frees the nodes left empty on the way back up
+static void pcache_delete(struct page_cache *cache, u64 index) {
+    struct pcache_node *path[PCACHE_LEVELS];
+    struct pcache_node *node = cache->root;
+
+    for (int level = PCACHE_LEVELS - 1; level > 0 && node; level--) {
+        path[level] = node;
+        size_t slot = (index >> (level * PCACHE_BITS)) & PCACHE_MASK;
+        node = node->present & (1ULL << slot) ? node->slots[slot] : NULL;
+    }
+    if (!node)
+        return;
+    path[0] = node;
+
+    for (int level = 0; level < PCACHE_LEVELS; level++) {
+        path[level]->present &= ~(1ULL << ((index >> (level * PCACHE_BITS)) & PCACHE_MASK));
+        if (path[level]->present || level == PCACHE_LEVELS - 1)
+            break;
+        kmem_cache_free(&pcache_node_cache, path[level]);
+    }
+}
+
+static size_t pcache_gang_node(struct pcache_node *node, int level, u64 base, u64 start,
+                               struct cached_page **out, size_t max) {
+    size_t n = 0;
+    u64 span = 1ULL << (level * PCACHE_BITS);
+
+    for (u64 present = node->present; present && n < max; present &= present - 1) {
+        size_t slot = __builtin_ctzll(present);
+        u64 first = base + slot * span;
+        if (first + span <= start)
+            continue;
+
+        if (level == 0)
+            out[n++] = node->slots[slot];
+        else
+            n += pcache_gang_node(node->slots[slot], level - 1, first, start, out + n, max - n);
+    }
+    return n;
+}
+
+// Up to max pages from index start on, in index order
+static size_t pcache_gang(struct page_cache *cache, u64 start, struct cached_page **out, size_t max) {
+    if (!cache->root)
+        return 0;
+    return pcache_gang_node(cache->root, PCACHE_LEVELS - 1, 0, start, out, max);
+}
+
+// Evicts up to n clean, unused pages. Recently used ones get a second
+// chance and go to the back. Caller holds pushcli.
+static size_t cache_shrink(struct page_cache *cache, size_t n) {
+    size_t freed = 0;
+
+    for (size_t scanned = 0; freed < n && scanned < 2 * cache->pages && !list_empty(&cache->clock); scanned++) {
+        struct cached_page *pg = container_of(cache->clock.next, struct cached_page, lru);
+        list_del(&pg->lru);
+
+        if (pg->refs || (pg->flags & (PG_DIRTY | PG_IO | PG_REFERENCED))) {
+            pg->flags &= ~PG_REFERENCED;
+            list_add_tail(&cache->clock, &pg->lru);
+            continue;
+        }
+
+        pcache_delete(cache, pg->index);
+        early_kfree(pg->data, 0);
+        kmem_cache_free(&cached_page_cache, pg);
+        cache->pages--;
+        freed++;
+    }
+
+    // Only writeback can make dirty pages reclaimable
+    if (freed < n && cache->dirty)
+        wake_up(cache);
+    return freed;
+}
+
+// For allocations outside the cache that found no memory. Returns how
+// many clean pages the cache gave up, 0 once there are none left.
+static size_t reclaim_memory(void) {
+    if (!virtio_blk.ready)
+        return 0;
+
+    pushcli();
+    size_t freed = cache_shrink(&virtio_blk.cache, PCACHE_SHRINK_BATCH);
+    popcli();
+    return freed;
+}
+
+#ifdef BENCH
+// A new page at index holding one reference, NULL when even shrinking
+// the cache leaves no memory. Caller holds pushcli.
+static struct cached_page *cache_page_alloc(struct page_cache *cache, u64 index, u32 flags) {
+    if (cache->pages >= cache->max_pages)
+        cache_shrink(cache, PCACHE_SHRINK_BATCH);
+
+    void *data = try_early_kalloc(0);
+    if (!data && cache_shrink(cache, PCACHE_SHRINK_BATCH))
+        data = try_early_kalloc(0);
+    if (!data)
+        return NULL;
+
+    struct cached_page *pg = kmem_cache_alloc(&cached_page_cache);
+    if (!pg) {
+        early_kfree(data, 0);
+        return NULL;
+    }
+
+    pg->index = index;
+    pg->flags = flags;
+    pg->refs = 1;
+    pg->data = data;
+    pg->io_done = 1;
+    if (pcache_insert(cache, pg) < 0) {
+        early_kfree(data, 0);
+        kmem_cache_free(&cached_page_cache, pg);
+        return NULL;
+    }
+
+    list_add_tail(&cache->clock, &pg->lru);
+    cache->pages++;
+    return pg;
+}
+
+static void cache_page_put(struct cached_page *pg) {
+    pushcli();
+    pg->refs--;
+    popcli();
+}
+#endif
+
+// Interrupt or poll context
+static void cache_io_end(struct blk_req *req) {
+    struct cache_io *io = container_of(req, struct cache_io, req);
+    struct page_cache *cache = io->cache;
+
+    for (size_t i = 0; i < io->count; i++) {
+        struct cached_page *pg = io->pages[i];
+
+        if (req->status == VIRTIO_BLK_S_OK && !io->write)
+            pg->flags |= PG_UPTODATE;
+        // A failed write stays dirty for the next round
+        if (req->status != VIRTIO_BLK_S_OK && io->write && !(pg->flags & PG_DIRTY)) {
+            pg->flags |= PG_DIRTY;
+            cache->dirty++;
+        }
+
+        pg->flags &= ~PG_IO;
+        pg->io_done = 1;
+        pg->refs--;
+    }
+
+    kmem_cache_free(&cache_io_cache, io);
+}
+
+// Caller holds pushcli. Takes the page into io, which the page has to
+// extend.
+static struct cache_io *cache_io_add(struct page_cache *cache, struct cache_io *io, int write, struct cached_page *pg) {
+    if (!io) {
+        io = kmem_cache_alloc(&cache_io_cache);
+        if (!io)
+            return NULL;
+        io->cache = cache;
+        io->q = blk_my_queue();
+        io->write = write;
+        io->req.end = cache_io_end;
+    }
+
+    pg->flags |= PG_IO;
+    pg->io_done = 0;
+    pg->q = io->q;
+    pg->refs++;
+    io->pages[io->count++] = pg;
+    return io;
+}
+
+// Hands io to the device, waiting for room in the queue if need be. Not
+// kicked.
+static void cache_io_submit(struct cache_io *io) {
+    struct blk_seg segs[BLK_MAX_SEGS];
+
+    for (size_t i = 0; i < io->count; i++) {
+        segs[i].buf = io->pages[i]->data;
+        segs[i].len = PAGE_SIZE;
+    }
+
+    u64 sector = io->pages[0]->index * PCACHE_SECTORS_PER_PAGE;
+    if (sector + io->count * PCACHE_SECTORS_PER_PAGE > virtio_blk.capacity)
+        panic("cache_io_submit - past the end of the disk\n");
+    if (io->write) {
+        io->cache->wb_reqs++;
+        io->cache->wb_pages += io->count;
+    }
+
+    while (blk_submit_segs(io->q, io->write, sector, segs, io->count, &io->req) < 0) {
+        blk_kick(io->q);
+        pushcli();
+        blk_queue_poll(io->q);
+        popcli();
+    }
+}
+
+#ifdef BENCH
+// Starts reading the uncached pages of [first, first + count) in as few
+// requests as possible and marks the page at marker, if it is read, to
+// start the next window. Runs of cached pages split the requests.
+static void cache_read_pages(struct page_cache *cache, u64 first, size_t count, u64 marker) {
+    struct cache_io *ios[PCACHE_RA_MAX];
+    size_t io_count = 0;
+    struct cache_io *io = 0;
+    u64 end = virtio_blk.capacity / PCACHE_SECTORS_PER_PAGE;
+
+    if (count > PCACHE_RA_MAX)
+        count = PCACHE_RA_MAX;
+
+    pushcli();
+    for (u64 index = first; index < first + count && index < end; index++) {
+        struct cached_page *pg = pcache_lookup(cache, index);
+        if (pg) {
+            if (!(pg->flags & (PG_UPTODATE | PG_IO))) {
+                // An earlier read failed, retry it
+                pg->refs++;
+            } else {
+                io = 0;
+                continue;
+            }
+        } else {
+            pg = cache_page_alloc(cache, index, index == marker ? PG_READAHEAD : 0);
+            if (!pg)
+                break;
+        }
+
+        struct cache_io *next = cache_io_add(cache, io, 0, pg);
+        pg->refs--;
+        if (!next)
+            break;
+        if (next != io)
+            ios[io_count++] = next;
+        io = next->count == BLK_MAX_SEGS ? 0 : next;
+        cache->ra_pages++;
+    }
+    popcli();
+
+    for (size_t i = 0; i < io_count; i++)
+        cache_io_submit(ios[i]);
+    for (size_t i = 0; i < io_count; i++)
+        blk_kick(ios[i]->q);
+}
+
+// Grows the window while accesses stay sequential. The marker in the
+// middle of each window starts the next one before the reader gets there.
+static void cache_readahead(struct page_cache *cache, u64 index, int sequential, int hit_marker) {
+    if (hit_marker) {
+        cache->ra_start += cache->ra_size;
+        cache->ra_size = cache->ra_size * 2 > PCACHE_RA_MAX ? PCACHE_RA_MAX : cache->ra_size * 2;
+    } else if (sequential) {
+        cache->ra_start = index;
+        cache->ra_size = cache->ra_size * 2 < PCACHE_RA_MIN ? PCACHE_RA_MIN :
+                         cache->ra_size * 2 > PCACHE_RA_MAX ? PCACHE_RA_MAX : cache->ra_size * 2;
+    } else {
+        // Random access, read just what was asked for
+        cache->ra_start = index;
+        cache->ra_size = 1;
+    }
+
+    cache_read_pages(cache, cache->ra_start, cache->ra_size,
+                     cache->ra_size > 1 ? cache->ra_start + cache->ra_size / 2 : ~0ULL);
+}
+
+// The uptodate page at index with a reference held, NULL on a read error
+static struct cached_page *cache_page_get(struct page_cache *cache, u64 index) {
+    pushcli();
+    struct cached_page *pg = pcache_lookup(cache, index);
+    int hit_marker = 0;
+
+    if (pg && (pg->flags & (PG_UPTODATE | PG_IO))) {
+        cache->hits++;
+        pg->refs++;
+        pg->flags |= PG_REFERENCED;
+        if (pg->flags & PG_READAHEAD) {
+            pg->flags &= ~PG_READAHEAD;
+            hit_marker = 1;
+        }
+    } else {
+        cache->misses++;
+        pg = 0;
+    }
+
+    int sequential = index == cache->ra_prev + 1;
+    cache->ra_prev = index;
+    popcli();
+
+    if (pg && hit_marker && sequential) {
+        cache_readahead(cache, index, 1, 1);
+    } else if (!pg) {
+        cache_readahead(cache, index, sequential, 0);
+
+        pushcli();
+        pg = pcache_lookup(cache, index);
+        if (pg)
+            pg->refs++;
+        popcli();
+        if (!pg)
+            return NULL;
+    }
+
+    if (pg->flags & PG_IO)
+        blk_wait_until(pg->q, &pg->io_done);
+
+    if (!(pg->flags & PG_UPTODATE)) {
+        cache_page_put(pg);
+        return NULL;
+    }
+    return pg;
+}
+
+// Reads len bytes at byte offset off through the cache. Returns -1 on a
+// device error or past the end of the disk.
+static s64 cache_read(struct page_cache *cache, u64 off, void *dst, size_t len) {
+    if (off + len > virtio_blk.capacity * VIRTIO_BLK_SECTOR_SIZE)
+        return -1;
+
+    for (size_t done = 0; done < len;) {
+        u64 pos = off + done;
+        size_t chunk = PAGE_SIZE - pos % PAGE_SIZE;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        struct cached_page *pg = cache_page_get(cache, pos / PAGE_SIZE);
+        if (!pg)
+            return -1;
+        memcpy((char *)dst + done, (char *)pg->data + pos % PAGE_SIZE, chunk);
+        cache_page_put(pg);
+        done += chunk;
+    }
+    return len;
+}
+
+// Dirties the cache, the disk is only written by writeback. Whole pages
+// are not read first.
+static s64 cache_write(struct page_cache *cache, u64 off, const void *src, size_t len) {
+    if (off + len > virtio_blk.capacity * VIRTIO_BLK_SECTOR_SIZE)
+        return -1;
+
+    for (size_t done = 0; done < len;) {
+        u64 pos = off + done;
+        size_t chunk = PAGE_SIZE - pos % PAGE_SIZE;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        struct cached_page *pg = 0;
+        if (chunk == PAGE_SIZE) {
+            pushcli();
+            pg = pcache_lookup(cache, pos / PAGE_SIZE);
+            if (pg)
+                pg->refs++;
+            else
+                pg = cache_page_alloc(cache, pos / PAGE_SIZE, PG_UPTODATE);
+            popcli();
+
+            if (pg && (pg->flags & PG_IO))
+                blk_wait_until(pg->q, &pg->io_done);
+            if (pg)
+                pg->flags |= PG_UPTODATE;
+        } else {
+            pg = cache_page_get(cache, pos / PAGE_SIZE);
+        }
+        if (!pg)
+            return -1;
+
+        memcpy((char *)pg->data + pos % PAGE_SIZE, (const char *)src + done, chunk);
+
+        pushcli();
+        pg->flags |= PG_REFERENCED;
+        if (!(pg->flags & PG_DIRTY)) {
+            pg->flags |= PG_DIRTY;
+            cache->dirty++;
+        }
+        pg->refs--;
+        if (cache->dirty > cache->dirty_high)
+            wake_up(cache);
+        popcli();
+
+        done += chunk;
+    }
+    return len;
+}
+#endif
+
+// Starts writing every dirty page, merging runs of consecutive ones into
+// requests of up to BLK_MAX_SEGS pages. One kick covers them all.
+static size_t cache_writeback(struct page_cache *cache) {
+    struct cached_page *gang[PCACHE_GANG];
+    struct cache_io *io = 0;
+    struct blk_queue *q = 0;
+    size_t written = 0;
+    u64 next = 0;
+
+    for (;;) {
+        struct cache_io *full[PCACHE_GANG + 1];
+        size_t full_count = 0;
+
+        pushcli();
+        size_t n = pcache_gang(cache, next, gang, PCACHE_GANG);
+        for (size_t i = 0; i < n; i++) {
+            struct cached_page *pg = gang[i];
+            if (!(pg->flags & PG_DIRTY) || (pg->flags & PG_IO) ||
+                (io && io->pages[io->count - 1]->index + 1 != pg->index)) {
+                if (io)
+                    full[full_count++] = io;
+                io = 0;
+                if (!(pg->flags & PG_DIRTY) || (pg->flags & PG_IO))
+                    continue;
+            }
+
+            struct cache_io *next_io = cache_io_add(cache, io, 1, pg);
+            if (!next_io)
+                break;
+            pg->flags &= ~PG_DIRTY;
+            cache->dirty--;
+            written++;
+
+            io = next_io;
+            q = io->q;
+            if (io->count == BLK_MAX_SEGS) {
+                full[full_count++] = io;
+                io = 0;
+            }
+        }
+        if (n)
+            next = gang[n - 1]->index + 1;
+        if (n < PCACHE_GANG && io) {
+            full[full_count++] = io;
+            io = 0;
+        }
+        popcli();
+
+        for (size_t i = 0; i < full_count; i++)
+            cache_io_submit(full[i]);
+        if (n < PCACHE_GANG)
+            break;
+    }
+
+    if (q)
+        blk_kick(q);
+    return written;
+}
+
+#ifdef BENCH
+// Writes everything back and waits for it
+static void cache_sync(struct page_cache *cache) {
+    struct cached_page *gang[PCACHE_GANG];
+    u64 next = 0;
+
+    cache_writeback(cache);
+
+    for (;;) {
+        pushcli();
+        size_t n = pcache_gang(cache, next, gang, PCACHE_GANG);
+        for (size_t i = 0; i < n; i++)
+            gang[i]->refs++;
+        popcli();
+
+        for (size_t i = 0; i < n; i++) {
+            if (gang[i]->flags & PG_IO)
+                blk_wait_until(gang[i]->q, &gang[i]->io_done);
+            cache_page_put(gang[i]);
+        }
+
+        if (n < PCACHE_GANG)
+            break;
+        next = gang[n - 1]->index + 1;
+    }
+}
+#endif
+
+static void cache_writeback_tick(struct timer *t) {
+    struct page_cache *cache = container_of(t, struct page_cache, writeback_timer);
+
+    if (cache->dirty)
+        wake_up(cache);
+    timer_add(t, t->expires + PCACHE_WRITEBACK_NS, cache_writeback_tick);
+}
+
+static void cache_writeback_thread(void) {
+    struct page_cache *cache = &virtio_blk.cache;
+
+    for (;;) {
+        sleep(cache);
+        cache_writeback(cache);
+    }
+}
+
+// Lets the cache grow to a quarter of usable memory
+static void init_page_cache(void) {
+    struct page_cache *cache = &virtio_blk.cache;
+    if (!virtio_blk.ready)
+        return;
+
+    u64 usable = 0;
+    for (size_t i = 0; i < memmap.region_count; i++) {
+        if (memmap.regions[i].type == MEMMAP_REGION_USABLE)
+            usable += memmap.regions[i].size;
+    }
+
+    kmem_cache_init(&pcache_node_cache, sizeof(struct pcache_node));
+    kmem_cache_init(&cached_page_cache, sizeof(struct cached_page));
+    kmem_cache_init(&cache_io_cache, sizeof(struct cache_io));
+
+    list_init(&cache->clock);
+    cache->max_pages = usable / PAGE_SIZE / 4;
+    cache->dirty_high = cache->max_pages / 8;
+    cache->ra_prev = ~0ULL;
+
+    timer_add(&cache->writeback_timer, clock_ns() + PCACHE_WRITEBACK_NS, cache_writeback_tick);
+    if (!kthread_create(cache_writeback_thread))
+        panic("Could not create writeback thread\n");
+}
+
+// Returns -1 if the device has no room for the queue, otherwise whether
+// it took the msi-x vector
+static int net_vq_setup(struct net_vq *vq, u16 index, u16 msix) {
+    vq->ring = early_kalloc(0);
+    vq->index = index;
+    for (u16 i = 0; i < VIRTQ_SIZE; i++)
+        vq->free[i] = i;
+    vq->free_count = VIRTQ_SIZE;
+    vq->ring->avail.flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    int msix_ok;
+    vq->notify = virtio_pci_queue(&virtio_net.vp, index, msix, vq->ring, &msix_ok);
+    if (!vq->notify) {
+        early_kfree(vq->ring, 0);
+        return -1;
+    }
+    return msix_ok;
+}
+
+// Not seen by the device until net_vq_publish
+static void net_vq_add(struct net_vq *vq, u16 buf, void *data, u32 len, int write) {
+    u16 d = vq->free[--vq->free_count];
+
+    vq->ring->desc[d].addr = v2p((uintptr_t)data);
+    vq->ring->desc[d].len = len;
+    vq->ring->desc[d].flags = write ? VIRTQ_DESC_F_WRITE : 0;
+    vq->bufs[d] = buf;
+
+    vq->ring->avail.ring[vq->avail_idx % VIRTQ_SIZE] = d;
+    vq->avail_idx++;
+    vq->unkicked++;
+}
+
+// One index store and at most one notification for everything added
+static void net_vq_publish(struct net_vq *vq) {
+    if (!vq->unkicked)
+        return;
+
+    vq->unkicked = 0;
+    __atomic_store_n(&vq->ring->avail.idx, vq->avail_idx, __ATOMIC_SEQ_CST);
+    if (!(__atomic_load_n(&vq->ring->used.flags, __ATOMIC_RELAXED) & VIRTQ_USED_F_NO_NOTIFY))
+        *vq->notify = vq->index;
+}
+
+static int net_vq_pending(struct net_vq *vq) {
+    return vq->last_used != __atomic_load_n(&vq->ring->used.idx, __ATOMIC_ACQUIRE);
+}
+
+// Takes back one buffer the device is done with, -1 if there is none.
+// *len is how much the device wrote.
+static int net_vq_reap(struct net_vq *vq, u32 *len) {
+    if (!net_vq_pending(vq))
+        return -1;
+
+    u16 d = vq->ring->used.ring[vq->last_used % VIRTQ_SIZE].id;
+    *len = vq->ring->used.ring[vq->last_used % VIRTQ_SIZE].len;
+    vq->last_used++;
+    vq->free[vq->free_count++] = d;
+    return vq->bufs[d];
+}
+
+static void net_vq_irqs(struct net_vq *vq, int on) {
+    __atomic_store_n(&vq->ring->avail.flags, on ? 0 : VIRTQ_AVAIL_F_NO_INTERRUPT, __ATOMIC_SEQ_CST);
+}
+
+// Internet checksum of len bytes on top of sum, inverted
+static u16 net_csum(const u8 *p, size_t len, u32 sum) {
+    for (; len > 1; p += 2, len -= 2)
+        sum += p[0] << 8 | p[1];
+    if (len)
+        sum += p[0] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+// Fills in the checksum itself when the device cannot. As with the
+// device, the field has to hold the pseudo header sum beforehand.
+static void net_tx(struct net_queue *q, u16 buf, u64 len, u64 flags) {
+    struct virtio_net_hdr *hdr = q->bufs[buf];
+    u8 *frame = (u8 *)q->bufs[buf] + NET_FRAME_OFFSET;
+    u16 start = flags & 0xFFFF;
+    u16 offset = (flags >> 16) & 0xFFFF;
+
+    if (len > NET_FRAME_MAX)
+        len = NET_FRAME_MAX;
+    memset(hdr, 0, sizeof(*hdr));
+
+    if ((flags & NET_TX_CSUM) && (u64)start + offset + 2 <= len) {
+        if (virtio_net.features & VIRTIO_NET_F_CSUM) {
+            hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr->csum_start = start;
+            hdr->csum_offset = offset;
+        } else {
+            u16 sum = net_csum(frame + start, len - start, 0);
+            frame[start + offset] = sum >> 8;
+            frame[start + offset + 1] = sum;
+        }
+    }
+
+    net_vq_add(&q->tx, buf, hdr, NET_FRAME_OFFSET + len, 0);
+    q->tx_packets++;
+}
+
+static u32 net_cq_space(struct net_queue *q) {
+    struct ring_ctl *ctl = q->ch->rings[RING_CQ].ctl;
+    u32 used = __atomic_load_n(&ctl->tail, __ATOMIC_RELAXED) - __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+    u32 space = RING_ENTRIES - used;
+    return space < NET_BUDGET ? space : NET_BUDGET;
+}
+
+// Sends and frees what the server queued. Pops no more than could all
+// be sends so every one gets a descriptor.
+static size_t net_sq(struct net_queue *q) {
+    struct ipc_msg msgs[NET_BUDGET];
+    u32 max = q->tx.free_count < NET_BUDGET ? q->tx.free_count : NET_BUDGET;
+    u32 n = ring_pop(&q->ch->rings[RING_SQ], msgs, max);
+
+    for (u32 i = 0; i < n; i++) {
+        u64 buf = msgs[i].w[1];
+        if (buf >= NET_BUFS || q->owner[buf] != NET_BUF_SERVER)
+            continue;
+
+        if (msgs[i].w[0] == NET_MSG_TX) {
+            q->owner[buf] = NET_BUF_DEVICE;
+            net_tx(q, buf, msgs[i].w[2], msgs[i].w[3]);
+        } else if (msgs[i].w[0] == NET_MSG_FREE) {
+            q->owner[buf] = NET_BUF_POOL;
+            q->pool[q->pool_count++] = buf;
+        }
+    }
+
+    net_vq_publish(&q->tx);
+    return n;
+}
+
+// Hands received frames to the server in one push. While the cq is full
+// they stay with the device, which then drops what it cannot place.
+static size_t net_rx(struct net_queue *q) {
+    struct ipc_msg msgs[NET_BUDGET];
+    u32 max = net_cq_space(q);
+    u32 n = 0;
+    u32 len;
+    int buf;
+
+    while (n < max && (buf = net_vq_reap(&q->rx, &len)) >= 0) {
+        struct virtio_net_hdr *hdr = q->bufs[buf];
+        q->owner[buf] = NET_BUF_SERVER;
+        msgs[n].w[0] = NET_MSG_RX;
+        msgs[n].w[1] = buf;
+        msgs[n].w[2] = len > NET_FRAME_OFFSET ? len - NET_FRAME_OFFSET : 0;
+        msgs[n].w[3] = hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID ? NET_RX_CSUM_VALID : 0;
+        n++;
+    }
+
+    if (n) {
+        ring_push(&q->ch->rings[RING_CQ], msgs, n);
+        ring_kick(&q->ch->rings[RING_CQ]);
+        q->rx_packets += n;
+    }
+    return n;
+}
+
+// Sent buffers go back to the server in one push
+static size_t net_tx_reclaim(struct net_queue *q) {
+    struct ipc_msg msgs[NET_BUDGET];
+    u32 max = net_cq_space(q);
+    u32 n = 0;
+    u32 len;
+    int buf;
+
+    while (n < max && (buf = net_vq_reap(&q->tx, &len)) >= 0) {
+        q->owner[buf] = NET_BUF_SERVER;
+        msgs[n].w[0] = NET_MSG_TX_DONE;
+        msgs[n].w[1] = buf;
+        n++;
+    }
+
+    if (n) {
+        ring_push(&q->ch->rings[RING_CQ], msgs, n);
+        ring_kick(&q->ch->rings[RING_CQ]);
+    }
+    return n;
+}
+
+// Posts pool buffers NET_REFILL_BATCH at a time so the device sees one
+// index update and at most one notification per batch, sooner only
+// when it is about to run dry
+static void net_refill(struct net_queue *q) {
+    u16 posted = VIRTQ_SIZE - q->rx.free_count;
+    if (q->rx.free_count < NET_REFILL_BATCH && posted >= NET_REFILL_BATCH)
+        return;
+
+    while (q->rx.free_count && q->pool_count) {
+        u16 buf = q->pool[--q->pool_count];
+        q->owner[buf] = NET_BUF_DEVICE;
+        net_vq_add(&q->rx, buf, q->bufs[buf], PAGE_SIZE, 1);
+    }
+    net_vq_publish(&q->rx);
+}
+
+static void net_queue_irq(struct irq *irq) {
+    struct net_queue *q = irq->data;
+
+    net_vq_irqs(&q->rx, 0);
+    net_vq_irqs(&q->tx, 0);
+    wake_up(&q->ch->rings[RING_SQ].ctl->waiting);
+}
+
+// NAPI style. An interrupt only starts polling, and while packets keep
+// coming they are taken with interrupts off, yielding between rounds.
+// Once idle the thread keeps polling for NET_BUSY_POLL_NS, then turns
+// interrupts back on and sleeps like a ring consumer so a server kick
+// wakes it as well. Tx interrupts are only wanted while sends are
+// outstanding. Without an irq the thread backs off to one poll per tick
+// once idle.
+static void net_poll_thread(void) {
+    struct net_queue *q = &virtio_net.queues[__atomic_fetch_add(&virtio_net.pollers, 1, __ATOMIC_RELAXED)];
+    struct ring_ctl *ctl = q->ch->rings[RING_SQ].ctl;
+    u64 busy_cycles = NET_BUSY_POLL_NS * tsc_khz / 1000000;
+    u64 last_work = rdtsc();
+
+    for (;;) {
+        size_t work = net_sq(q) + net_tx_reclaim(q) + net_rx(q);
+        net_refill(q);
+        q->polls++;
+
+        if (work)
+            last_work = rdtsc();
+        if (work || rdtsc() - last_work < busy_cycles) {
+            yield();
+            continue;
+        }
+        if (!q->irq) {
+            sleep(&sched_ticks);
+            continue;
+        }
+
+        pushcli();
+        __atomic_store_n(&ctl->waiting, 1, __ATOMIC_SEQ_CST);
+        net_vq_irqs(&q->rx, 1);
+        if (q->tx.free_count < VIRTQ_SIZE)
+            net_vq_irqs(&q->tx, 1);
+
+        if (__atomic_load_n(&ctl->tail, __ATOMIC_SEQ_CST) == ctl->head &&
+            !net_vq_pending(&q->rx) && !net_vq_pending(&q->tx)) {
+            q->sleeps++;
+            _sleep(&ctl->waiting);
+        }
+
+        __atomic_store_n(&ctl->waiting, 0, __ATOMIC_RELAXED);
+        net_vq_irqs(&q->rx, 0);
+        net_vq_irqs(&q->tx, 0);
+        popcli();
+        last_work = rdtsc();
+    }
+}
+
+// Maps the queue's buffers at va, buffer i at va + i * PAGE_SIZE, into a
+// server's address space, followed by the ring indices page and then the
+// sq and cq entries. The server also needs a CAP_CHANNEL handle to the
+// queue's channel to wait and kick. The buffers it starts with arrive as
+// NET_MSG_TX_DONE.
+static int net_attach(struct net_queue *q, struct vm_space *vm, uintptr_t va) {
+    if (!vm_range_ok(va, NET_BUFS + CHANNEL_PAGES))
+        return -1;
+
+    pushcli();
+    if (!vm_range_is(vm, va, NET_BUFS + CHANNEL_PAGES, 0)) {
+        popcli();
+        return -1;
+    }
+
+    for (size_t i = 0; i < NET_BUFS; i++) {
+        if (vm_map_kernel(vm, va + i * PAGE_SIZE, q->bufs[i], PAGE_RW) < 0) {
+            popcli();
+            vm_unmap(vm, va, i);
+            return -1;
+        }
+    }
+
+    if (channel_map(q->ch, vm, va + NET_BUFS * PAGE_SIZE) < 0) {
+        popcli();
+        vm_unmap(vm, va, NET_BUFS);
+        return -1;
+    }
+
+    popcli();
+    return 0;
+}
+
+// Every shared page carries a kernel reference so a server unmapping it
+// never frees it
+static void net_share(void *page) {
+    frame_get(v2p((uintptr_t)page));
+}
+
+// Rx queue 2i and tx queue 2i+1 share msi-x entry i, aimed at cpu i
+static int virtio_net_setup_queue(struct virtio_net *net, u16 index) {
+    struct net_queue *q = &net->queues[index];
+
+    q->irq = pci_msix_bind(net->vp.pci, index, index, 1);
+    u16 msix = q->irq ? index : VIRTIO_NO_VECTOR;
+
+    int rx = net_vq_setup(&q->rx, 2 * index, msix);
+    if (rx < 0)
+        return -1;
+    int tx = net_vq_setup(&q->tx, 2 * index + 1, msix);
+    if (tx < 0)
+        return -1;
+    if (!rx || !tx)
+        q->irq = 0;
+    if (q->irq) {
+        q->irq->handler = net_queue_irq;
+        q->irq->data = q;
+    }
+
+    q->ch = channel_create();
+    if (!q->ch)
+        panic("Could not create net channel\n");
+
+    for (u16 i = 0; i < NET_BUFS; i++) {
+        q->bufs[i] = early_kalloc(0);
+        net_share(q->bufs[i]);
+        q->pool[q->pool_count++] = i;
+    }
+
+    // The server's send buffers, rx keeps the rest
+    struct ipc_msg grant[NET_TX_GRANT];
+    for (size_t i = 0; i < NET_TX_GRANT; i++) {
+        grant[i].w[0] = NET_MSG_TX_DONE;
+        grant[i].w[1] = q->pool[--q->pool_count];
+        q->owner[grant[i].w[1]] = NET_BUF_SERVER;
+    }
+    ring_push(&q->ch->rings[RING_CQ], grant, NET_TX_GRANT);
+    return 0;
+}
+
+// Polled, only used once at init
+static int virtio_net_set_pairs(struct virtio_net *net, u16 pairs) {
+    u8 *cmd = early_kalloc(0);
+    struct virtq_desc *desc = net->ctrl.ring->desc;
+
+    cmd[0] = VIRTIO_NET_CTRL_MQ;
+    cmd[1] = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    *(u16 *)(cmd + 2) = pairs;
+    cmd[4] = 0xFF;
+
+    desc[0] = (struct virtq_desc){ v2p((uintptr_t)cmd), 2, VIRTQ_DESC_F_NEXT, 1 };
+    desc[1] = (struct virtq_desc){ v2p((uintptr_t)cmd + 2), 2, VIRTQ_DESC_F_NEXT, 2 };
+    desc[2] = (struct virtq_desc){ v2p((uintptr_t)cmd + 4), 1, VIRTQ_DESC_F_WRITE, 0 };
+    net->ctrl.ring->avail.ring[0] = 0;
+    __atomic_store_n(&net->ctrl.ring->avail.idx, 1, __ATOMIC_SEQ_CST);
+    *net->ctrl.notify = net->ctrl.index;
+
+    while (!net_vq_pending(&net->ctrl))
+        ;
+
+    int ok = cmd[4] == VIRTIO_NET_OK;
+    early_kfree(cmd, 0);
+    return ok ? 0 : -1;
+}
+
+// One queue pair and poll thread per cpu as far as the device allows.
+// Multiple pairs need the control queue to be switched on.
+static void init_virtio_net(void) {
+    struct virtio_net *net = &virtio_net;
+    struct pci_dev *dev = pci_find(VIRTIO_VENDOR, VIRTIO_DEVICE_NET, 0);
+    if (!dev)
+        dev = pci_find(VIRTIO_VENDOR, VIRTIO_DEVICE_NET_TRANSITIONAL, 0);
+    if (!dev)
+        return;
+
+    u64 wanted = VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MAC | VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+    if (virtio_pci_init(&net->vp, dev, wanted, &net->features, "virtio-net") < 0)
+        return;
+
+    volatile struct virtio_common_cfg *common = net->vp.common;
+    if (net->features & VIRTIO_NET_F_MAC) {
+        for (size_t i = 0; i < 6; i++)
+            net->mac[i] = *(volatile u8 *)(net->vp.device_cfg + VIRTIO_NET_CFG_MAC + i);
+    }
+
+    size_t max_pairs = 1;
+    if ((net->features & VIRTIO_NET_F_MQ) && (net->features & VIRTIO_NET_F_CTRL_VQ))
+        max_pairs = *(volatile u16 *)(net->vp.device_cfg + VIRTIO_NET_CFG_MAX_PAIRS);
+    size_t pairs = max_pairs < lapic_count ? max_pairs : lapic_count;
+
+    for (net->queue_count = 0; net->queue_count < pairs; net->queue_count++) {
+        if (virtio_net_setup_queue(net, net->queue_count) < 0)
+            break;
+    }
+    if (!net->queue_count) {
+        common->device_status = VIRTIO_STATUS_FAILED;
+        early_printf("virtio-net: no usable queue\n");
+        return;
+    }
+
+    int ctrl = 0;
+    if (net->queue_count > 1)
+        ctrl = net_vq_setup(&net->ctrl, 2 * max_pairs, VIRTIO_NO_VECTOR) >= 0;
+
+    common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+    if (net->queue_count > 1 && (!ctrl || virtio_net_set_pairs(net, net->queue_count) < 0))
+        net->queue_count = 1;
+    net->ready = 1;
+
+    for (size_t i = 0; i < net->queue_count; i++) {
+        if (!kthread_create(net_poll_thread))
+            panic("Could not create net poll thread\n");
+    }
+
+    early_printf("virtio-net: mac %lx, %lu queue pairs, tx csum %s, rx csum %s, %s\n",
+                 (u64)net->mac[0] << 40 | (u64)net->mac[1] << 32 | (u64)net->mac[2] << 24 |
+                 (u64)net->mac[3] << 16 | (u64)net->mac[4] << 8 | net->mac[5],
+                 net->queue_count, net->features & VIRTIO_NET_F_CSUM ? "offloaded" : "software",
+                 net->features & VIRTIO_NET_F_GUEST_CSUM ? "offloaded" : "software",
+                 net->queues[0].irq ? "msi-x" : "polled");
+}
+
+static struct list *futex_bucket(u64 key) {
+    return &futex_table[(key * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_HASH_BITS)];
+}
+
+// Caller holds pushcli. User words are keyed by physical address so every
+// mapping of a shared frame finds the same waiters. Kernel threads without
+// an address space wait on kernel addresses, keyed by va. Returns the word
+// through the hhdm so a bad user address cannot fault. write asks for a
+// word the caller may change, NULL if the page is read only.
+static u32 *futex_word(struct proc *p, uintptr_t addr, int write, u64 *key) {
+    if (addr % sizeof(u32))
+        return 0;
+
+    if (addr >= USER_VA_END) {
+        if (p->vm)
+            return 0;
+        *key = addr;
+        return (u32 *)addr;
+    }
+
+    if (!p->vm)
+        return 0;
+
+    // Filled in and unshared first, a copy on write later would move the
+    // key away from the waiters. Read only areas are only filled in, a
+    // waiter just reads the word.
+    if (vm_fault(p->vm, addr, PF_WRITE) < 0 && (write || vm_fault(p->vm, addr, 0) < 0))
+        return 0;
+
+    uintptr_t page = page_round_down(addr);
+    uintptr_t pa = vm_lookup(p->vm, page);
+    if (!pa || (write && !(vm_pte(p->vm, page, 0)->entry & PAGE_RW)))
+        return 0;
+
+    *key = pa + addr % PAGE_SIZE;
+    return (u32 *)p2v(*key);
+}
+
+static void futex_timeout(struct timer *t) {
+    struct proc *p = container_of(t, struct proc, timer);
+
+    if (p->futex_queued) {
+        list_del(&p->node);
+        p->futex_queued = 0;
+        p->futex_timed_out = 1;
+        make_runnable(p);
+    }
+}
+
+// Sleeps while *addr == val, for at most timeout_ns unless it is 0.
+// Returns 0 once woken, FUTEX_AGAIN or FUTEX_TIMEDOUT.
+static int futex_wait(uintptr_t addr, u32 val, u64 timeout_ns) {
+    pushcli();
+    struct proc *p = my_proc();
+    u64 key;
+    u32 *word = futex_word(p, addr, 0, &key);
+
+    if (!word || __atomic_load_n(word, __ATOMIC_ACQUIRE) != val) {
+        popcli();
+        return FUTEX_AGAIN;
+    }
+
+    p->futex_key = key;
+    p->futex_queued = 1;
+    p->futex_timed_out = 0;
+    list_add_tail(futex_bucket(key), &p->node);
+    if (timeout_ns)
+        timer_add(&p->timer, clock_ns() + timeout_ns, futex_timeout);
+
+    p->state = PROC_SLEEPING;
+    sched();
+
+    if (timeout_ns)
+        timer_del(&p->timer);
+    int ret = p->futex_timed_out ? FUTEX_TIMEDOUT : 0;
+
+    popcli();
+    return ret;
+}
+
+// Caller holds pushcli. Wakes up to n waiters on key, then moves up to
+// requeue more of them to to_key. Returns how many were woken.
+static int futex_wake_key(u64 key, int n, u64 to_key, int requeue) {
+    struct list *bucket = futex_bucket(key);
+    int woken = 0;
+
+    for (struct list *l = bucket->next; l != bucket && (woken < n || requeue > 0);) {
+        struct proc *p = container_of(l, struct proc, node);
+        l = l->next;
+
+        if (p->futex_key != key)
+            continue;
+
+        list_del(&p->node);
+        if (woken < n) {
+            p->futex_queued = 0;
+            make_runnable(p);
+            woken++;
+        } else {
+            p->futex_key = to_key;
+            list_add_tail(futex_bucket(to_key), &p->node);
+            requeue--;
+        }
+    }
+
+    return woken;
+}
+
+static int futex_wake(uintptr_t addr, int n) {
+    pushcli();
+    u64 key;
+
+    if (!futex_word(my_proc(), addr, 0, &key)) {
+        popcli();
+        return -1;
+    }
+
+    int woken = futex_wake_key(key, n, 0, 0);
+    popcli();
+    preempt_check();
+    return woken;
+}
+
+// Wakes n waiters on addr and moves up to requeue of the rest to addr2
+// without waking them, so a condvar broadcast does not stampede the
+// mutex. Fails if *addr no longer holds val.
+static int futex_requeue(uintptr_t addr, int n, uintptr_t addr2, int requeue, u32 val) {
+    pushcli();
+    struct proc *p = my_proc();
+    u64 key, key2;
+    u32 *word = futex_word(p, addr, 0, &key);
+
+    if (!word || !futex_word(p, addr2, 0, &key2) || __atomic_load_n(word, __ATOMIC_ACQUIRE) != val) {
+        popcli();
+        return -1;
+    }
+
+    int woken = futex_wake_key(key, n, key2, requeue);
+    popcli();
+    preempt_check();
+    return woken;
+}
+
+// Applies the encoded op to *addr2, wakes n waiters on addr and, if the
+// old value of *addr2 passes the encoded test, n2 waiters on addr2
+static int futex_wake_op(uintptr_t addr, int n, uintptr_t addr2, int n2, u32 op) {
+    pushcli();
+    struct proc *p = my_proc();
+    u64 key, key2;
+    u32 *word2 = futex_word(p, addr2, 1, &key2);
+
+    if (!futex_word(p, addr, 0, &key) || !word2) {
+        popcli();
+        return -1;
+    }
+
+    u32 oparg = (op >> 12) & 0xFFF;
+    u32 cmparg = op & 0xFFF;
+    u32 old;
+
+    switch (op >> 28) {
+        case FUTEX_OP_SET:
+            old = __atomic_exchange_n(word2, oparg, __ATOMIC_SEQ_CST);
+            break;
+        case FUTEX_OP_ADD:
+            old = __atomic_fetch_add(word2, oparg, __ATOMIC_SEQ_CST);
+            break;
+        case FUTEX_OP_OR:
+            old = __atomic_fetch_or(word2, oparg, __ATOMIC_SEQ_CST);
+            break;
+        case FUTEX_OP_ANDN:
+            old = __atomic_fetch_and(word2, ~oparg, __ATOMIC_SEQ_CST);
+            break;
+        case FUTEX_OP_XOR:
+            old = __atomic_fetch_xor(word2, oparg, __ATOMIC_SEQ_CST);
+            break;
+        default:
+            popcli();
+            return -1;
+    }
+
+    int pass;
+    switch ((op >> 24) & 0xF) {
+        case FUTEX_OP_CMP_EQ:
+            pass = old == cmparg;
+            break;
+        case FUTEX_OP_CMP_NE:
+            pass = old != cmparg;
+            break;
+        case FUTEX_OP_CMP_LT:
+            pass = old < cmparg;
+            break;
+        case FUTEX_OP_CMP_LE:
+            pass = old <= cmparg;
+            break;
+        case FUTEX_OP_CMP_GT:
+            pass = old > cmparg;
+            break;
+        default:
+            pass = old >= cmparg;
+            break;
+    }
+
+    int woken = futex_wake_key(key, n, 0, 0);
+    if (pass)
+        woken += futex_wake_key(key2, n2, 0, 0);
+
+    popcli();
+    preempt_check();
+    return woken;
+}
+
+// rdi = addr, then rsi, rdx, r8 and r9 as the futex_* arguments in order
+static s64 sys_futex(struct trap_frame *tf) {
+    switch (tf->rax) {
+        case SYS_FUTEX_WAIT:
+            return futex_wait(tf->rdi, tf->rsi, tf->rdx);
+        case SYS_FUTEX_WAKE:
+            return futex_wake(tf->rdi, tf->rsi);
+        case SYS_FUTEX_REQUEUE:
+            return futex_requeue(tf->rdi, tf->rsi, tf->rdx, tf->r8, tf->r9);
+        default:
+            return futex_wake_op(tf->rdi, tf->rsi, tf->rdx, tf->r8, tf->r9);
+    }
+}
+
+// Finds a live thread by tid, 0 meaning the caller. Other threads are only
+// visible to threads that share their cap table. Called with cli held so
+// the thread cannot be reaped under the caller.
+static struct proc *proc_find(int tid) {
+    struct proc *self = my_proc();
+
+    if (!tid)
+        return self;
+
+    struct proc *p = idr_find(&tid_idr, tid);
+    if (!p || p->state == PROC_DEAD || !self->caps || p->caps != self->caps)
+        return 0;
+    return p;
+}
+
+// Scheduling of the thread with tid r8, 0 for the caller. SETSCHEDULER:
+// rdi = policy, rsi = rt priority. SETDEADLINE: rdi = runtime, rsi =
+// deadline, rdx = period in ns. SET_NICE: rdi = nice, clamped to
+// [NICE_MIN, NICE_MAX]. WAIT_PERIOD always ends the caller's own job.
+static s64 sys_sched(struct trap_frame *tf) {
+    if (tf->rax == SYS_SCHED_WAIT_PERIOD) {
+        sched_wait_period();
+        return 0;
+    }
+
+    pushcli();
+    struct proc *p = proc_find(tf->r8);
+    s64 ret = -1;
+
+    if (p) {
+        switch (tf->rax) {
+            case SYS_SCHED_SETSCHEDULER:
+                if (tf->rdi < SCHED_DEADLINE && tf->rsi < RT_PRIO_COUNT)
+                    ret = sched_setscheduler(p, tf->rdi, tf->rsi);
+                break;
+            case SYS_SCHED_SETDEADLINE:
+                ret = sched_setdeadline(p, tf->rdi, tf->rsi, tf->rdx);
+                break;
+            default:
+                set_nice(p, (int)tf->rdi);
+                ret = 0;
+                break;
+        }
+    }
+
+    popcli();
+    return ret;
+}
+
+// rdi = handle of the CAP_VM being changed, which needs CAP_RIGHT_MAP.
+// ALLOC and UNMAP: rsi = va, rdx = page count, and for ALLOC r8 = PAGE_RW
+// to make the pages writable. GRANT and TRANSFER: rsi = va in the
+// caller's space, rdx = va in the target, r8 = page count, and for GRANT
+// r9 = PAGE_RW to share write access.
+static s64 sys_vm(struct trap_frame *tf) {
+    struct proc *p = my_proc();
+    struct vm_space *vm = cap_lookup(p->caps, tf->rdi, CAP_VM, CAP_RIGHT_MAP, 0);
+
+    if (!vm || !p->vm)
+        return -1;
+
+    switch (tf->rax) {
+        case SYS_VM_ALLOC:
+            return vm_alloc(vm, tf->rsi, tf->rdx, tf->r8);
+        case SYS_VM_UNMAP:
+            return vm_unmap(vm, tf->rsi, tf->rdx);
+        case SYS_VM_GRANT:
+            return vm_grant(p->vm, tf->rsi, vm, tf->rdx, tf->r8, tf->r9);
+        default:
+            return vm_transfer(p->vm, tf->rsi, vm, tf->rdx, tf->r8);
+    }
+}
+
+// rdi = irq handle, and for SET_AFFINITY rsi = the cpu to pin it to
+static s64 sys_irq(struct trap_frame *tf) {
+    struct irq *irq = cap_lookup(my_proc()->caps, tf->rdi, CAP_IRQ, CAP_RIGHT_RECV, 0);
+
+    if (!irq)
+        return -1;
+
+    switch (tf->rax) {
+        case SYS_IRQ_WAIT:
+            return irq_wait(irq);
+        case SYS_IRQ_ACK:
+            irq_ack(irq);
+            return 0;
+        default:
+            return irq_set_affinity(irq, tf->rsi);
+    }
+}
+
+// Delegation within the caller's own table. rdi = handle, rsi = rights,
+// rdx = badge. New handles come back in rax.
+static s64 sys_cap(struct trap_frame *tf) {
+    struct cap_table *caps = my_proc()->caps;
+
+    switch (tf->rax) {
+        case SYS_CAP_COPY:
+            return cap_copy(caps, tf->rdi, caps, tf->rsi);
+        case SYS_CAP_MINT:
+            return cap_mint(caps, tf->rdi, caps, tf->rsi, tf->rdx);
+        case SYS_CAP_DELETE:
+            return cap_delete(caps, tf->rdi);
+        default:
+            return cap_revoke(caps, tf->rdi);
+    }
+}
+
+static void syscall(struct trap_frame *tf) {
+    switch (tf->rax) {
+        case SYS_IPC_CALL:
+        case SYS_IPC_REPLY_WAIT:
+        case SYS_IPC_REPLY:
+            tf->rax = sys_ipc(tf);
+            break;
+        case SYS_RING_WAIT:
+        case SYS_RING_NOTIFY:
+            tf->rax = sys_ring(tf);
+            break;
+        case SYS_CHANNEL_CREATE:
+        case SYS_CHANNEL_MAP:
+            tf->rax = sys_channel(tf);
+            break;
+        case SYS_CAP_COPY:
+        case SYS_CAP_MINT:
+        case SYS_CAP_DELETE:
+        case SYS_CAP_REVOKE:
+            tf->rax = sys_cap(tf);
+            break;
+        case SYS_IRQ_WAIT:
+        case SYS_IRQ_ACK:
+        case SYS_IRQ_SET_AFFINITY:
+            tf->rax = sys_irq(tf);
+            break;
+        case SYS_FUTEX_WAIT:
+        case SYS_FUTEX_WAKE:
+        case SYS_FUTEX_REQUEUE:
+        case SYS_FUTEX_WAKE_OP:
+            tf->rax = sys_futex(tf);
+            break;
+        case SYS_SCHED_SETSCHEDULER:
+        case SYS_SCHED_SETDEADLINE:
+        case SYS_SCHED_WAIT_PERIOD:
+        case SYS_SET_NICE:
+            tf->rax = sys_sched(tf);
+            break;
+        case SYS_VM_ALLOC:
+        case SYS_VM_UNMAP:
+        case SYS_VM_GRANT:
+        case SYS_VM_TRANSFER:
+            tf->rax = sys_vm(tf);
+            break;
+        default:
+            tf->rax = -1;
+            break;
+    }
+}
+
+void trap(struct trap_frame *tf) {
+    // Syscalls come in through a trap gate with interrupts on and may block
+    if (tf->vector == TRAP_SYSCALL) {
+        syscall(tf);
+        return;
+    }
+
+    // Demand paging, then a faulting user thread only takes itself down
+    if ((tf->cs & 3) == DPL_USER && tf->vector < TRAP_IRQ0) {
+        if (tf->vector == TRAP_PAGE_FAULT) {
+            uintptr_t addr;
+            asm volatile("mov %%cr2, %0" : "=r"(addr));
+            if (vm_fault(my_proc()->vm, addr, tf->error) == 0)
+                return;
+        }
+        early_printf("thread %d: fault %lu at %lx, killed\n", my_proc()->tid, tf->vector, tf->rip);
+        exit();
+    }
+
+    u64 start = TRACE_LATENCY ? rdtsc() : 0;
+
+    switch (tf->vector) {
+        case TRAP_ILLEGAL_OPCODE:
+            panic("Illegal Opcode!\n");
+        case TRAP_DOUBLE_FAULT:
+            panic("Double Fault!\n");
+        case TRAP_SEGMENT_NOT_PRESENT:
+            panic("Segment Not Present!\n");
+        case TRAP_STACK:
+            panic("Stack!\n");
+        case TRAP_GENERAL_PROTECTION_FAULT:
+            panic("General Protection Fault!\n");
+        case TRAP_PAGE_FAULT:
+            panic("Page Fault!\n");
+        case TRAP_IRQ0 + IRQ_TIMER:
+            sched_ticks++;
+            time_page_tick();
+            run_timers(my_cpu(), clock_ns());
+            sched_tick(my_cpu());
+            wake_up(&sched_ticks);
+            lapic_eoi();
+            break;
+        default:
+            if (tf->vector >= IRQ_VECTOR_BASE && tf->vector < IRQ_VECTOR_BASE + MAX_IRQS &&
+                irqs[tf->vector - IRQ_VECTOR_BASE].bound) {
+                irq_deliver(&irqs[tf->vector - IRQ_VECTOR_BASE]);
+                break;
+            }
+            panic("Unexpected trap!\n");
+    }
+
+    if (TRACE_LATENCY)
+        trace_record(&my_cpu()->irqoff, start, trap_vectors[tf->vector], tf->rip);
+}
+
+// Called by isr_common once trap() returns, still with interrupts off.
+// Only code that the interrupt could legally stop is preempted.
+void trap_exit(struct trap_frame *tf) {
+    struct cpu *c = my_cpu();
+    struct proc *p = c->proc;
+
+    if (!c->need_resched || !p || p->state != PROC_RUNNING)
+        return;
+    if (p->preempt_count || c->cli_count || !(tf->rflags & RFLAG_IF))
+        return;
+
+    preempt_schedule();
+}
+
+#ifndef BENCH
+static void thread1(void) {
+    for (;;)
+        early_printf("thread1!\n");
+    panic("Should not have left the loop\n");
+}
+
+static void thread2(void) {
+    for (;;)
+        early_printf("thread2!\n");
+    panic("Should not have left the loop\n");
+}
+
+static struct endpoint *console_ep;
+
+// Serves init's console endpoint. A call carries up to sizeof(struct
+// ipc_msg) bytes of text, NUL padded, and the reply's first word is the
+// number of bytes written.
+static void console_server(void) {
+    struct ipc_msg msg = { { 0 } };
+    char text[sizeof(msg) + 1];
+    u64 badge;
+
+    for (;;) {
+        ipc_reply_wait(console_ep, &msg, &badge);
+
+        size_t n = 0;
+        for (; n < sizeof(msg) && ((char *)msg.w)[n]; n++)
+            text[n] = ((char *)msg.w)[n];
+        text[n] = 0;
+
+        early_printf("%s", text);
+        msg.w[0] = n;
+    }
+}
+
+// The first user program, started with a cap table holding the boot-time
+// grants at the INIT_CAP_* handles. Without one in the initrd the demo
+// threads run instead.
+static struct proc *spawn_init(void) {
+    if (!initrd_find(INIT_NAME)) {
+        early_printf("init: no %s in the initrd\n", INIT_NAME);
+        return NULL;
+    }
+
+    struct cap_table *caps = cap_table_create();
+    if (!caps)
+        panic("Could not create init's cap table\n");
+
+    struct proc *p = elf_spawn(INIT_NAME, caps, 0);
+    if (!p)
+        panic("Could not start init\n");
+
+    if (cap_install(caps, CAP_VM, p->vm, CAP_RIGHTS_ALL) != INIT_CAP_VM)
+        panic("Could not grant init its vm\n");
+
+    console_ep = endpoint_create();
+    if (!console_ep || !kthread_create(console_server) ||
+        cap_install(caps, CAP_ENDPOINT, console_ep, CAP_RIGHT_SEND) != INIT_CAP_CONSOLE)
+        panic("Could not give init a console\n");
+
+    // Drivers get their lines from here, there is no bind syscall
+    struct irq *kbd = irq_bind(isa_irq_gsi(IRQ_KBD), 0);
+    if (!kbd || cap_install(caps, CAP_IRQ, kbd, CAP_RIGHT_RECV) != INIT_CAP_KBD)
+        panic("Could not grant init the keyboard irq\n");
+
+    // init serves the network, the poll threads only move buffers
+    struct net_queue *q = &virtio_net.queues[0];
+    if (virtio_net.ready &&
+        (net_attach(q, p->vm, INIT_NET_VA) < 0 ||
+         cap_install(caps, CAP_CHANNEL, q->ch, CAP_RIGHT_SEND | CAP_RIGHT_RECV) != INIT_CAP_NET))
+        panic("Could not attach init to the network\n");
+    return p;
+}
+#endif
+
+#ifdef BENCH
+#define BENCH_SWITCH_ROUNDS 100000
+
+static volatile int bench_pingpong_stop;
+
+static void bench_pingpong_partner(void) {
+    while (!bench_pingpong_stop)
+        yield();
+}
+
+// Two threads yield back and forth, every yield is one context switch
+static void bench_switch(int direct) {
+    sched_direct_switch = direct;
+    bench_pingpong_stop = 0;
+
+    if (!kthread_create(bench_pingpong_partner))
+        panic("bench: could not create partner\n");
+
+    yield();
+
+    u64 start = rdtsc();
+    for (size_t i = 0; i < BENCH_SWITCH_ROUNDS; i++)
+        yield();
+    u64 cycles = rdtsc() - start;
+
+    bench_pingpong_stop = 1;
+    yield();
+
+    early_printf("bench: switch direct=%d rounds=%d cycles/switch=%lu\n",
+                 direct, BENCH_SWITCH_ROUNDS, cycles / (2 * BENCH_SWITCH_ROUNDS));
+}
+
+#define BENCH_LATENCY_SAMPLES 1000
+#define BENCH_HOGS 3
+
+static volatile int bench_hog_stop;
+static volatile int bench_hogs_running;
+static u64 bench_latency[BENCH_LATENCY_SAMPLES];
+
+static void sort_u64(u64 *v, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        u64 x = v[i];
+        size_t j = i;
+        for (; j > 0 && v[j - 1] > x; j--)
+            v[j] = v[j - 1];
+        v[j] = x;
+    }
+}
+
+#define BENCH_MAX_SAMPLES 1000
+
+static int bench_has_rdtscp;
+static u64 bench_overhead;
+static u64 bench_samples[BENCH_MAX_SAMPLES];
+
+// lfence keeps earlier work from drifting into the timed region
+static u64 bench_tsc_start(void) {
+    asm volatile("lfence" : : : "memory");
+    return rdtsc();
+}
+
+// rdtscp waits for the timed work to retire, the lfence keeps later work out
+static u64 bench_tsc_stop(void) {
+    u32 lo, hi;
+    if (bench_has_rdtscp)
+        asm volatile("rdtscp" : "=a"(lo), "=d"(hi) : : "rcx", "memory");
+    else
+        asm volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+    asm volatile("lfence" : : : "memory");
+    return ((u64)hi << 32) | lo;
+}
+
+// The cheapest empty start/stop pair is taken off every sample
+static void bench_calibrate(void) {
+    u32 eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+        bench_has_rdtscp = (edx >> 27) & 1;
+    }
+
+    bench_overhead = ~0ULL;
+    for (size_t i = 0; i < BENCH_MAX_SAMPLES; i++) {
+        u64 start = bench_tsc_start();
+        u64 cycles = bench_tsc_stop() - start;
+        if (cycles < bench_overhead)
+            bench_overhead = cycles;
+    }
+
+    early_printf("BENCH name=overhead unit=cycles rdtscp=%d min=%lu\n",
+                 bench_has_rdtscp, bench_overhead);
+}
+
+// Warms fn up, then times samples batches of iters calls each and reports
+// cycles per call as one "BENCH key=value ..." line
+static void bench_run(const char *name, void (*fn)(void *), void *arg, size_t iters, size_t samples) {
+    if (samples > BENCH_MAX_SAMPLES)
+        samples = BENCH_MAX_SAMPLES;
+
+    for (size_t i = 0; i < samples / 10 * iters; i++)
+        fn(arg);
+
+    for (size_t s = 0; s < samples; s++) {
+        u64 start = bench_tsc_start();
+        for (size_t i = 0; i < iters; i++)
+            fn(arg);
+        u64 cycles = bench_tsc_stop() - start;
+        cycles = cycles > bench_overhead ? cycles - bench_overhead : 0;
+        bench_samples[s] = cycles / iters;
+    }
+
+    sort_u64(bench_samples, samples);
+    early_printf("BENCH name=%s unit=cycles iters=%lu samples=%lu min=%lu p50=%lu p99=%lu max=%lu\n",
+                 name, iters, samples, bench_samples[0], bench_samples[samples / 2],
+                 bench_samples[samples * 99 / 100], bench_samples[samples - 1]);
+}
+
+// One call is a yield to the partner and back, so two switches
+static void bench_op_yield(void *arg) {
+    (void)arg;
+    yield();
+}
+
+// An unknown syscall number goes all the way through trap() and back
+static void bench_op_trap(void *arg) {
+    (void)arg;
+    u64 rax = ~0ULL;
+    asm volatile("int %1" : "+a"(rax) : "i"(TRAP_SYSCALL) : "memory");
+}
+
+static void bench_op_kalloc(void *arg) {
+    (void)arg;
+    early_kfree(early_kalloc(0), 0);
+}
+
+// Remaps the page onto its own direct map address, which changes nothing
+static void bench_op_map_page(void *arg) {
+    map_page_early(kernel_ptl4, v2p((uintptr_t)arg), (uintptr_t)arg, PAGE_P | PAGE_RW);
+    asm volatile("invlpg (%0)" : : "r"(arg) : "memory");
+}
+
+static void bench_op_memcpy(void *arg) {
+    void **pages = arg;
+    memcpy(pages[0], pages[1], PAGE_SIZE);
+}
+
+static void bench_op_memset(void *arg) {
+    memset(arg, 0x5A, PAGE_SIZE);
+}
+
+static void bench_op_printf(void *arg) {
+    (void)arg;
+    early_printf("bench: printf probe %lu %s\n", 1234567890UL, "abcdef");
+}
+
+static void bench_micro(void) {
+    bench_calibrate();
+
+    bench_pingpong_stop = 0;
+    if (!kthread_create(bench_pingpong_partner))
+        panic("bench: could not create partner\n");
+    yield();
+    bench_run("switch_roundtrip", bench_op_yield, NULL, 10, BENCH_MAX_SAMPLES);
+    bench_pingpong_stop = 1;
+    yield();
+
+    bench_run("trap_roundtrip", bench_op_trap, NULL, 10, BENCH_MAX_SAMPLES);
+    bench_run("early_kalloc_kfree", bench_op_kalloc, NULL, 10, BENCH_MAX_SAMPLES);
+
+    void *pages[2] = { early_kalloc(0), early_kalloc(0) };
+    bench_run("map_page_early", bench_op_map_page, pages[0], 10, BENCH_MAX_SAMPLES);
+    bench_run("memcpy_4k", bench_op_memcpy, pages, 10, BENCH_MAX_SAMPLES);
+    bench_run("memset_4k", bench_op_memset, pages[0], 10, BENCH_MAX_SAMPLES);
+    early_kfree(pages[0], 0);
+    early_kfree(pages[1], 0);
+
+    // Every call is a line on the serial port, so keep the sample count low
+    bench_run("early_printf", bench_op_printf, NULL, 1, 100);
+}
+
+static void bench_hog(void) {
+    while (!bench_hog_stop)
+        ;
+    __atomic_sub_fetch(&bench_hogs_running, 1, __ATOMIC_SEQ_CST);
+}
+
+// An interactive thread sleeps one tick at a time next to CPU-bound
+// threads and records how long each wakeup waited to get the cpu
+static void bench_fair_latency(int wakeup_preempt) {
+    sched_wakeup_preempt = wakeup_preempt;
+    bench_hog_stop = 0;
+    bench_hogs_running = BENCH_HOGS;
+
+    for (size_t i = 0; i < BENCH_HOGS; i++) {
+        if (!kthread_create(bench_hog))
+            panic("bench: could not create hog\n");
+    }
+
+    for (size_t i = 0; i < BENCH_LATENCY_SAMPLES; i++) {
+        sleep(&sched_ticks);
+        bench_latency[i] = clock_ns() - my_proc()->wakeup_ns;
+    }
+
+    bench_hog_stop = 1;
+    while (bench_hogs_running)
+        sleep(&sched_ticks);
+
+    sort_u64(bench_latency, BENCH_LATENCY_SAMPLES);
+    early_printf("bench: fair wakeup_preempt=%d hogs=%d p50=%luns p99=%luns max=%luns\n",
+                 wakeup_preempt, BENCH_HOGS,
+                 bench_latency[BENCH_LATENCY_SAMPLES / 2],
+                 bench_latency[BENCH_LATENCY_SAMPLES * 99 / 100],
+                 bench_latency[BENCH_LATENCY_SAMPLES - 1]);
+}
+
+#define BENCH_DL_JOBS 200
+#define BENCH_DL_RUNTIME_NS 2000000ULL
+#define BENCH_DL_PERIOD_NS 10000000ULL
+#define BENCH_DL_WORK_NS 1500000ULL
+
+static volatile int bench_dl_admitted;
+static volatile int bench_dl_done;
+
+static void bench_dl_task(void) {
+    struct proc *p = my_proc();
+
+    if (sched_setdeadline(p, BENCH_DL_RUNTIME_NS, BENCH_DL_PERIOD_NS, BENCH_DL_PERIOD_NS) < 0)
+        panic("bench: deadline reservation rejected\n");
+    bench_dl_admitted = 1;
+
+    for (size_t i = 0; i < BENCH_DL_JOBS; i++) {
+        u64 end = clock_ns() + BENCH_DL_WORK_NS;
+        while (clock_ns() < end)
+            ;
+        sched_wait_period();
+    }
+
+    early_printf("bench: deadline jobs=%lu misses=%lu overruns=%lu max_lateness=%luns\n",
+                 p->dl_jobs, p->dl_misses, p->dl_overruns, p->dl_max_lateness);
+    bench_dl_done = 1;
+}
+
+// A periodic deadline thread competes with CPU-bound normal threads, and
+// a second reservation that would overcommit the cpu must be refused
+static void bench_deadline(void) {
+    bench_hog_stop = 0;
+    bench_hogs_running = BENCH_HOGS;
+    bench_dl_admitted = 0;
+    bench_dl_done = 0;
+
+    struct proc *hog = 0;
+    for (size_t i = 0; i < BENCH_HOGS; i++) {
+        hog = kthread_create(bench_hog);
+        if (!hog)
+            panic("bench: could not create hog\n");
+    }
+
+    if (!kthread_create(bench_dl_task))
+        panic("bench: could not create deadline thread\n");
+
+    // Only overcommitted once the deadline thread holds its reservation
+    while (!bench_dl_admitted)
+        sleep(&sched_ticks);
+    if (hog && sched_setdeadline(hog, 9 * BENCH_DL_PERIOD_NS / 10, BENCH_DL_PERIOD_NS, BENCH_DL_PERIOD_NS) == 0)
+        panic("bench: overcommitted deadline reservation admitted\n");
+
+    while (!bench_dl_done)
+        sleep(&sched_ticks);
+
+    bench_hog_stop = 1;
+    while (bench_hogs_running)
+        sleep(&sched_ticks);
+}
+
+#define BENCH_IPC_ROUNDS 100000
+#define BENCH_IPC_STOP 1
+
+static struct endpoint *bench_ep;
+static struct cap_table *bench_caps;
+static u64 bench_ep_handle;
+
+// Same calling convention as a user thread would use
+static void ipc_trap(u64 op, u64 handle, struct ipc_msg *msg) {
+    register u64 r8 asm("r8") = msg->w[2];
+    register u64 r9 asm("r9") = msg->w[3];
+    u64 ret = op;
+
+    asm volatile("int $64"
+                 : "+a"(ret), "+D"(handle), "+S"(msg->w[0]), "+d"(msg->w[1]), "+r"(r8), "+r"(r9)
+                 :
+                 : "memory");
+
+    msg->w[2] = r8;
+    msg->w[3] = r9;
+    if (ret)
+        panic("bench: ipc syscall failed\n");
+}
+
+static void bench_ipc_call(int trap, struct ipc_msg *msg) {
+    if (trap)
+        ipc_trap(SYS_IPC_CALL, bench_ep_handle, msg);
+    else
+        ipc_call(bench_ep, 0, msg);
+}
+
+static void bench_ipc_reply_wait(int trap, struct ipc_msg *msg) {
+    u64 badge;
+
+    if (trap)
+        ipc_trap(SYS_IPC_REPLY_WAIT, bench_ep_handle, msg);
+    else
+        ipc_reply_wait(bench_ep, msg, &badge);
+}
+
+static void bench_ipc_serve(int trap) {
+    struct ipc_msg msg = { { 0 } };
+
+    bench_ipc_reply_wait(trap, &msg);
+    while (msg.w[1] != BENCH_IPC_STOP) {
+        msg.w[0]++;
+        bench_ipc_reply_wait(trap, &msg);
+    }
+
+    ipc_reply(&msg);
+}
+
+static void bench_ipc_server(void) {
+    bench_ipc_serve(0);
+}
+
+static void bench_ipc_trap_server(void) {
+    bench_ipc_serve(1);
+}
+
+// Round trips between a client and a server thread, each call and each
+// reply is one message
+static void bench_ipc(int trap) {
+    bench_ep = endpoint_create();
+    if (!bench_ep)
+        panic("bench: could not create endpoint\n");
+
+    s64 handle = cap_install(bench_caps, CAP_ENDPOINT, bench_ep, CAP_RIGHTS_ALL);
+    if (handle < 0)
+        panic("bench: could not install endpoint\n");
+    bench_ep_handle = handle;
+
+    struct proc *server = kthread_create(trap ? bench_ipc_trap_server : bench_ipc_server);
+    if (!server)
+        panic("bench: could not create ipc server\n");
+    server->caps = bench_caps;
+    cap_table_get(bench_caps);
+
+    struct ipc_msg msg = { { 0 } };
+    bench_ipc_call(trap, &msg);
+
+    u64 start = rdtsc();
+    for (size_t i = 0; i < BENCH_IPC_ROUNDS; i++)
+        bench_ipc_call(trap, &msg);
+    u64 cycles = rdtsc() - start;
+
+    msg.w[1] = BENCH_IPC_STOP;
+    bench_ipc_call(trap, &msg);
+    if (msg.w[0] != BENCH_IPC_ROUNDS + 1)
+        panic("bench: ipc messages lost\n");
+
+    early_printf("bench: ipc trap=%d rounds=%d cycles/message=%lu\n",
+                 trap, BENCH_IPC_ROUNDS, cycles / (2 * BENCH_IPC_ROUNDS));
+
+    // The server is done with ep once it has replied to the stop message
+    if (cap_delete(bench_caps, bench_ep_handle) < 0 || endpoint_destroy(bench_ep) < 0)
+        panic("bench: could not tear down endpoint\n");
+}
+
+#define BENCH_RING_MSGS 1000000
+#define BENCH_RING_BATCH 32
+
+static struct channel *bench_chan;
+static u64 bench_ring_kicks;
+static volatile int bench_ring_server_done;
+
+static void bench_ring_server(void) {
+    struct ipc_msg msgs[BENCH_RING_BATCH];
+
+    for (size_t done = 0; done < BENCH_RING_MSGS;) {
+        u32 n = ring_pop(&bench_chan->rings[RING_SQ], msgs, BENCH_RING_BATCH);
+        if (!n) {
+            ring_wait(&bench_chan->rings[RING_SQ]);
+            continue;
+        }
+
+        for (u32 i = 0; i < n; i++)
+            msgs[i].w[1] = msgs[i].w[0] + 1;
+
+        // The client never has more in flight than the completion ring holds
+        if (ring_push(&bench_chan->rings[RING_CQ], msgs, n) != n)
+            panic("bench: completion ring overflow\n");
+        bench_ring_kicks += ring_kick(&bench_chan->rings[RING_CQ]);
+        done += n;
+    }
+
+    bench_ring_server_done = 1;
+}
+
+// The client streams requests through the submission ring in batches and
+// reaps completions, entering the kernel only to sleep or wake the peer
+static void bench_ring(void) {
+    bench_chan = channel_create();
+    if (!bench_chan)
+        panic("bench: could not create channel\n");
+    bench_ring_kicks = 0;
+    bench_ring_server_done = 0;
+
+    if (!kthread_create(bench_ring_server))
+        panic("bench: could not create ring server\n");
+
+    struct ipc_msg msgs[BENCH_RING_BATCH];
+    size_t sent = 0;
+    size_t done = 0;
+    u64 start = clock_ns();
+
+    while (done < BENCH_RING_MSGS) {
+        size_t n = BENCH_RING_MSGS - sent;
+        if (n > BENCH_RING_BATCH)
+            n = BENCH_RING_BATCH;
+        if (n > RING_ENTRIES - (sent - done))
+            n = RING_ENTRIES - (sent - done);
+
+        for (size_t i = 0; i < n; i++)
+            msgs[i].w[0] = sent + i;
+        u32 pushed = ring_push(&bench_chan->rings[RING_SQ], msgs, n);
+        if (pushed) {
+            sent += pushed;
+            bench_ring_kicks += ring_kick(&bench_chan->rings[RING_SQ]);
+        }
+
+        u32 got = ring_pop(&bench_chan->rings[RING_CQ], msgs, BENCH_RING_BATCH);
+        for (u32 i = 0; i < got; i++) {
+            if (msgs[i].w[0] != done + i || msgs[i].w[1] != done + i + 1)
+                panic("bench: ring completion out of order\n");
+        }
+        done += got;
+
+        if (!pushed && !got)
+            ring_wait(&bench_chan->rings[RING_CQ]);
+    }
+
+    u64 ns = clock_ns() - start;
+    early_printf("bench: ring msgs=%d batch=%d ns=%lu msgs/s=%lu kernel_notifies=%lu\n",
+                 BENCH_RING_MSGS, BENCH_RING_BATCH, ns,
+                 ns ? (u64)BENCH_RING_MSGS * 1000000000ULL / ns : 0, bench_ring_kicks);
+
+    // The server may still be kicking the last completions
+    while (!bench_ring_server_done)
+        sleep(&sched_ticks);
+    if (channel_destroy(bench_chan) < 0)
+        panic("bench: could not tear down channel\n");
+}
+
+#define BENCH_GRANT_PAGES 1024
+#define BENCH_GRANT_SRC_VA 0x10000000ULL
+#define BENCH_GRANT_DST_VA 0x20000000ULL
+
+// Moves a 4MB buffer between two address spaces by copying it, by
+// transferring its frames and by granting them read-only
+static void bench_grant(void) {
+    struct vm_space *a = vm_create();
+    struct vm_space *b = vm_create();
+    if (!a || !b)
+        panic("bench: could not create address spaces\n");
+
+    if (vm_alloc(a, BENCH_GRANT_SRC_VA, BENCH_GRANT_PAGES, PAGE_RW) < 0 ||
+        vm_alloc(b, BENCH_GRANT_DST_VA, BENCH_GRANT_PAGES, PAGE_RW) < 0)
+        panic("bench: could not allocate buffer\n");
+
+    struct proc *p = my_proc();
+    p->vm = a;
+    pushcli();
+    vm_activate(my_cpu(), a);
+    popcli();
+
+    u64 *buf = (u64 *)BENCH_GRANT_SRC_VA;
+    for (size_t i = 0; i < BENCH_GRANT_PAGES * PAGE_SIZE / sizeof(u64); i++)
+        buf[i] = i;
+
+    u64 start = rdtsc();
+    for (size_t i = 0; i < BENCH_GRANT_PAGES; i++)
+        memcpy((void *)p2v(vm_lookup(b, BENCH_GRANT_DST_VA + i * PAGE_SIZE)),
+               (char *)buf + i * PAGE_SIZE, PAGE_SIZE);
+    u64 copy = rdtsc() - start;
+
+    vm_unmap(b, BENCH_GRANT_DST_VA, BENCH_GRANT_PAGES);
+
+    start = rdtsc();
+    if (vm_transfer(a, BENCH_GRANT_SRC_VA, b, BENCH_GRANT_DST_VA, BENCH_GRANT_PAGES) < 0)
+        panic("bench: transfer failed\n");
+    u64 transfer = rdtsc() - start;
+
+    u64 *moved = (u64 *)p2v(vm_lookup(b, BENCH_GRANT_DST_VA + (BENCH_GRANT_PAGES - 1) * PAGE_SIZE));
+    if (vm_lookup(a, BENCH_GRANT_SRC_VA) || moved[0] != (BENCH_GRANT_PAGES - 1) * PAGE_SIZE / sizeof(u64))
+        panic("bench: transfer lost data\n");
+
+    vm_transfer(b, BENCH_GRANT_DST_VA, a, BENCH_GRANT_SRC_VA, BENCH_GRANT_PAGES);
+
+    start = rdtsc();
+    if (vm_grant(a, BENCH_GRANT_SRC_VA, b, BENCH_GRANT_DST_VA, BENCH_GRANT_PAGES, 0) < 0)
+        panic("bench: grant failed\n");
+    u64 grant = rdtsc() - start;
 
-    // Kernel code segment (index 1)
-    gdt_set_entry(SEG_KCODE, 0, 0xFFFFF, 0x9A, 0xAF);
+    if (vm_pte(b, BENCH_GRANT_DST_VA, 0)->entry & PAGE_RW)
+        panic("bench: read-only grant is writable\n");
 
-    // Kernel data segment (index 2)
-    gdt_set_entry(SEG_KDATA, 0, 0xFFFFF, 0x92, 0xAF);
+    start = rdtsc();
+    vm_unmap(b, BENCH_GRANT_DST_VA, BENCH_GRANT_PAGES);
+    u64 revoke = rdtsc() - start;
 
-    // User code segment (index 3)
-    gdt_set_entry(SEG_UCODE, 0, 0xFFFFF, 0xFA, 0xAF);
+    if (buf[1] != 1)
+        panic("bench: revoking a grant freed the owner's frames\n");
 
-    // User data segment (index 4)
-    gdt_set_entry(SEG_UDATA, 0, 0xFFFFF, 0xF2, 0xAF);
+    p->vm = 0;
+    vm_put(a);
+    vm_put(b);
 
-    lgdt(gdt, sizeof(gdt));
-    reset_segment_registers(); // <- this guys a loser
+    early_printf("bench: grant pages=%d copy=%lu transfer=%lu grant_ro=%lu revoke=%lu cycles\n",
+                 BENCH_GRANT_PAGES, copy, transfer, grant, revoke);
 }
 
-static void lapic_write(size_t index, int value) {
-    lapic[index] = value;
-    (void)lapic[APIC_ID];
+#define BENCH_CAP_LOOKUPS 1000000
+#define BENCH_CAP_TREE 128
+
+// Fast-path lookups, then a derivation tree spread over two tables that
+// a single revoke must tear down
+static void bench_cap(void) {
+    struct endpoint *ep = endpoint_create();
+    struct cap_table *other = cap_table_create();
+    if (!ep || !other)
+        panic("bench: could not create cap objects\n");
+
+    s64 root = cap_install(bench_caps, CAP_ENDPOINT, ep, CAP_RIGHTS_ALL);
+    if (root < 0)
+        panic("bench: could not install root cap\n");
+
+    u64 start = rdtsc();
+    for (size_t i = 0; i < BENCH_CAP_LOOKUPS; i++) {
+        if (cap_lookup(bench_caps, root, CAP_ENDPOINT, CAP_RIGHT_SEND, 0) != ep)
+            panic("bench: cap lookup failed\n");
+    }
+    u64 lookup = (rdtsc() - start) / BENCH_CAP_LOOKUPS;
+
+    start = rdtsc();
+    s64 minted = cap_mint(bench_caps, root, other, CAP_RIGHT_SEND | CAP_RIGHT_GRANT, 42);
+    s64 h = minted;
+    for (size_t i = 1; i < BENCH_CAP_TREE; i++) {
+        h = cap_copy(i % 2 ? other : bench_caps, h, i % 2 ? bench_caps : other, CAP_RIGHT_SEND | CAP_RIGHT_GRANT);
+        if (h < 0)
+            panic("bench: cap copy failed\n");
+    }
+    u64 derive = (rdtsc() - start) / BENCH_CAP_TREE;
+
+    u64 badge = 0;
+    if (!cap_lookup(other, minted, CAP_ENDPOINT, CAP_RIGHT_SEND, &badge) || badge != 42)
+        panic("bench: minted cap lost its badge\n");
+    if (cap_lookup(other, minted, CAP_ENDPOINT, CAP_RIGHT_RECV, 0))
+        panic("bench: derived cap gained rights\n");
+
+    start = rdtsc();
+    cap_revoke(bench_caps, root);
+    u64 revoke = rdtsc() - start;
+
+    if (cap_lookup(other, minted, CAP_ENDPOINT, 0, 0) || other->count != 0)
+        panic("bench: revoked caps still usable\n");
+
+    cap_delete(bench_caps, root);
+    if (cap_lookup(bench_caps, root, CAP_ENDPOINT, 0, 0))
+        panic("bench: stale handle still resolves\n");
+
+    early_printf("bench: cap lookup=%lu derive=%lu cycles, revoke of %d caps=%lu cycles\n",
+                 lookup, derive, BENCH_CAP_TREE, revoke);
 }
 
-static u32 lapic_read(size_t index) {
-    return lapic[index];
+#define BENCH_USER_TEXT 0x400000ULL
+#define BENCH_USER_STACK 0x800000ULL
+
+extern char user_bench_start[];
+extern char user_bench_end[];
+
+// A ring 3 thread times null syscalls, reports through an ipc call to us
+// and then faults, which must only kill it
+static void bench_user(void) {
+    struct vm_space *vm = vm_create();
+    struct cap_table *caps = cap_table_create();
+    struct endpoint *ep = endpoint_create();
+    if (!vm || !caps || !ep)
+        panic("bench: could not create user objects\n");
+
+    if (vm_alloc(vm, BENCH_USER_TEXT, 1, 0) < 0 || vm_alloc(vm, BENCH_USER_STACK, 1, PAGE_RW) < 0)
+        panic("bench: could not map user pages\n");
+    memcpy((void *)p2v(vm_lookup(vm, BENCH_USER_TEXT)), user_bench_start, user_bench_end - user_bench_start);
+
+    s64 handle = cap_install(caps, CAP_ENDPOINT, ep, CAP_RIGHT_SEND);
+    if (handle < 0)
+        panic("bench: could not install user endpoint\n");
+
+    // The thread frees both when the fault kills it
+    if (!uthread_create(vm, caps, BENCH_USER_TEXT, BENCH_USER_STACK + PAGE_SIZE, handle))
+        panic("bench: could not create user thread\n");
+    vm_put(vm);
+    cap_table_put(caps);
+
+    struct ipc_msg msg;
+    u64 badge;
+    ipc_reply_wait(ep, &msg, &badge);
+    ipc_reply(&msg);
+
+    early_printf("bench: user null syscall=%lu cycles, time page read=%lu cycles\n", msg.w[0], msg.w[1]);
+
+    u64 user_ns = msg.w[2];
+    u64 ns = time_page_ns(time_page);
+    if (user_ns > ns || clock_ns() < ns)
+        panic("bench: time page disagrees with clock_ns\n");
 }
 
-static void init_lapic(void) {
-    if (!lapic) {
-        panic("No lapic found\n");
-    }
+#define BENCH_IRQ_ISA 7
+#define BENCH_IRQ_SAMPLES BENCH_LATENCY_SAMPLES
 
-    map_page_early(kernel_ptl4, v2p((uintptr_t)lapic), (uintptr_t)lapic, PAGE_P | PAGE_RW);
+static struct irq *bench_irq;
+static volatile size_t bench_irq_count;
 
-    lapic_write(APIC_SVR, APIC_ENABLE | (TRAP_IRQ0 + IRQ_SPURIOUS));
+static void bench_irq_driver(void) {
+    while (bench_irq_count < BENCH_IRQ_SAMPLES) {
+        irq_wait(bench_irq);
+        bench_latency[bench_irq_count] = tsc_to_ns(rdtsc() - bench_irq->raised_tsc);
+        bench_irq_count++;
+        irq_ack(bench_irq);
+    }
+}
 
-    u32 timer_frequency_hz = 1000;
-    u32 lapic_clock_hz = 1000000000;
-    lapic_write(APIC_TDCR, APIC_X1);
-    lapic_write(APIC_TIMER, APIC_PERIODIC | (TRAP_IRQ0 + IRQ_TIMER));
-    lapic_write(APIC_TICR, lapic_clock_hz / timer_frequency_hz);
+// Raises the driver's vector with self IPIs next to CPU-bound threads and
+// records how long each interrupt took to reach the driver thread
+static void bench_irq_latency(void) {
+    bench_irq = irq_bind(isa_irq_gsi(BENCH_IRQ_ISA), 1);
+    if (!bench_irq) {
+        early_printf("bench: isa irq %d unavailable, skipped\n", BENCH_IRQ_ISA);
+        return;
+    }
+    // Self IPIs only ever reach this cpu, keep the device line there too
+    irq_set_affinity(bench_irq, 0);
+
+    bench_hog_stop = 0;
+    bench_hogs_running = BENCH_HOGS;
+    bench_irq_count = 0;
+    for (size_t i = 0; i < BENCH_HOGS; i++) {
+        if (!kthread_create(bench_hog))
+            panic("bench: could not create hog\n");
+    }
+    if (!kthread_create(bench_irq_driver))
+        panic("bench: could not create irq driver\n");
+
+    for (size_t i = 0; i < BENCH_IRQ_SAMPLES; i++) {
+        sleep(&sched_ticks);
+        lapic_write(APIC_ICRLO, APIC_SELF | APIC_FIXED | APIC_ASSERT | bench_irq->vector);
+        while (bench_irq_count == i)
+            yield();
+    }
 
-    lapic_write(APIC_LINT0, APIC_MASKED);
-    lapic_write(APIC_LINT1, APIC_MASKED);
+    bench_hog_stop = 1;
+    while (bench_hogs_running)
+        sleep(&sched_ticks);
 
-    if (((lapic[APIC_VER] >> 16) & 0xFF) >= 4)
-        lapic_write(APIC_PCINT, APIC_MASKED);
+    sort_u64(bench_latency, BENCH_IRQ_SAMPLES);
+    early_printf("bench: irq to driver hogs=%d p50=%luns p99=%luns max=%luns\n",
+                 BENCH_HOGS,
+                 bench_latency[BENCH_IRQ_SAMPLES / 2],
+                 bench_latency[BENCH_IRQ_SAMPLES * 99 / 100],
+                 bench_latency[BENCH_IRQ_SAMPLES - 1]);
+}
 
-    lapic_write(APIC_ERROR, TRAP_IRQ0 + IRQ_ERROR);
+#define BENCH_FUTEX_UNCONTENDED 1000000
+#define BENCH_FUTEX_CONTENDED 10000
+#define BENCH_FUTEX_TIMEOUT_NS 20000000ULL
 
-    lapic_write(APIC_ESR, 0);
-    lapic_write(APIC_ESR, 0);
+static u32 bench_mutex;
+static u64 bench_mutex_counter;
+static volatile int bench_futex_done;
+static u64 bench_futex_calls;
 
-    lapic_write(APIC_EOI, 0);
+// Drepper's three state mutex: 0 free, 1 locked, 2 locked with waiters.
+// Only the contended paths make futex calls.
+static void bench_mutex_lock(u32 *m) {
+    u32 c = 0;
+    if (__atomic_compare_exchange_n(m, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
 
-    lapic_write(APIC_TPR, 0);
+    if (c != 2)
+        c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        bench_futex_calls++;
+        futex_wait((uintptr_t)m, 2, 0);
+        c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+    }
 }
 
-static void init_pic(void) {
-    // Disable
-    outb(0x12, 0xFF);
-    outb(0xA1, 0xFF);
+static void bench_mutex_unlock(u32 *m) {
+    if (__atomic_fetch_sub(m, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(m, 0, __ATOMIC_RELEASE);
+        bench_futex_calls++;
+        futex_wake((uintptr_t)m, 1);
+    }
 }
 
-static int ioapicread(size_t index, u32 reg) {
-    volatile u32 *mmio = ioapics[index].addr;
-    mmio[IOAPIC_IO_REG_SELECT] = reg;
-    return mmio[IOAPIC_IO_DATA];
+static void bench_futex_worker(void) {
+    for (size_t i = 0; i < BENCH_FUTEX_CONTENDED; i++) {
+        bench_mutex_lock(&bench_mutex);
+        bench_mutex_counter++;
+        // Give up the cpu while holding the lock to force contention
+        yield();
+        bench_mutex_unlock(&bench_mutex);
+    }
+    bench_futex_done++;
 }
 
-static void ioapicwrite(size_t index, u32 reg, u32 data) {
-    volatile u32 *mmio = ioapics[index].addr;
-    mmio[IOAPIC_IO_REG_SELECT] = reg;
-    mmio[IOAPIC_IO_DATA] = data;
+static void bench_futex(void) {
+    bench_futex_calls = 0;
+
+    u64 start = rdtsc();
+    for (size_t i = 0; i < BENCH_FUTEX_UNCONTENDED; i++) {
+        bench_mutex_lock(&bench_mutex);
+        bench_mutex_unlock(&bench_mutex);
+    }
+    u64 uncontended = (rdtsc() - start) / BENCH_FUTEX_UNCONTENDED;
+    if (bench_futex_calls)
+        panic("bench: uncontended mutex entered the kernel\n");
+
+    bench_futex_done = 0;
+    bench_mutex_counter = 0;
+    for (size_t i = 0; i < 2; i++) {
+        if (!kthread_create(bench_futex_worker))
+            panic("bench: could not create futex worker\n");
+    }
+    while (bench_futex_done < 2)
+        sleep(&sched_ticks);
+    if (bench_mutex_counter != 2 * BENCH_FUTEX_CONTENDED)
+        panic("bench: futex mutex lost updates\n");
+
+    u32 word = 0;
+    u64 t0 = clock_ns();
+    if (futex_wait((uintptr_t)&word, 0, BENCH_FUTEX_TIMEOUT_NS) != FUTEX_TIMEDOUT)
+        panic("bench: futex wait did not time out\n");
+    u64 waited = clock_ns() - t0;
+
+    early_printf("bench: futex uncontended=%lu cycles contended_calls=%lu timeout=%luns for %luns\n",
+                 uncontended, bench_futex_calls, waited, BENCH_FUTEX_TIMEOUT_NS);
 }
 
-static void init_ioapic(void) {
-    for (size_t i = 0; i < ioapic_count; i++) {
-        map_page_early(kernel_ptl4, v2p((uintptr_t)ioapics[i].addr), (uintptr_t)ioapics[i].addr, PAGE_P | PAGE_RW);
+#define BENCH_BLK_OPS 10000
+#define BENCH_BLK_MAX_DEPTH 32
+#define BENCH_BLK_BLOCK PAGE_SIZE
 
-        u32 id;
-        u32 maxintr;
+static u64 bench_blk_latency[BENCH_BLK_OPS];
 
-        maxintr = (ioapicread(i, IOAPIC_REG_VERSION) >> 16) & 0xFF;
-        id = ioapicread(i, IOAPIC_REG_ID) >> 24;
-        if (id != ioapics[i].id) {
-            continue;
-        }
+static u64 bench_rand(u64 *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
 
-        for (u32 j = 0; j <= maxintr; j++) {
-            ioapicwrite(i, IOAPIC_REG_TABLE + 2 * j, IOAPIC_INT_DISABLED | (TRAP_IRQ0 + j));
-            ioapicwrite(i, IOAPIC_REG_TABLE + 2 * j + 1, 0);
+// fio style random 4K reads at a fixed queue depth. Requests are waited on
+// in submission order, finished ones are resubmitted together and kicked
+// once when the next wait would block.
+static void bench_blk(size_t depth) {
+    struct blk_queue *q = blk_my_queue();
+    struct blk_req reqs[BENCH_BLK_MAX_DEPTH] = { 0 };
+    void *bufs[BENCH_BLK_MAX_DEPTH];
+    int busy[BENCH_BLK_MAX_DEPTH];
+    u64 blocks = virtio_blk.capacity / (BENCH_BLK_BLOCK / VIRTIO_BLK_SECTOR_SIZE);
+    u64 seed = rdtsc() | 1;
+    size_t submitted = 0;
+    size_t completed = 0;
+
+    if (blocks == 0 || depth > BENCH_BLK_MAX_DEPTH || depth * 3 > VIRTQ_SIZE)
+        panic("bench: bad blk setup\n");
+
+    for (size_t i = 0; i < depth; i++)
+        bufs[i] = early_kalloc(0);
+
+    u64 start = rdtsc();
+    for (size_t i = 0; i < depth; i++, submitted++) {
+        u64 sector = bench_rand(&seed) % blocks * (BENCH_BLK_BLOCK / VIRTIO_BLK_SECTOR_SIZE);
+        if (blk_submit(q, 0, sector, bufs[i], BENCH_BLK_BLOCK, &reqs[i]) < 0)
+            panic("bench: blk submit failed\n");
+        busy[i] = 1;
+    }
+
+    for (size_t k = 0; completed < BENCH_BLK_OPS; k = (k + 1) % depth) {
+        struct blk_req *r = &reqs[k];
+        if (!busy[k])
+            continue;
+        if (!r->done)
+            blk_kick(q);
+        blk_wait(q, r);
+
+        if (r->status != VIRTIO_BLK_S_OK)
+            panic("bench: blk read failed\n");
+        bench_blk_latency[completed++] = tsc_to_ns(r->complete_tsc - r->submit_tsc);
+
+        if (submitted < BENCH_BLK_OPS) {
+            u64 sector = bench_rand(&seed) % blocks * (BENCH_BLK_BLOCK / VIRTIO_BLK_SECTOR_SIZE);
+            if (blk_submit(q, 0, sector, bufs[k], BENCH_BLK_BLOCK, r) < 0)
+                panic("bench: blk submit failed\n");
+            submitted++;
+        } else {
+            busy[k] = 0;
         }
     }
-}
+    u64 ns = tsc_to_ns(rdtsc() - start);
 
-static void init_idt(void) {
-    lidt(idt, sizeof(idt));
+    for (size_t i = 0; i < depth; i++)
+        early_kfree(bufs[i], 0);
+
+    sort_u64(bench_blk_latency, BENCH_BLK_OPS);
+    early_printf("bench: blk randread 4k qd=%lu iops=%lu p50=%luns p99=%luns max=%luns poll=%luns\n",
+                 depth, BENCH_BLK_OPS * 1000000000ULL / ns,
+                 bench_blk_latency[BENCH_BLK_OPS / 2],
+                 bench_blk_latency[BENCH_BLK_OPS * 99 / 100],
+                 bench_blk_latency[BENCH_BLK_OPS - 1], q->poll_ns);
 }
 
-#define set_gate(gate, istrap, sel, off, d)                             \
-    {                                                                   \
-        (gate).off_15_0 = (uintptr_t)(off) & 0xffff;                    \
-        (gate).cs = (sel);                                              \
-        (gate).args = 0;                                                \
-        (gate).rsv1 = 0;                                                \
-        (gate).type = (istrap) ? STS_TG64 : STS_IG64;                   \
-        (gate).s = 0;                                                   \
-        (gate).dpl = (d);                                               \
-        (gate).p = 1;                                                   \
-        (gate).off_31_16 = (uintptr_t)(off) >> 16 & 0xffff;             \
-        (gate).off_32_63 = (uintptr_t)(off) >> 32 & 0xffffffff;         \
+#define BENCH_CACHE_BYTES (8ULL << 20)
+#define BENCH_CACHE_CHUNK_ORDER 4
+
+// Sequential 64K reads cold and then hot, then the same range written
+// back with its own contents so the disk is left as it was
+static void bench_cache(void) {
+    struct page_cache *cache = &virtio_blk.cache;
+    size_t chunk = PAGE_SIZE << BENCH_CACHE_CHUNK_ORDER;
+    u64 bytes = BENCH_CACHE_BYTES;
+    if (bytes > virtio_blk.capacity * VIRTIO_BLK_SECTOR_SIZE)
+        bytes = virtio_blk.capacity * VIRTIO_BLK_SECTOR_SIZE / chunk * chunk;
+    void *buf = early_kalloc(BENCH_CACHE_CHUNK_ORDER);
+
+    for (int pass = 0; pass < 2; pass++) {
+        u64 misses = cache->misses;
+        u64 ra = cache->ra_pages;
+        u64 start = rdtsc();
+        for (u64 off = 0; off < bytes; off += chunk) {
+            if (cache_read(cache, off, buf, chunk) < 0)
+                panic("bench: cache read failed\n");
+        }
+        u64 ns = tsc_to_ns(rdtsc() - start);
+
+        early_printf("bench: cache %s read %luMB/s misses=%lu readahead=%lu pages\n", pass ? "hot" : "cold",
+                     bytes * 1000 / ns, cache->misses - misses, cache->ra_pages - ra);
     }
 
-static void init_tv(void) {
-    for (size_t i = 0; i < INTERRUPT_COUNT; i++)
-        set_gate(idt[i], 0, SEG_KCODE << 3, trap_vectors[i], 0);
-    set_gate(idt[TRAP_SYSCALL], 1, SEG_KCODE << 3, trap_vectors[TRAP_SYSCALL], DPL_USER);
-}
+    u64 wb_reqs = cache->wb_reqs;
+    u64 wb_pages = cache->wb_pages;
+    u64 start = rdtsc();
+    for (u64 off = 0; off < bytes; off += chunk) {
+        if (cache_read(cache, off, buf, chunk) < 0 || cache_write(cache, off, buf, chunk) < 0)
+            panic("bench: cache rewrite failed\n");
+    }
+    cache_sync(cache);
+    u64 ns = tsc_to_ns(rdtsc() - start);
 
-static void lapic_eoi(void) {
-    if (lapic)
-        lapic_write(APIC_EOI, 0);
+    early_kfree(buf, BENCH_CACHE_CHUNK_ORDER);
+    early_printf("bench: cache rewrite+sync %luMB/s, %lu pages in %lu requests\n",
+                 bytes * 1000 / ns, cache->wb_pages - wb_pages, cache->wb_reqs - wb_reqs);
 }
 
-static void print_tf(struct trap_frame *tf) {
-    early_printf("r15: %lx\n", tf->r15);
-    early_printf("r14: %lx\n", tf->r14);
-    early_printf("r13: %lx\n", tf->r13);
-    early_printf("r12: %lx\n", tf->r12);
-    early_printf("r11: %lx\n", tf->r11);
-    early_printf("r10: %lx\n", tf->r10);
-    early_printf("r9: %lx\n", tf->r9);
-    early_printf("r8: %lx\n", tf->r8);
-    early_printf("rdi: %lx\n", tf->rdi);
-    early_printf("rsi: %lx\n", tf->rsi);
-    early_printf("rbp: %lx\n", tf->rbp);
-    early_printf("rbx: %lx\n", tf->rbx);
-    early_printf("rdx: %lx\n", tf->rdx);
-    early_printf("rcx: %lx\n", tf->rcx);
-    early_printf("rax: %lx\n", tf->rax);
-    early_printf("vector: %lx\n", tf->vector);
-    early_printf("error: %lx\n", tf->error);
-    early_printf("rip: %lx\n", tf->rip);
-    early_printf("cs: %lx\n", tf->cs);
-    early_printf("rflags: %lx\n", tf->rflags);
-    early_printf("rsp: %lx\n", tf->rsp);
-    early_printf("ss: %lx\n", tf->ss);
-}
+#define BENCH_NET_PINGS BENCH_LATENCY_SAMPLES
+#define BENCH_NET_BURST 100000
+#define BENCH_NET_TIMEOUT_NS 100000000ULL
+#define BENCH_NET_FRAME 60
+#define BENCH_NET_VA 0x10000000ULL
+
+// QEMU user networking: we are 10.0.2.15 and the gateway 10.0.2.2
+static const u8 bench_net_ip[4] = { 10, 0, 2, 15 };
+static const u8 bench_net_gw_ip[4] = { 10, 0, 2, 2 };
+static u8 bench_net_gw_mac[6];
+static u16 bench_net_tx[NET_TX_GRANT];
+static size_t bench_net_tx_count;
+
+// Plays the network server of queue 0 through kernel pointers. Keeps
+// returned send buffers, gives rx buffers straight back and says whether
+// an arp reply came in.
+static int bench_net_drain(struct net_queue *q) {
+    struct ipc_msg msgs[NET_BUDGET];
+    struct ipc_msg frees[NET_BUDGET];
+    u32 n = ring_pop(&q->ch->rings[RING_CQ], msgs, NET_BUDGET);
+    u32 nfree = 0;
+    int reply = 0;
+
+    for (u32 i = 0; i < n; i++) {
+        if (msgs[i].w[0] == NET_MSG_TX_DONE) {
+            bench_net_tx[bench_net_tx_count++] = msgs[i].w[1];
+            continue;
+        }
 
-static struct proc *my_proc(void) {
-    return current_proc;
+        u8 *frame = (u8 *)q->bufs[msgs[i].w[1]] + NET_FRAME_OFFSET;
+        if (msgs[i].w[2] >= 42 && frame[12] == 0x08 && frame[13] == 0x06 && frame[21] == 2 &&
+            !memcmp(frame + 28, bench_net_gw_ip, 4)) {
+            memcpy(bench_net_gw_mac, frame + 22, 6);
+            reply = 1;
+        }
+        frees[nfree].w[0] = NET_MSG_FREE;
+        frees[nfree].w[1] = msgs[i].w[1];
+        nfree++;
+    }
+
+    for (u32 pushed = 0; pushed < nfree;) {
+        pushed += ring_push(&q->ch->rings[RING_SQ], frees + pushed, nfree - pushed);
+        ring_kick(&q->ch->rings[RING_SQ]);
+    }
+    return reply;
 }
 
-static void kthread_create(void (* fn)()) {
-    for (struct proc *p = proc_table; p < &proc_table[PROC_COUNT]; p++) {
-        if (p->state != PROC_DEAD)
-            continue;
+static void bench_net_send(struct net_queue *q, const u8 *frame, u64 flags) {
+    while (!bench_net_tx_count) {
+        ring_kick(&q->ch->rings[RING_SQ]);
+        yield();
+        bench_net_drain(q);
+    }
 
-        cli();
+    struct ipc_msg msg = { { NET_MSG_TX, bench_net_tx[--bench_net_tx_count], BENCH_NET_FRAME, flags } };
+    memcpy((u8 *)q->bufs[msg.w[1]] + NET_FRAME_OFFSET, frame, BENCH_NET_FRAME);
+    while (!ring_push(&q->ch->rings[RING_SQ], &msg, 1)) {
+        ring_kick(&q->ch->rings[RING_SQ]);
+        yield();
+    }
+}
 
-        memset(&p->context, 0, sizeof(struct context));
+// Arp who-has for the gateway, answered by QEMU itself, so the round trip
+// is our tx, rx and poll path plus the host's
+static void bench_net_arp(u8 *f) {
+    memset(f, 0, BENCH_NET_FRAME);
+    memset(f, 0xFF, 6);
+    memcpy(f + 6, virtio_net.mac, 6);
+    f[12] = 0x08;
+    f[13] = 0x06;
+    f[15] = 1;
+    f[16] = 0x08;
+    f[18] = 6;
+    f[19] = 4;
+    f[21] = 1;
+    memcpy(f + 22, virtio_net.mac, 6);
+    memcpy(f + 28, bench_net_ip, 4);
+    memcpy(f + 38, bench_net_gw_ip, 4);
+}
 
-        p->state = PROC_RUNNABLE;
-        p->channel = NULL;
-        p->stack = early_kalloc(KSTACK_ORDER);
+// Udp to the discard port, the checksum left to net_tx
+static u64 bench_net_udp(u8 *f) {
+    memset(f, 0, BENCH_NET_FRAME);
+    memcpy(f, bench_net_gw_mac, 6);
+    memcpy(f + 6, virtio_net.mac, 6);
+    f[12] = 0x08;
+
+    u8 *ip = f + 14;
+    ip[0] = 0x45;
+    ip[3] = BENCH_NET_FRAME - 14;
+    ip[8] = 64;
+    ip[9] = 17;
+    memcpy(ip + 12, bench_net_ip, 4);
+    memcpy(ip + 16, bench_net_gw_ip, 4);
+    u16 sum = net_csum(ip, 20, 0);
+    ip[10] = sum >> 8;
+    ip[11] = sum;
+
+    u8 *udp = ip + 20;
+    u16 len = BENCH_NET_FRAME - 34;
+    udp[0] = 0x30;
+    udp[1] = 0x39;
+    udp[3] = 9;
+    udp[5] = len;
+    u8 pseudo[12] = { 0 };
+    memcpy(pseudo, ip + 12, 8);
+    pseudo[9] = 17;
+    pseudo[11] = len;
+    sum = ~net_csum(pseudo, sizeof(pseudo), 0);
+    udp[6] = sum >> 8;
+    udp[7] = sum;
+
+    return NET_TX_CSUM | 34 | 6 << 16;
+}
 
-        uintptr_t *sp = (uintptr_t *)((char *)p->stack + KSTACK_SIZE);
-        *--sp = (uintptr_t)fn;
-        p->context.rsp = (uintptr_t)sp;
+static void bench_net(void) {
+    struct net_queue *q = &virtio_net.queues[0];
+    u8 frame[BENCH_NET_FRAME];
+    u64 timeout = BENCH_NET_TIMEOUT_NS * tsc_khz / 1000000;
+    size_t replies = 0;
+
+    // A server's view of the queue, dropped again. The kernel's references
+    // keep the pages for the bench, which serves the queue itself.
+    struct vm_space *vm = vm_create();
+    if (!vm || net_attach(q, vm, BENCH_NET_VA) < 0 ||
+        vm_lookup(vm, BENCH_NET_VA) != v2p((uintptr_t)q->bufs[0]) ||
+        vm_lookup(vm, BENCH_NET_VA + NET_BUFS * PAGE_SIZE) != v2p((uintptr_t)q->ch->ctl))
+        panic("bench: net_attach mapped the wrong pages\n");
+    vm_put(vm);
+
+    bench_net_arp(frame);
+    for (size_t i = 0; i < BENCH_NET_PINGS; i++) {
+        u64 start = rdtsc();
+        bench_net_send(q, frame, 0);
+        ring_kick(&q->ch->rings[RING_SQ]);
+
+        int reply;
+        while (!(reply = bench_net_drain(q)) && rdtsc() - start < timeout)
+            yield();
+        if (reply)
+            bench_latency[replies++] = tsc_to_ns(rdtsc() - start);
+    }
 
-        sti();
+    if (!replies) {
+        early_printf("bench: net got no arp reply, skipped\n");
         return;
     }
-}
-
-static void scheduler() {
-    sti();
+    sort_u64(bench_latency, replies);
+    early_printf("bench: net arp rtt p50=%luns p99=%luns max=%luns lost=%lu\n",
+                 bench_latency[replies / 2], bench_latency[replies * 99 / 100],
+                 bench_latency[replies - 1], BENCH_NET_PINGS - replies);
+
+    u64 flags = bench_net_udp(frame);
+    u64 polls = q->polls;
+    u64 sleeps = q->sleeps;
+    u64 start = rdtsc();
+    for (size_t i = 0; i < BENCH_NET_BURST; i++) {
+        bench_net_send(q, frame, flags);
+        if (i % NET_BUDGET == NET_BUDGET - 1)
+            ring_kick(&q->ch->rings[RING_SQ]);
+    }
+    while (bench_net_tx_count < NET_TX_GRANT) {
+        ring_kick(&q->ch->rings[RING_SQ]);
+        yield();
+        bench_net_drain(q);
+    }
+    u64 ns = tsc_to_ns(rdtsc() - start);
 
-    for (;;) {
-        pushcli();
+    early_printf("bench: net udp tx %lu pps, %lu poll rounds, %lu sleeps\n",
+                 BENCH_NET_BURST * 1000000000ULL / ns, q->polls - polls, q->sleeps - sleeps);
+}
 
-        for (struct proc *p = proc_table; p < &proc_table[PROC_COUNT]; p++) {
-            if (p->state != PROC_RUNNABLE)
+#define BENCH_INITRD_VA 0x10000000ULL
+#define BENCH_INITRD_COPY_ORDER 4
+
+// Maps every initrd file into one address space and compares that with
+// copying the same bytes
+static void bench_initrd(void) {
+    struct vm_space *vm = vm_create();
+    if (!vm)
+        panic("bench: could not create vm\n");
+
+    size_t chunk = PAGE_SIZE << BENCH_INITRD_COPY_ORDER;
+    void *buf = early_kalloc(BENCH_INITRD_COPY_ORDER);
+    uintptr_t va = BENCH_INITRD_VA;
+    u64 bytes = 0;
+    u64 map_cycles = 0;
+    u64 copy_cycles = 0;
+
+    for (size_t i = 0; i < INITRD_HASH_SIZE; i++) {
+        for (struct list *l = initrd_table[i].next; l != &initrd_table[i]; l = l->next) {
+            struct initrd_file *f = container_of(l, struct initrd_file, node);
+            if (!f->size)
                 continue;
 
-            current_proc = p;
-            p->state = PROC_RUNNING;
+            u64 start = rdtsc();
+            if (initrd_map(vm, va, f) < 0)
+                panic("bench: initrd map failed\n");
+            map_cycles += rdtsc() - start;
 
-            switch_proc(&scheduler_context, &p->context);
+            start = rdtsc();
+            for (size_t off = 0; off < f->size; off += chunk)
+                memcpy(buf, f->data + off, f->size - off < chunk ? f->size - off : chunk);
+            copy_cycles += rdtsc() - start;
 
-            current_proc = 0;
+            va += page_round_up(initrd_page_offset(f) + f->size);
+            bytes += f->size;
         }
-
-        popcli();
     }
+
+    vm_put(vm);
+    early_kfree(buf, BENCH_INITRD_COPY_ORDER);
+    early_printf("bench: initrd %lu files %luKB mapped in %luns, copying would take %luns\n",
+                 initrd_file_count, bytes >> 10, tsc_to_ns(map_cycles), tsc_to_ns(copy_cycles));
 }
 
-static void _wake_up(void *channel) {
-    for (struct proc *p = proc_table; p < &proc_table[PROC_COUNT]; p++) {
-        if (p->state == PROC_SLEEPING && p->channel == channel)
-            p->state = PROC_RUNNABLE;
+#define BENCH_ELF_INSTANCES 8
+
+// Loads init, or else the first ELF in the initrd, several times, then
+// touches all of every instance to see that read only pages are shared
+static void bench_elf(void) {
+    struct initrd_file *f = initrd_find(INIT_NAME);
+    for (size_t i = 0; i < INITRD_HASH_SIZE && !f; i++) {
+        for (struct list *l = initrd_table[i].next; l != &initrd_table[i]; l = l->next) {
+            struct initrd_file *g = container_of(l, struct initrd_file, node);
+            if (g->size >= sizeof(struct elf64_ehdr) && !memcmp(g->data, ELF_MAGIC, 4)) {
+                f = g;
+                break;
+            }
+        }
+    }
+    if (!f) {
+        early_printf("bench: no ELF in the initrd, skipped\n");
+        return;
     }
-}
 
-static void wake_up(void *channel) {
+    struct vm_space *vms[BENCH_ELF_INSTANCES];
+    u64 load_cycles = 0;
+    for (size_t i = 0; i < BENCH_ELF_INSTANCES; i++) {
+        vms[i] = vm_create();
+        if (!vms[i])
+            panic("bench: could not create vm\n");
+
+        u64 start = rdtsc();
+        if (!elf_load(vms[i], f)) {
+            early_printf("bench: ELF is not loadable, skipped\n");
+            for (size_t j = 0; j <= i; j++)
+                vm_put(vms[j]);
+            return;
+        }
+        load_cycles += rdtsc() - start;
+    }
+
+    size_t pages = 0;
+    size_t shared = 0;
+    u64 start = rdtsc();
     pushcli();
-    _wake_up(channel);
+    for (struct list *l = vms[0]->areas.next; l != &vms[0]->areas; l = l->next) {
+        struct vm_area *a = container_of(l, struct vm_area, node);
+        for (uintptr_t va = a->start; va < a->end; va += PAGE_SIZE) {
+            for (size_t i = 0; i < BENCH_ELF_INSTANCES; i++) {
+                if (vm_fault(vms[i], va, 0) < 0)
+                    panic("bench: ELF fault failed\n");
+            }
+            pages++;
+            if (vm_lookup(vms[0], va) == vm_lookup(vms[BENCH_ELF_INSTANCES - 1], va))
+                shared++;
+        }
+    }
     popcli();
-}
+    u64 fault_cycles = rdtsc() - start;
 
-static void sched(void) {
-    struct proc *p = my_proc();
+    for (size_t i = 0; i < BENCH_ELF_INSTANCES; i++)
+        vm_put(vms[i]);
 
-    if (cli_count != 1)
-        panic("cli_count != 1 in sched\n");
-    if (p->state == PROC_RUNNING)
-        panic("process already running in sched\n");
-    if (readrflags() & RFLAG_IF)
-        panic("sched is interruptable\n");
-    int int_enabled = interrupts_enabled;
-    switch_proc(&p->context, &scheduler_context);
-    interrupts_enabled = int_enabled;
+    early_printf("bench: elf load %luns, %lu pages faulted in %luns each, %lu of %lu shared\n",
+                 tsc_to_ns(load_cycles / BENCH_ELF_INSTANCES), pages,
+                 tsc_to_ns(fault_cycles / (pages * BENCH_ELF_INSTANCES + 1)), shared, pages);
 }
 
-static void exit(void) {
-    pushcli();
-    my_proc()->state = PROC_DEAD;
-    sched();
-    panic("dead process exit\n");
-}
+static void bench_main(void) {
+    bench_caps = cap_table_create();
+    if (!bench_caps)
+        panic("bench: could not create cap table\n");
+    my_proc()->caps = bench_caps;
+    cap_table_get(bench_caps);
 
-static void yield(void) {
-    pushcli();
-    my_proc()->state = PROC_RUNNABLE;
-    sched();
-    popcli();
-}
+    bench_micro();
 
-void trap(struct trap_frame *tf) {
-    switch (tf->vector) {
-        case TRAP_ILLEGAL_OPCODE:
-            panic("Illegal Opcode!\n");
-        case TRAP_DOUBLE_FAULT:
-            panic("Double Fault!\n");
-        case TRAP_SEGMENT_NOT_PRESENT:
-            panic("Segment Not Present!\n");
-        case TRAP_STACK:
-            panic("Stack!\n");
-        case TRAP_GENERAL_PROTECTION_FAULT:
-            panic("General Protection Fault!\n");
-        case TRAP_PAGE_FAULT:
-            panic("Page Fault!\n");
-        case TRAP_IRQ0 + IRQ_TIMER:
-            sched_ticks++;
-            wake_up(&sched_ticks);
-            lapic_eoi();
-            break;
-        default:
-            panic("Unexpected trap!\n");
+    bench_switch(0);
+    bench_switch(1);
+    sched_direct_switch = 1;
+
+    bench_fair_latency(0);
+    bench_fair_latency(1);
+
+    bench_deadline();
+
+    bench_ipc(0);
+    bench_ipc(1);
+
+    bench_cap();
+
+    bench_ring();
+
+    bench_grant();
+
+    bench_user();
+
+    bench_irq_latency();
+
+    bench_futex();
+
+    if (virtio_blk.ready) {
+        bench_blk(1);
+        bench_blk(BENCH_BLK_MAX_DEPTH);
+        bench_cache();
+    } else {
+        early_printf("bench: no virtio-blk disk, skipped\n");
     }
 
-    if(my_proc() && my_proc()->state == PROC_RUNNING && tf->vector == TRAP_IRQ0 + IRQ_TIMER) {
-        // TODO: Bug
-        early_printf("HERE\n");
-        yield();
+    if (initrd_file_count) {
+        bench_initrd();
+        bench_elf();
+    } else {
+        early_printf("bench: no initrd, skipped\n");
     }
-}
 
-static void thread1(void) {
-    popcli();
-    for (;;)
-        early_printf("thread1!\n");
-    panic("Should not have left the loop\n");
-}
+    if (virtio_net.ready)
+        bench_net();
+    else
+        early_printf("bench: no virtio-net device, skipped\n");
 
-static void thread2(void) {
-    popcli();
-    for (;;)
-        early_printf("thread2!\n");
-    panic("Should not have left the loop\n");
+    print_idle_stats();
+    print_latency_stats();
+
+    early_printf("bench: done\n");
+    outb(QEMU_EXIT_PORT, 0);
 }
+#endif
 
 static __attribute__((noreturn)) void mp_main(void) {
     init_idt();
 
-    kthread_create(thread1);
-    kthread_create(thread2);
+#ifdef BENCH
+    if (!kthread_create(bench_main))
+        panic("Could not create benchmark thread\n");
+#else
+    // Nothing runs before scheduler(), so init sees its grants from its
+    // first instruction
+    if (!spawn_init() && (!kthread_create(thread1) || !kthread_create(thread2)))
+        panic("Could not create initial threads\n");
+#endif
 
     scheduler();
 
     hcf();
 }
 
+static __attribute__((noreturn)) void boot_late(void) {
+    reclaim_boot_memory();
+    boot_mark("reclaim");
+
+    print_boot_phases();
+    mp_main();
+}
+
 static void ap_enter(void) {
     mp_main();
 }
 
 void kmain(void) {
+    boot_mark("entry");
     init_serial();
 
     validate_bootloader();
@@ -1425,16 +8812,43 @@ void kmain(void) {
     load_memmap();
     load_hhdm();
     load_apic();
+    load_executable_address();
+    load_modules();
+    boot_mark("bootloader info");
 
     free_usable_regions();
+    boot_mark("free lists");
 
 //    init_mp();
     init_paging();
+    boot_mark("paging");
+    init_vm();
+    boot_mark("frame refs");
+    init_initrd();
+    boot_mark("initrd");
     init_lapic();
     init_gdt();
     init_pic();
     init_ioapic();
+    boot_mark("cpu and interrupts");
+    init_pci();
+    boot_mark("pci");
     init_tv();
-
-    mp_main();
+    calibrate_tsc();
+    boot_mark("tsc calibration");
+    init_time_page();
+    init_sched();
+    init_irq_balance();
+    boot_mark("scheduler");
+    init_virtio_blk();
+    init_page_cache();
+    boot_mark("virtio-blk");
+    init_ipc();
+    init_virtio_net();
+    boot_mark("virtio-net");
+
+    // The boot stack is bootloader reclaimable memory
+    uintptr_t stack = (uintptr_t)early_kalloc(BOOT_STACK_ORDER) + (PAGE_SIZE << BOOT_STACK_ORDER);
+    asm volatile ("mov %0, %%rsp\n\tcall *%1" : : "r"(stack), "r"(boot_late) : "memory");
+    __builtin_unreachable();
 }
@@ -0,0 +1,266 @@
+// Buddy page allocator and page table walker.
+//
+// Kept apart from main.c so the same code also builds as a hosted Linux
+// program, see kernel/hosted. The includer provides the u64/u32/u8
+// typedefs, memset and a panic() that does not return. hhdm is the offset
+// of the direct map; in a hosted build it points at a simulated physical
+// memory arena.
+
+#ifndef MM_H
+#define MM_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_ORDER 10
+
+#define PAGE_SIZE 4096
+
+#define PTL4_ENTRY_COUNT 512
+#define PTL3_ENTRY_COUNT 512
+#define PTL2_ENTRY_COUNT 512
+#define PTL1_ENTRY_COUNT 512
+
+#define PAGE_P (1ULL << 0)
+#define PAGE_RW (1ULL << 1)
+#define PAGE_U (1ULL << 2)
+#define PAGE_PS (1ULL << 7)
+#define PAGE_COW (1ULL << 9) // software bit: shared until the first write
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+typedef struct {
+    u64 entry;
+} ptl1e_t;
+
+typedef struct {
+    u64 entry;
+} ptl2e_t;
+
+typedef struct {
+    u64 entry;
+} ptl3e_t;
+
+typedef struct {
+    u64 entry;
+} ptl4e_t;
+
+typedef struct {
+    ptl1e_t table[PTL1_ENTRY_COUNT];
+} __attribute__((aligned(PAGE_SIZE))) ptl1_t;
+
+typedef struct {
+    ptl2e_t table[PTL2_ENTRY_COUNT];
+} __attribute__((aligned(PAGE_SIZE))) ptl2_t;
+
+typedef struct {
+    ptl3e_t table[PTL3_ENTRY_COUNT];
+} __attribute__((aligned(PAGE_SIZE))) ptl3_t;
+
+typedef struct {
+    ptl4e_t table[PTL4_ENTRY_COUNT];
+} __attribute__((aligned(PAGE_SIZE))) ptl4_t;
+
+struct free_list_node {
+    struct free_list_node *next;
+};
+
+static uintptr_t hhdm;
+
+static struct free_list_node *free_list[MAX_ORDER + 1];
+
+static uintptr_t p2v(uintptr_t phys) {
+    return phys + hhdm;
+}
+
+static uintptr_t v2p(uintptr_t virt) {
+    return virt - hhdm;
+}
+
+static size_t page_round_up(uintptr_t addr) {
+    return (addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static size_t page_round_down(uintptr_t addr) {
+    return addr & ~(PAGE_SIZE - 1);
+}
+
+static void early_kfree(void *addr, size_t order) {
+    if ((size_t)addr % PAGE_SIZE != 0) {
+        panic("Attempted to free unaligned page\n");
+    }
+
+    struct free_list_node *n = (struct free_list_node *)addr;
+
+    // Nothing to merge with, so no need to walk what may be every block of
+    // memory at boot
+    if (order == MAX_ORDER) {
+        n->next = free_list[order];
+        free_list[order] = n;
+        return;
+    }
+    n->next = 0;
+
+    struct free_list_node **pcurr = &free_list[order];
+    struct free_list_node *curr = free_list[order];
+
+    while (curr) {
+        if (order < MAX_ORDER) {
+            uintptr_t buddy = (uintptr_t)n ^ (PAGE_SIZE << order);
+            if ((uintptr_t)curr == buddy) {
+                *pcurr = curr->next;
+
+                void *block;
+                if (n < curr)
+                    block = n;
+                else
+                    block = curr;
+
+                early_kfree(block, order + 1);
+                return;
+            }
+        }
+
+        pcurr = &curr->next;
+        curr = curr->next;
+    }
+
+    n->next = *pcurr;
+    *pcurr = n;
+}
+
+static void free_range(void *base, void *end) {
+    size_t p = page_round_up((uintptr_t)base);
+    size_t e = page_round_down((uintptr_t)end);
+
+    while (p < e) {
+        size_t remaining = e - p;
+        size_t order = MAX_ORDER;
+
+        while (order > 0 && ((size_t)PAGE_SIZE << order > remaining || (p & (((size_t)PAGE_SIZE << order) - 1)) != 0))
+            order--;
+
+        early_kfree((void *)p, order);
+        p += PAGE_SIZE << order;
+    }
+}
+
+static void *try_early_kalloc(size_t order) {
+    if (order > MAX_ORDER) {
+        panic("Invalid order for early_kalloc\n");
+    }
+
+    struct free_list_node **pcurr = &free_list[order];
+    struct free_list_node *curr = free_list[order];
+
+    if (curr) {
+        *pcurr = curr->next;
+        memset(curr, 0, PAGE_SIZE << order);
+
+        return (void *)curr;
+    }
+
+    for (size_t higher = order + 1; higher <= MAX_ORDER; higher++) {
+        struct free_list_node **phigh = &free_list[higher];
+        struct free_list_node *high_curr = free_list[higher];
+
+        if (high_curr) {
+            *phigh = high_curr->next;
+
+            while (higher > order) {
+                higher--;
+
+                struct free_list_node *buddy = (struct free_list_node *)((uintptr_t)high_curr + (PAGE_SIZE << higher));
+
+                buddy->next = free_list[higher];
+                free_list[higher] = buddy;
+            }
+
+            memset(high_curr, 0, PAGE_SIZE << order);
+
+            return (void *)high_curr;
+        }
+    }
+
+    return 0;
+}
+
+static void *early_kalloc(size_t order) {
+    void *block = try_early_kalloc(order);
+    if (!block)
+        panic("Could not find suitable block for early_kalloc\n");
+    return block;
+}
+
+static ptl3_t *walk_ptl4(ptl4_t *ptl4, size_t index, int create) {
+    if (!(ptl4->table[index].entry & PAGE_P)) {
+        if (!create)
+            return 0;
+
+        void *new_page = try_early_kalloc(0);
+        if (!new_page)
+            return 0;
+        ptl4->table[index].entry = v2p((uintptr_t)new_page) | PAGE_P | PAGE_RW;
+    }
+
+    return (ptl3_t *)p2v(ptl4->table[index].entry & ~0xFFF);
+}
+
+static ptl2_t *walk_ptl3(ptl3_t *ptl3, size_t index, int create) {
+    if (!(ptl3->table[index].entry & PAGE_P)) {
+        if (!create)
+            return 0;
+
+        void *new_page = try_early_kalloc(0);
+        if (!new_page)
+            return 0;
+        ptl3->table[index].entry = v2p((uintptr_t)new_page) | PAGE_P | PAGE_RW;
+    }
+
+    return (ptl2_t *)p2v(ptl3->table[index].entry & ~0xFFF);
+}
+
+static ptl1_t *walk_ptl2(ptl2_t *ptl2, size_t index, int create) {
+    if (!(ptl2->table[index].entry & PAGE_P)) {
+        if (!create)
+            return 0;
+
+        void *new_page = try_early_kalloc(0);
+        if (!new_page)
+            return 0;
+        ptl2->table[index].entry = v2p((uintptr_t)new_page) | PAGE_P | PAGE_RW;
+    }
+
+    return (ptl1_t *)p2v(ptl2->table[index].entry & ~0xFFF);
+}
+
+static void map_page_early(ptl4_t *l4, uintptr_t pa, uintptr_t va, uintptr_t flags) {
+    uintptr_t l4_index = (va >> 39) & 0x1FF;
+    uintptr_t l3_index = (va >> 30) & 0x1FF;
+    uintptr_t l2_index = (va >> 21) & 0x1FF;
+    uintptr_t l1_index = (va >> 12) & 0x1FF;
+
+    ptl3_t *l3 = walk_ptl4(l4, l4_index, 1);
+    ptl2_t *l2 = l3 ? walk_ptl3(l3, l3_index, 1) : 0;
+    ptl1_t *l1 = l2 ? walk_ptl2(l2, l2_index, 1) : 0;
+    if (!l1)
+        panic("Out of memory for page tables\n");
+
+    l1->table[l1_index].entry = (pa & ~0xFFF) | (flags & 0xFFF);
+}
+
+// Walks down once per page table rather than once per page
+static void map_range_early(ptl4_t *l4, uintptr_t pa, uintptr_t va, size_t size, uintptr_t flags) {
+    for (size_t off = 0; off < size;) {
+        uintptr_t v = va + off;
+        ptl3_t *l3 = walk_ptl4(l4, (v >> 39) & 0x1FF, 1);
+        ptl2_t *l2 = l3 ? walk_ptl3(l3, (v >> 30) & 0x1FF, 1) : 0;
+        ptl1_t *l1 = l2 ? walk_ptl2(l2, (v >> 21) & 0x1FF, 1) : 0;
+        if (!l1)
+            panic("Out of memory for page tables\n");
+
+        for (size_t i = (v >> 12) & 0x1FF; i < PTL1_ENTRY_COUNT && off < size; i++, off += PAGE_SIZE)
+            l1->table[i].entry = ((pa + off) & ~0xFFF) | (flags & 0xFFF);
+    }
+}
+
+#endif
@@ -34,3 +34,19 @@ switch_proc:
     mov rsp, [rax + 0x30]
 
     ret
+
+.global kthread_entry
+.type kthread_entry, @function
+kthread_entry:
+    # First return target of a new thread, r12 = entry point
+    mov rdi, r12
+    call kthread_start
+    ud2
+
+.global uthread_entry
+.type uthread_entry, @function
+uthread_entry:
+    # First return target of a new user thread, the trap frame that enters
+    # ring 3 sits right above us on the stack
+    call uthread_start
+    jmp trap_return
@@ -21,7 +21,12 @@ isr_common:
     
     mov rdi, rsp          # arg0 = trap frame pointer
     call trap
-    
+
+    mov rdi, rsp          # preempt here if trap() asked for a reschedule
+    call trap_exit
+
+.global trap_return
+trap_return:
     pop r15
     pop r14
     pop r13
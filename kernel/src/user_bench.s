@@ -0,0 +1,78 @@
+.intel_syntax noprefix
+
+# Ring 3 side of the user mode benchmark, copied into a user page so it
+# has to be position independent. Entered with rdi = endpoint handle.
+# Times null syscalls and clock reads through the time page, sends the
+# averages and the last reading through an ipc call and faults.
+
+.set TIME_PAGE_VA, 0x7FFFFFFFF000
+.set TIME_PAGE_NS_MULT, 16
+.set TIME_PAGE_BOOT_TSC, 24
+
+.global user_bench_start
+.global user_bench_end
+
+user_bench_start:
+    mov r12, rdi
+    mov r13, 100000
+    mov r14, r13
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r15, rax
+
+1:
+    mov rax, -1           # no such syscall, returns straight away
+    int 0x40
+    dec r14
+    jnz 1b
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r15
+    xor edx, edx
+    div r13
+    mov r14, rax
+
+    movabs rbx, TIME_PAGE_VA
+    mov r9, r13
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r15, rax
+
+2:
+    mov r11d, dword ptr [rbx]   # seq, odd while the kernel updates
+    test r11d, 1
+    jnz 2b
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, [rbx + TIME_PAGE_BOOT_TSC]
+    mul qword ptr [rbx + TIME_PAGE_NS_MULT]
+    shrd rax, rdx, 32
+    cmp r11d, dword ptr [rbx]
+    jne 2b
+    mov r10, rax
+    dec r9
+    jnz 2b
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r15
+    xor edx, edx
+    div r13
+
+    mov rsi, r14          # msg.w[0] = cycles per syscall
+    mov rdx, rax          # msg.w[1] = cycles per clock read
+    mov r8, r10           # msg.w[2] = last clock read in ns
+    mov rdi, r12
+    xor eax, eax          # SYS_IPC_CALL
+    int 0x40
+
+    ud2
+user_bench_end: